@@ -95,15 +95,12 @@ int LevelCanvas::handle(int event) {
 								map_set(_map, layer, x, y, 0, -1);
 							} else {
 								map_set(_map, layer, x, y, tsi, ti);
-								struct map_cell * c = map_get_cell(_map, x, y);
 								if(meta) {
 									if(meta->flags) {
-										c->flags = meta->flags;
+										map_set_flags(_map, x, y, meta->flags);
 									}
 									if(meta->clas) {
-										if(c->clas)
-											free(c->clas);
-										c->clas = strdup(meta->clas);
+										map_set_class(_map, x, y, meta->clas);
 									}
 								}
 							}
@@ -137,19 +134,12 @@ int LevelCanvas::handle(int event) {
 					int x = col(), y = row();
 					map *m = getMap();
 					if(!m) return 1;
-					struct map_cell * c = map_get_cell(m, x, y);
-					if(c->id)
-						free(c->id);
-					c->id = 0;
-					if(c->clas)
-						free(c->clas);
-					c->clas = 0;
-					c->flags = 0;
+					map_set_id(m, x, y, NULL);
+					map_set_class(m, x, y, NULL);
+					map_set_flags(m, x, y, 0);
 					
-					for(int i = 0; i <= m->nl; i++) {
-						struct map_tile *tile = &c->tiles[i];	
-						tile->si = 0;
-						tile->ti = -1;
+					for(int i = 0; i < m->nl; i++) {
+						map_set(m, i, x, y, 0, -1);
 					}
 					
 					if(select_callback)
@@ -163,14 +153,9 @@ int LevelCanvas::handle(int event) {
 					int x = col(), y = row();
 					map *m = getMap();
 					if(!m) return 1;
-					struct map_cell * c = map_get_cell(m, x, y);
-					if(c->id)
-						free(c->id);
-					c->id = 0;
-					if(c->clas)
-						free(c->clas);
-					c->clas = 0;
-					c->flags = 0;
+					map_set_id(m, x, y, NULL);
+					map_set_class(m, x, y, NULL);
+					map_set_flags(m, x, y, 0);
 					
 					if(select_callback)
 						select_callback(this);
@@ -213,14 +198,13 @@ void LevelCanvas::paint() {
 	if(_drawBarriers || _drawMarkers) {
 		for(int j = 0; j < _map->nr; j++)
 			for(int i = 0; i < _map->nc; i++) {
-				map_cell *c = map_get_cell(_map, i, j);
 				
 				int x0 = i * _map->tiles.tw, 
 					y0 = j * _map->tiles.th, 
 					x1 = (i + 1) * _map->tiles.tw, 
 					y1 = (j + 1) * _map->tiles.th;
 				
-				if(_drawBarriers && (c->flags & TS_FLAG_BARRIER)) {
+				if(_drawBarriers && (map_get_flags(_map, i, j) & TS_FLAG_BARRIER)) {
 					pen("lime");
 					for(int y = y0; y < y1; y++)
 						for(int x = x0; x < x1; x++) {
@@ -231,13 +215,13 @@ void LevelCanvas::paint() {
 				if(_drawMarkers) {
 					x0++; y0++;
 					x1-=2; y1-=2;
-					if(c->id) {
+					if(map_get_id(_map, i, j)) {
 						pen("Blue");
 						line(x0, y0, x1 - 1, y0);
 						line(x0, y0, x0, y1 - 1);
 						line(x0, y1 - 1, x1 - 1, y0);
 					}
-					if(c->clas) {
+					if(map_get_class(_map, i, j)) {
 						pen("Red");
 						line(x0 + 1, y1, x1, y1);
 						line(x1, y0 + 1, x1, y1);
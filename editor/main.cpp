@@ -73,7 +73,7 @@ void new_cb(Fl_Menu_* w, void*) {
 }
 
 void open_cb(Fl_Menu_* w, void*) {
-	char * filepath = fl_file_chooser("Choose Map", "Map files (*.map)", "", 1);
+	char * filepath = fl_file_chooser("Choose Map", "Map files (*.map)\tBinary map files (*.rmap)", "", 1);
 	if(!filepath)
 		return;
 	
@@ -148,6 +148,14 @@ void open_cb(Fl_Menu_* w, void*) {
 	}
 }
 
+/* Maps with the .rmap extension are saved in the binary format */
+static int save_map(map *m, const char *filename) {
+	const char *ext = strrchr(filename, '.');
+	if(ext && !strcmp(ext, ".rmap"))
+		return map_save_bin(m, filename);
+	return map_save(m, filename);
+}
+
 void save_cb(Fl_Menu_* w, void*p) {
 	map *m = canvas->getMap();
 	if(!m) {
@@ -155,7 +163,7 @@ void save_cb(Fl_Menu_* w, void*p) {
 		return;
 	}
 	if(map_file) {
-		map_save(m, map_file);
+		save_map(m, map_file);
 	} else
 		saveas_cb(w, p);
 }
@@ -164,9 +172,9 @@ void saveas_cb(Fl_Menu_* w, void*) {
 	map *m = canvas->getMap();
 	if(!m) 
 		return;
-	char * filename = fl_file_chooser("Choose Filename For Map", "Map files (*.map)", "", 1);	
+	char * filename = fl_file_chooser("Choose Filename For Map", "Map files (*.map)\tBinary map files (*.rmap)", "", 1);	
 	if(filename != NULL) {
-		if(map_save(m, filename)) {		
+		if(save_map(m, filename)) {		
 			if(map_file) free(map_file);
 			map_file = strdup(filename);
 		} else {
@@ -327,13 +335,7 @@ void mapClass_cb(Fl_Input *in, void*) {
 	int x = canvas->col(), y = canvas->row();
 	map *m = canvas->getMap();
 	if(!m) return;
-	struct map_cell * c = map_get_cell(m, x, y);
-	if(c->clas)
-		free(c->clas);
-	if(strlen(mapClass->value()) == 0)
-		c->clas = NULL;
-	else
-		c->clas = strdup(mapClass->value());
+	map_set_class(m, x, y, mapClass->value());
 	if(canvas->drawBarriers())
 		canvas->redraw();
 }
@@ -342,13 +344,7 @@ void mapId_cb(Fl_Input *in, void*) {
 	int x = canvas->col(), y = canvas->row();
 	map *m = canvas->getMap();
 	if(!m) return;
-	struct map_cell * c = map_get_cell(m, x, y);
-	if(c->id)
-		free(c->id);
-	if(strlen(mapId->value()) == 0)
-		c->id = NULL;
-	else
-		c->id = strdup(mapId->value());
+	map_set_id(m, x, y, mapId->value());
 	if(canvas->drawBarriers())
 		canvas->redraw();
 }
@@ -356,12 +352,13 @@ void mapId_cb(Fl_Input *in, void*) {
 void mapBarrier_cb(Fl_Check_Button*, void*) {
 	int x = canvas->col(), y = canvas->row();
 	map *m = canvas->getMap();
-	struct map_cell * c = map_get_cell(m, x, y);
+	int flags = map_get_flags(m, x, y);
 	
 	if(mapBarrier->value())
-		c->flags |= TS_FLAG_BARRIER;
+		flags |= TS_FLAG_BARRIER;
 	else
-		c->flags &= ~TS_FLAG_BARRIER;
+		flags &= ~TS_FLAG_BARRIER;
+	map_set_flags(m, x, y, flags);
 	
 	if(canvas->drawBarriers())
 		canvas->redraw();
@@ -372,11 +369,11 @@ void map_select_cb(LevelCanvas *canvas) {
 	char buffer[128];
 	
 	map *m = canvas->getMap();
-	struct map_cell * c = map_get_cell(m, x, y);
+	const char *id = map_get_id(m, x, y), *clas = map_get_class(m, x, y);
 	
-	mapId->value(c->id?c->id:"");
-	mapClass->value(c->clas?c->clas:"");
-	mapBarrier->value(c->flags & TS_FLAG_BARRIER);
+	mapId->value(id?id:"");
+	mapClass->value(clas?clas:"");
+	mapBarrier->value(map_get_flags(m, x, y) & TS_FLAG_BARRIER);
 	
 	char sub[3][20];
 	for(int i = 0; i < 3; i++) {
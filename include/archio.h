@@ -0,0 +1,50 @@
+/*1 archio.h
+ *# The parts of reading an archive that {{pak.c}} and {{zip.c}} have in
+ *# common: Mapping the whole archive into memory, and the {{SDL_RWops}}
+ *# streams over a file within it.
+ *2 API
+ */
+
+/*@ const char *archio_map(const char *name, size_t *len)
+ *# Maps the whole file {{name}} into memory, read-only, and sets {{len}}
+ *# to its size.\n
+ *# Returns {{NULL}} if the file can't be opened or mapped, or is empty.
+ */
+const char *archio_map(const char *name, size_t *len);
+
+/*@ void archio_unmap(const char *map, size_t len)
+ *# Unmaps a file mapped with {{archio_map()}}. {{map}} may be {{NULL}}.
+ */
+void archio_unmap(const char *map, size_t len);
+
+#ifdef USESDL
+/*@ #define ARCHIO_RAW
+ *# Compressed data is a raw deflate stream, as in ZIP archives.
+ */
+#define ARCHIO_RAW  0
+
+/*@ #define ARCHIO_ZLIB
+ *# Compressed data has the zlib header and checksum, as in PAKZ archives.
+ */
+#define ARCHIO_ZLIB 1
+
+/*@ SDL_RWops *archio_open_range(const char *name, long offset, long length)
+ *# Opens a read-only stream over the {{length}} bytes at {{offset}} in the
+ *# file {{name}}. It has its own handle on the file and its own position,
+ *# so any number of them can be read at the same time, even from different
+ *# threads, without disturbing each other.\n
+ *# Returns {{NULL}} on failure, with the reason in {{SDL_GetError()}}.
+ */
+SDL_RWops *archio_open_range(const char *name, long offset, long length);
+
+/*@ SDL_RWops *archio_open_inflate(SDL_RWops *src, long size, int format)
+ *# Opens a read-only stream that inflates the compressed data read from
+ *# {{src}} as it is read, so that it is never decompressed in full.
+ *# {{size}} is the size of the data when uncompressed, and {{format}} is
+ *# {{ARCHIO_RAW}} or {{ARCHIO_ZLIB}}. Seeking backwards starts over from
+ *# the beginning.\n
+ *# Closing the stream closes {{src}}. On failure it returns {{NULL}} and
+ *# {{src}} is left open.
+ */
+SDL_RWops *archio_open_inflate(SDL_RWops *src, long size, int format);
+#endif
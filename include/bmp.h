@@ -4,6 +4,7 @@
  ** It supports BMP, GIF and PCX files without any third party dependencies.
  ** PNG support is optional through libpng (http://www.libpng.org/pub/png/libpng.html). Use {{-DUSEPNG}} when compiling.
  ** JPG support is optional through libjpeg (http://www.ijg.org/). Use {{-DUSEJPG}} when compiling.
+ ** On x86 CPUs the blitters use SSE2 or AVX2 if the processor supports it. Use {{-DNO_SIMD}} when compiling to disable it.
  *} 
  *2 References
  *{
@@ -44,8 +45,15 @@ typedef struct bitmap {
 	/* Dimesions of the bitmap */
 	int w, h;	
 	
+	/* Number of bytes between the start of each row in data.
+	 * It is w * 4 unless the bitmap is a view created with bm_view() */
+	int stride;
+	
 	/* The actual pixel data in RGBA format */
 	unsigned char *data;
+	
+	/* The bitmap that owns data if this is a view, otherwise NULL */
+	struct bitmap *parent;
 		
 	/* Color for the pen of the canvas */
 	unsigned int color;
@@ -61,6 +69,9 @@ typedef struct bitmap {
 		int x0, y0;
 		int x1, y1;
 	} clip;
+	
+	/* Change counter; See bm_touch() and bm_version() */
+	unsigned int version;
 } Bitmap;
 
 /*@ struct bitmap *bm_create(int w, int h)
@@ -105,6 +116,16 @@ Bitmap *bm_load_fp(FILE *f);
 Bitmap *bm_load_rw(SDL_RWops *file);
 #endif
 
+/*@ Bitmap *bm_load_mem(const void *data, long len)
+ *# Loads a bitmap from {{len}} bytes of file data at {{data}}, for example
+ *# a view of a file in a memory mapped archive.\n
+ *# The data is only read, and may be released as soon as the function returns.\n
+ *# BMP, GIF and PCX support is always enabled, while JPG and PNG support 
+ *# depends on how the library was compiled.\n
+ *# Returns {{NULL}} if the data could not be loaded.
+ */
+Bitmap *bm_load_mem(const void *data, long len);
+
 /*@ int bm_save(Bitmap *b, const char *fname)
  *# Saves the bitmap {{b}} to a BMP, JPG or PNG file named {{fname}}.\n
  *# If the filename contains {{".bmp"}}, {{".gif"}}, {{".pcx"}} or {{".jpg"}} the file is 
@@ -128,7 +149,9 @@ Bitmap *bm_bind(int w, int h, unsigned char *data);
  *# Changes the data referred to by a bitmap structure previously
  *# created with a call to {{bm_bind()}}.
  *# The new data must be of the same dimensions as specified
- *# in the original {{bm_bind()}} call.
+ *# in the original {{bm_bind()}} call.\n
+ *# If the rows of the new data are padded, set the bitmap's {{stride}} 
+ *# field to the number of bytes per row afterwards.
  */
 void bm_rebind(Bitmap *b, unsigned char *data);
 
@@ -138,6 +161,17 @@ void bm_rebind(Bitmap *b, unsigned char *data);
  */
 void bm_unbind(Bitmap *b);
 
+/*@ Bitmap *bm_view(Bitmap *parent, int x, int y, int w, int h)
+ *# Creates a bitmap structure that refers to the w*h area at x,y of 
+ *# the {{parent}} bitmap without copying its pixels. Drawing on the view
+ *# draws on the parent and vice versa.\n
+ *# The area is clipped to the bounds of the {{parent}}. It returns {{NULL}} 
+ *# if the area is empty.\n
+ *# The view must be deallocated with {{bm_free()}} (which won't touch the
+ *# parent's pixels) and it must not outlive its parent.
+ */
+Bitmap *bm_view(Bitmap *parent, int x, int y, int w, int h);
+
 /*@ Bitmap *bm_copy(Bitmap *b)
  *# Creates a duplicate of the bitmap structure.\n
  *# Caveat: Font information is not copied and must be set on the copy before
@@ -161,6 +195,21 @@ void bm_clip(Bitmap *b, int x0, int y0, int x1, int y1);
  */
 void bm_unclip(Bitmap *b);
 
+/*@ void bm_touch(Bitmap *b)
+ *# Marks the pixels of {{b}} as changed, so that anything that was derived
+ *# from them (like a {{BmRle}} or a pre-rendered map layer) can tell that 
+ *# it has to be created again. See {{bm_version()}}.\n
+ *# The drawing functions don't call it; whoever changes the pixels in a way
+ *# that matters has to. Touching a view touches the bitmap that owns the pixels.
+ */
+void bm_touch(Bitmap *b);
+
+/*@ unsigned int bm_version(Bitmap *b)
+ *# Returns a number that changes every time {{bm_touch()}} is called on {{b}}, 
+ *# on its parent if {{b}} is a view, or on any of the parent's views.
+ */
+unsigned int bm_version(Bitmap *b);
+
 /*@ unsigned int bm_get(Bitmap *b, int x, int y)
  *# Retrieves the value of the pixel at x,y as an integer.\n
  *# The return value is in the form 0xAABBGGRR
@@ -315,6 +364,81 @@ void bm_blit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, in
  */
 void bm_maskedblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h);
 
+/*@ void bm_alphablit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h)
+ *# Blits an area of w*h pixels at sx,sy on the src bitmap to 
+ *# dx,dy on the {{dst}} bitmap, blending the pixels using the 
+ *# alpha values of the pixels on the {{src}} bitmap.\n
+ *# The src bitmap colour is not taken into account.
+ */
+void bm_alphablit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h);
+
+/*@ void bm_fadeblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h, int a)
+ *# Like {{bm_maskedblit()}}, but blends the pixels with a 
+ *# constant alpha value {{a}} in the range [0-255].
+ */
+void bm_fadeblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h, int a);
+
+/*@ void bm_addblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h)
+ *# Blits an area of w*h pixels at sx,sy on the src bitmap to 
+ *# dx,dy on the {{dst}} bitmap, adding the R, G and B values of 
+ *# the pixels together (saturating at 255).\n
+ *# The alpha values of the {{dst}} bitmap are left unchanged.
+ */
+void bm_addblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h);
+
+/*@ void bm_mulblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h)
+ *# Blits an area of w*h pixels at sx,sy on the src bitmap to 
+ *# dx,dy on the {{dst}} bitmap, multiplying the R, G and B values of 
+ *# the pixels together.\n
+ *# The alpha values of the {{dst}} bitmap are left unchanged.
+ */
+void bm_mulblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h);
+
+/*@ const char *bm_kernel_name()
+ *# Returns the name of the set of blitting kernels that was selected
+ *# for this CPU: {{"AVX2"}}, {{"SSE2"}} or {{"C"}}.
+ */
+const char *bm_kernel_name();
+
+/*@ typedef struct bm_rle BmRle
+ *# A run-length encoded "compiled sprite" built from a bitmap and its mask 
+ *# colour. Only the runs of pixels that don't match the mask colour are 
+ *# stored, so blitting it with {{bm_rle_blit()}} skips the transparent areas 
+ *# entirely and copies the opaque runs in bulk.\n
+ *# It is a snapshot: If the bitmap's pixels or mask colour change, the
+ *# {{BmRle}} has to be created again.
+ */
+typedef struct bm_rle {
+	int w, h;
+	unsigned int color;
+	unsigned int *rows;
+	unsigned int *data;
+} BmRle;
+
+/*@ BmRle *bm_rle_create(Bitmap *b)
+ *# Creates a {{BmRle}} from the bitmap {{b}}, using its current colour as the mask.\n
+ *# It returns {{NULL}} if the memory could not be allocated.
+ */
+BmRle *bm_rle_create(Bitmap *b);
+
+/*@ void bm_rle_free(BmRle *r)
+ *# Deallocates a {{BmRle}} created with {{bm_rle_create()}}.
+ */
+void bm_rle_free(BmRle *r);
+
+/*@ size_t bm_rle_size(BmRle *r)
+ *# Returns the number of bytes of memory used by the {{BmRle}} {{r}}.
+ */
+size_t bm_rle_size(BmRle *r);
+
+/*@ void bm_rle_blit(Bitmap *dst, int dx, int dy, BmRle *src, int sx, int sy, int w, int h)
+ *# Blits an area of w*h pixels at sx,sy of the {{src}} sprite to dx,dy on 
+ *# the {{dst}} bitmap.\n
+ *# The result is the same as {{bm_maskedblit()}} on the bitmap the sprite
+ *# was created from.
+ */
+void bm_rle_blit(Bitmap *dst, int dx, int dy, BmRle *src, int sx, int sy, int w, int h);
+
 /*@ void bm_blit_ex(Bitmap *dst, int dx, int dy, int dw, int dh, Bitmap *src, int sx, int sy, int sw, int sh, int mask)
  *# Extended blit function. Blits an area of sw*sh pixels at sx,sy from the {{src}} bitmap to 
  *# dx,dy on the {{dst}} bitmap into an area of dw*dh pixels, stretching or shrinking the blitted area as neccessary.\n
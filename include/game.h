@@ -28,6 +28,10 @@ int readkey();
 extern char initial_dir[];
 
 extern unsigned int frame_counter;
+
+/* The measured length of the last frame, in seconds */
+extern double frame_time;
+
 void advanceFrame();
 
 /* Converts a keyboard scancode to an ASCII cheracter. */
@@ -0,0 +1,29 @@
+/*
+Image cache:
+Decoding PNGs and JPEGs takes most of the time it takes to start a game,
+so the decoded pixels are saved in a cache directory and read back directly
+the next time. Each cached image records a hash of the file it was decoded
+from, so if the file changes it is decoded and cached again.
+*/
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+
+#include <stddef.h>
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/* Sets the directory in which images are cached, creating it if needed.
+Until this is called, nothing is cached. */
+int ic_init(const char *dir);
+
+/* Decodes the image in data, like bm_load_mem().
+name identifies the image in the cache, so it should be unique to
+the file (the PAK name and file name, for example).
+It may be called from more than one thread. */
+struct bitmap *ic_decode(const char *name, const void *data, size_t len);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+#endif /* IMGCACHE_H */
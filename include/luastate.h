@@ -1,11 +1,20 @@
 
 #define MAX_TIMEOUTS 20
 
-/* Don't tamper with this variable from your Lua scripts. */
-#define STATE_DATA_VAR	"___state_data"
+/* Registry table of the results of importOnce() */
+#define IMPORTED_VAR	"___imported"
 
 #define GLOBAL_FUNCTION(name, fun)	lua_pushcfunction(L, fun); lua_setglobal(L, name);
 #define SET_TABLE_INT_VAL(k, v)     lua_pushstring(L, k); lua_pushinteger(L, v); lua_rawset(L, -3);
+#define SET_TABLE_NUM_VAL(k, v)     lua_pushstring(L, k); lua_pushnumber(L, v); lua_rawset(L, -3);
+
+/* Functions that need the State Data are registered with it as their first
+upvalue, so that they don't have to look it up with get_state_data() every
+time they're called. Use STATE_DATA(L) to get it in those functions. */
+#define STATE_DATA(L)               ((struct lustate_data *)lua_touserdata(L, lua_upvalueindex(1)))
+#define STATE_FUNCTION(name, fun)   lua_pushlightuserdata(L, get_state_data(L)); lua_pushcclosure(L, fun, 1); lua_setglobal(L, name);
+#define STATE_METHOD(name, fun)     lua_pushlightuserdata(L, get_state_data(L)); lua_pushcclosure(L, fun, 1); lua_setfield(L, -2, name);
+#define STATE_LIB(funcs)            luaL_newlibtable(L, funcs); lua_pushlightuserdata(L, get_state_data(L)); luaL_setfuncs(L, funcs, 1);
 
 struct callback_function {
 	int ref;
@@ -34,4 +43,6 @@ struct lustate_data {
 };
 
 struct lustate_data *get_state_data(lua_State *L);
+int lus_load_chunk(lua_State *L, const char *chunk, size_t len, const char *name);
+int lus_load_script(lua_State *L, const char *path);
 void process_timeouts(lua_State *L);
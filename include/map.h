@@ -9,11 +9,11 @@ struct map_tile {
 	short ti; /* Tile index within the set */
 };
 
+/* A reference to a cell in a map. 
+The cell's data lives in the map's planes below. */
 struct map_cell {
-	struct map_tile *tiles;
-	char *id;
-	char *clas;
-	int flags; 
+	struct map *map;
+	int x, y;
 };
 
 struct map {
@@ -21,9 +21,26 @@ struct map {
 	char dirty;
 	
 	int nl;
-	struct map_cell *cells;
+	
+	/* Tiles are stored layer by layer, row by row:
+	   the tile at (x,y) in layer l is layers[(l * nr + y) * nc + x] */
+	struct map_tile *layers;
+	
+	/* Per-cell attributes, nr * nc entries each. 
+	   ids and classes index into strings; 0 means none. */
+	int *flags;
+	int *ids;
+	int *classes;
+	
+	/* Interned id and class strings */
+	char **strings;
+	int nstrings, astrings;
+	struct hash_tbl *string_index;
 	
 	struct tile_collection tiles;
+	
+	/* The layer cache of map_render_cached() */
+	struct map_chunks *chunks;
 };
 
 struct map *map_create(int nr, int nc, int tw, int th, int nl);
@@ -34,15 +51,59 @@ void map_get(struct map *m, int layer, int x, int y, int *tsi, int *ti);
 
 void map_render(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int scroll_y);
 
+/* Like map_render(), but if wrap is non-zero the map is repeated in all directions */
+void map_render_ex(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int scroll_y, int wrap);
+
+/* Like map_render_ex(), but draws the layer from pre-rendered chunks.
+Chunks are rendered when they're first needed, again after map_set() 
+changes one of their cells (changing the cells directly bypasses this) 
+and again after bm_touch() was called on one of the tilesets' bitmaps.
+When the chunks go over the budget set with map_set_cache_budget(), the
+ones that were drawn the longest ago are freed. */
+void map_render_cached(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int scroll_y, int wrap);
+
+/* Sets the number of bytes of pre-rendered chunks map_render_cached() 
+may keep for each map. The chunks on screen are kept regardless. */
+void map_set_cache_budget(size_t bytes);
+
 void map_free(struct map *m);
 
 int map_save(struct map *m, const char *filename);
 
+/* Saves the map in the binary format, which loads much faster than JSON.
+map_load() and map_parse_mem() recognise either format. */
+int map_save_bin(struct map *m, const char *filename);
+
 struct map *map_load(const char *filename, int cd);
 
 struct map *map_parse(const char *text, int cd);
 
-struct map_cell *map_get_cell(struct map *m, int x, int y);
+/* Like map_parse(), but for len bytes of data in either the JSON or binary format */
+struct map *map_parse_mem(const char *data, size_t len, int cd);
+
+/* Calls fun with the name of each of the tilesets used by the map in data,
+without loading anything. Returns the number of tilesets, or -1 on error. */
+int map_tilesets(const char *data, size_t len, void (*fun)(const char *name, void *udata), void *udata);
+
+/* Converts the JSON map in text to the binary format, writing it to f.
+The map's tilesets are not loaded. */
+int map_convert(const char *text, FILE *f);
+
+struct map_cell map_get_cell(struct map *m, int x, int y);
+
+int map_get_flags(struct map *m, int x, int y);
+
+void map_set_flags(struct map *m, int x, int y, int flags);
+
+/* The id and class strings are interned in the map; 
+Setting them to NULL or "" clears them. */
+const char *map_get_id(struct map *m, int x, int y);
+
+void map_set_id(struct map *m, int x, int y, const char *id);
+
+const char *map_get_class(struct map *m, int x, int y);
+
+void map_set_class(struct map *m, int x, int y, const char *clas);
 
 #if defined(__cplusplus) || defined(c_plusplus)
 } /* extern "C" */
@@ -1,5 +1,8 @@
 /*1 pak.h
  *# Utility library for manipulating id Software's Quake-style PAK files. 
+ *# Archives that contain compressed files use an extended format (magic {{"PAKZ"}})
+ *# that also records the compression method and uncompressed size of every file.
+ *# Archives without compressed files are still written as plain Quake PAKs.
  *2 References
  *{
  ** http://debian.fmi.uni-sofia.bg/~sergei/cgsr/docs/pak.txt
@@ -30,6 +33,15 @@ extern int pak_verbose;
  */
 struct pak_file *pak_open(const char *name);
 
+/*@ struct pak_file *pak_open_mapped(const char *name)
+ *# Opens an existing archive read-only and maps the whole file into memory,
+ *# so that {{pak_get_view()}} can return the files in it without copying them.\n
+ *# {{pak_append_file()}} and {{pak_append_blob()}} will fail on an archive 
+ *# opened this way.\n
+ *# Returns {{NULL}} if the file does not exist, can not be mapped or on error.
+ */
+struct pak_file *pak_open_mapped(const char *name);
+
 /*@ struct pak_file *pak_create(const char *name)
  *# Creates a new PAK file on disk. It it already exists its contents
  *# will be erased.\n
@@ -45,10 +57,78 @@ int pak_append_file(struct pak_file *p, const char *filename);
 
 /*@ int pak_append_blob(struct pak_file *p, const char *filename, const char *blob, int len)
  *# Appends a {{blob}} of data of length {{len}} to the archive under the name {{filename}}.\n
+ *# If a file with the same contents was appended since the archive was opened,
+ *# the new file shares its data instead of storing it again.\n
  *# Returns 1 on success, 0 on failure.
  */
 int pak_append_blob(struct pak_file *p, const char *filename, const char *blob, int len);
 
+/*@ struct pak_blob
+ *# A blob prepared by {{pak_pack_blob()}} to be appended with {{pak_append_packed()}}.
+ */
+struct pak_blob {
+	const char *data; /* The bytes to store */
+	int len;          /* Number of bytes to store */
+	int size;         /* Size of the original blob */
+	int method;       /* PAK_STORE or PAK_DEFLATE */
+	unsigned long long hash; /* Hash of the original blob */
+	char *packed;     /* Compressed data, if any */
+};
+
+/*@ int pak_pack_blob(const char *blob, int len, int method, struct pak_blob *b)
+ *# Prepares a {{blob}} of length {{len}} to be appended to an archive: It hashes
+ *# the blob to detect duplicates and compresses it if {{method}} is {{PAK_DEFLATE}}.\n
+ *# It doesn't touch any archive, so blobs can be packed on several threads at once
+ *# and appended in a fixed order afterwards.\n
+ *# {{b->data}} may point into {{blob}}, so keep the blob until the {{pak_blob}} has 
+ *# been appended. Call {{pak_free_blob()}} when done with it.\n
+ *# Returns 1 on success, 0 on failure.
+ */
+int pak_pack_blob(const char *blob, int len, int method, struct pak_blob *b);
+
+/*@ void pak_free_blob(struct pak_blob *b)
+ *# Frees the memory allocated by {{pak_pack_blob()}}.
+ */
+void pak_free_blob(struct pak_blob *b);
+
+/*@ int pak_append_packed(struct pak_file *p, const char *filename, const struct pak_blob *b)
+ *# Appends a blob prepared by {{pak_pack_blob()}} to the archive under the name {{filename}}.\n
+ *# Returns 1 on success, 0 on failure.
+ */
+int pak_append_packed(struct pak_file *p, const char *filename, const struct pak_blob *b);
+
+/*@ PAK_STORE
+ *# Compression method for files stored as is.
+ */
+#define PAK_STORE   0
+
+/*@ PAK_DEFLATE
+ *# Compression method for files compressed with zlib's deflate.
+ */
+#define PAK_DEFLATE 1
+
+/*@ void pak_compress(struct pak_file *p, int method)
+ *# Sets the compression {{method}} ({{PAK_STORE}} or {{PAK_DEFLATE}}) for files 
+ *# appended to the archive after this call. The default is {{PAK_STORE}}.\n
+ *# Files that don't get smaller are stored as is regardless.
+ */
+void pak_compress(struct pak_file *p, int method);
+
+/*@ void pak_align(struct pak_file *p, int align)
+ *# Stores files appended after this call at offsets that are multiples of {{align}}, 
+ *# padding the archive with zeros where necessary. Aligned files can be mapped or
+ *# read with direct I/O more efficiently. The default is 1.
+ */
+void pak_align(struct pak_file *p, int align);
+
+/*@ void pak_sort(struct pak_file *p)
+ *# Sorts the archive's directory by file name when it is written by {{pak_close()}}.\n
+ *# The file data is not moved. In a sorted archive {{pak_next_file()}} can 
+ *# find all the files that start with a prefix (such as {{"maps/"}}) without
+ *# scanning the whole directory.
+ */
+void pak_sort(struct pak_file *p);
+
 /*@ void pak_close(struct pak_file * p)
  *# Writes all changes to disk and closes the file.\n
  *# It also deallocates all memory allocated to the {{pak_file}} structure.
@@ -60,11 +140,35 @@ int pak_close(struct pak_file * p);
  */
 int pak_num_files(struct pak_file * p);
 
+/*@ struct pak_info
+ *# Where and how a file is stored in the archive. See {{pak_nth_info()}}.
+ */
+struct pak_info {
+	int offset, length; /* Location and number of bytes stored */
+	int size;           /* Size of the file when uncompressed */
+	int method;         /* PAK_STORE or PAK_DEFLATE */
+};
+
+/*@ int pak_nth_info(struct pak_file * p, int n, struct pak_info *info)
+ *# Fills {{info}} with the details of the n-th file in the archive.
+ *# Files with the same contents share their offset.\n
+ *# Returns 0 if there is no such file.
+ */
+int pak_nth_info(struct pak_file * p, int n, struct pak_info *info);
+
 /*@ const char *pak_nth_file(struct pak_file * p, int n)
  *# Returns the name of the n-th file in the archive.
  */
 const char *pak_nth_file(struct pak_file * p, int n);
 
+/*@ int pak_next_file(struct pak_file * p, const char *prefix, int from)
+ *# Returns the index of the first file at or after index {{from}} 
+ *# whose name starts with {{prefix}}, or -1 if there are no more.\n
+ *# To visit all the files under {{maps/}}, start with {{from}} = 0 and
+ *# continue from the returned index plus one.
+ */
+int pak_next_file(struct pak_file * p, const char *prefix, int from);
+
 /*@ char *pak_get_blob(struct pak_file * p, const char *filename, int *len)
  *# Retrieves the contents of a file within the archive as a blob of bytes.\n
  *# {{len}} will be set to the number of bytes in the blob.\n
@@ -72,6 +176,23 @@ const char *pak_nth_file(struct pak_file * p, int n);
  */
 char *pak_get_blob(struct pak_file * p, const char *filename, size_t *len);
 
+/*@ const char *pak_get_view(struct pak_file * p, const char *filename, size_t *len)
+ *# Retrieves the contents of a file within an archive opened with
+ *# {{pak_open_mapped()}} without copying it.\n
+ *# Compressed files can't be viewed; use {{pak_get_blob()}} for them.\n
+ *# {{len}} will be set to the number of bytes in the file.\n
+ *# The bytes are not null-terminated and remain valid until {{pak_close()}}.
+ *# They must not be modified or {{free()}}ed.\n
+ *# Returns {{NULL}} if the archive is not mapped or the file is not found.
+ */
+const char *pak_get_view(struct pak_file * p, const char *filename, size_t *len);
+
+/*@ int pak_is_view(struct pak_file * p, const void *ptr)
+ *# Returns 1 if {{ptr}} points into the memory mapped by {{pak_open_mapped()}},
+ *# that is if it was returned by {{pak_get_view()}}, 0 otherwise.
+ */
+int pak_is_view(struct pak_file * p, const void *ptr);
+
 /*@ char *pak_get_text(struct pak_file * p, const char *filename)
  *# Retrieves the contents of a file within the archive as an array of characters.\n
  *# It assumes a text file and so returns a null-terminated string.
@@ -81,7 +202,7 @@ char *pak_get_text(struct pak_file * p, const char *filename);
 
 /*@ FILE *pak_get_file(struct pak_file * p, const char *filename)
  *# Retrieves the location of a file within the archive as a {{FILE*}}.\n
- *# It returns {{NULL}} if the file could not be found.\n
+ *# It returns {{NULL}} if the file could not be found or is compressed.\n
  *N Don't write to this {{FILE*}}
  */
 #ifndef USESDL
@@ -89,6 +210,18 @@ FILE *pak_get_file(struct pak_file * p, const char *filename);
 #endif
 
 #ifdef USESDL
+/*@ SDL_RWops *pak_get_rwops(struct pak_file * p, const char *filename)
+ *# Opens a new read-only {{SDL_RWops}} stream over a file within the archive.\n
+ *# The stream starts at offset 0, its size is the size of the file and it 
+ *# can not read past the end of the file. Compressed files are decompressed
+ *# as they are read. Every stream has its own position,
+ *# so several can be read at the same time (even from different threads)
+ *# without interfering with each other.\n
+ *# Close it with {{SDL_RWclose()}} when done. Streams over an archive opened
+ *# with {{pak_open_mapped()}} read from the mapping, so they must be closed 
+ *# before the archive is.\n
+ *# It returns {{NULL}} if the file could not be found.
+ */
 SDL_RWops *pak_get_rwops(struct pak_file * p, const char *filename);
 #endif
 
@@ -8,17 +8,89 @@ void re_push();
 void re_pop();
 #endif
 
-int rs_read_pak(const char *filename);
+/* Mounts a PAK or ZIP archive, or a directory, as a source of the game's
+files. Files in later mounts take the place of files with the same name
+in earlier ones. Mount everything before calling re_preload_init(). */
+int rs_mount(const char *filename);
 
 struct ini_file *re_get_ini(const char *filename);
 
+/* Kinds of resources in the cache */
+enum re_kind { RE_BITMAP, RE_SOUND, RE_MUSIC, RE_NUM_KINDS };
+
+struct re_stats {
+	int count;      /* Resources in the cache */
+	int unused;     /* ...of which nothing holds a reference */
+	size_t bytes;   /* Memory used by them */
+	size_t budget;  /* See re_set_budget() */
+	unsigned long hits, misses, evictions;
+};
+
+/* The resources returned by re_get_bmp(), re_get_wav() and re_get_mus()
+are only guaranteed to stay in the cache until the next one is loaded. 
+To hold on to one, take a reference with re_retain() and give it back 
+with re_release() when you're done with it. */
+void re_retain(const void *res);
+void re_release(const void *res);
+
+/* When the resources of a kind use more than bytes of memory, the least
+recently used ones without references are freed. 0 means there is no limit */
+void re_set_budget(enum re_kind kind, size_t bytes);
+
+void re_get_stats(enum re_kind kind, struct re_stats *stats);
+void re_log_stats();
+
 struct bitmap *re_get_bmp(const char *filename);
 
+/* Clones and views come with a reference, and they're freed 
+when it is released */
 struct bitmap *re_clone_bmp(struct bitmap *b, const char *newname);
 
+struct bitmap *re_view_bmp(struct bitmap *b, int x, int y, int w, int h, const char *newname);
+
+/* Returns the compiled (RLE) sprite of a bitmap, creating it if needed */
+struct bm_rle *re_get_rle(struct bitmap *b);
+
+/* Call this after changing the pixels of a bitmap */
+void re_dirty_bmp(struct bitmap *b);
+
 #ifdef _SDL_MIXER_H
 Mix_Chunk *re_get_wav(const char *filename);
 Mix_Music *re_get_mus(const char *filename);
 #endif
 
 char *re_get_script(const char *filename);
+
+const char *re_get_data(const char *filename, size_t *len);
+
+void re_free_data(const char *data);
+
+/* Watches the files under dir for changes, on platforms that support it.
+re_watch_update() reloads the cached resources among the changed files 
+and calls changed() for every one of them, so that whatever else uses 
+them can reload them too, except for bitmaps that could be reloaded in 
+place (their change counter is bumped; see bm_touch()).
+It returns the number of files that changed. */
+int re_watch(const char *dir);
+void re_unwatch();
+int re_watch_update(void (*changed)(const char *filename));
+
+/* Starts nthreads worker threads that load preloaded resources
+in the background. Without them, re_preload() loads immediately. */
+int re_preload_init(int nthreads);
+void re_preload_deinit();
+
+/* Queues a bitmap, WAV, music or map file to be loaded into the cache
+in the background. For a map, its tilesets are loaded. */
+int re_preload(const char *filename);
+int re_preload_map(const char *filename);
+
+/* Moves loaded resources into the cache; call it once per frame */
+void re_preload_update();
+
+/* Waits until everything queued has been loaded */
+void re_preload_wait();
+
+/* Fraction of the queued resources that have been loaded, 
+from 0 to 1. It is 1 if nothing is queued. */
+double re_preload_progress();
@@ -28,8 +28,16 @@ int pop_state(struct game_state *next);
 struct game_state *get_state(const char *name);
 int set_state(const char *name);
 
+/* Queues the resources the state named in the ini file needs 
+to be loaded in the background */
+int preload_state(const char *name);
+
+/* Does the current state use the file (for hot reloading)? */
+int state_uses_file(const char *filename);
+
 void states_initialize();
 
 struct game_state *get_lua_state(const char *name); /* luastate.c */
+void lus_clean_up(); /* luastate.c */
 struct game_state *get_mus_state(const char *name); /* mustate.c */
 
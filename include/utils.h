@@ -62,3 +62,17 @@ char *my_strtok_r(char *str, const char *delim, char **saveptr);
  *# It returns {{NULL}} if the file could not be read.
  */
 char *my_readfile (const char *fn);
+
+/*@ char *my_readblob (const char *fn, size_t *len)
+ *# Like {{my_readfile()}}, but also stores the length of the file in {{len}},
+ *# so it can be used for binary files. {{len}} may be {{NULL}}.\n
+ *# The buffer is still null-terminated.
+ */
+char *my_readblob (const char *fn, size_t *len);
+
+/*@ unsigned long long my_fnv1a(const void *data, size_t len)
+ *# Computes the 64-bit FNV-1a hash of the {{len}} bytes at {{data}}.\n
+ *# It's fast and good enough to tell files and blobs apart, but it is not
+ *# a cryptographic hash.
+ */
+unsigned long long my_fnv1a(const void *data, size_t len);
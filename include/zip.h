@@ -0,0 +1,90 @@
+/*1 zip.h
+ *# Read-only access to ZIP archives, so that a game can be distributed as
+ *# (or developed from) a plain {{.zip}} file made with any archiver.\n
+ *# The central directory is read once when the archive is opened and indexed
+ *# by file name. Files may be stored or compressed with deflate; other
+ *# compression methods, encrypted files and ZIP64 archives are not supported.
+ *2 References
+ *{
+ ** https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+ ** http://en.wikipedia.org/wiki/Zip_%28file_format%29
+ *}
+ *2 API
+ */
+
+/*@ struct zip_file
+ *# Internal datastructure representing a {*ZIP*} file.
+ */
+struct zip_file;
+
+/*@ extern int zip_verbose
+ *# Sets verbose mode, like {{pak_verbose}}: \n
+ *{
+ ** 0 - disabled.
+ ** 1 - displays errors and warnings.\n
+ ** 2 - everything - intended for debugging.\n
+ *}
+ *# Defaults to 0.
+ */
+extern int zip_verbose;
+
+/*@ struct zip_file *zip_open(const char *name)
+ *# Opens an existing ZIP archive for reading.\n
+ *# The whole file is mapped into memory if possible, so that {{zip_get_view()}}
+ *# can return stored files without copying them.\n
+ *# Returns {{NULL}} if the file does not exist, is not a ZIP archive or on error.
+ */
+struct zip_file *zip_open(const char *name);
+
+/*@ void zip_close(struct zip_file *z)
+ *# Closes the archive and deallocates all memory allocated to it.
+ */
+void zip_close(struct zip_file *z);
+
+/*@ int zip_num_files(struct zip_file *z)
+ *# Returns the number of files in the archive. Directories are not counted.
+ */
+int zip_num_files(struct zip_file *z);
+
+/*@ const char *zip_nth_file(struct zip_file *z, int n)
+ *# Returns the name of the n-th file in the archive.
+ */
+const char *zip_nth_file(struct zip_file *z, int n);
+
+/*@ char *zip_get_blob(struct zip_file *z, const char *filename, size_t *len)
+ *# Retrieves the contents of a file within the archive as a blob of bytes.\n
+ *# {{len}} will be set to the number of bytes in the blob.\n
+ *# The blob needs to be {{free()}}ed afterwards.
+ */
+char *zip_get_blob(struct zip_file *z, const char *filename, size_t *len);
+
+/*@ char *zip_get_text(struct zip_file *z, const char *filename)
+ *# Retrieves the contents of a file within the archive as a null-terminated string.\n
+ *# The string needs to be {{free()}}ed afterwards.
+ */
+char *zip_get_text(struct zip_file *z, const char *filename);
+
+/*@ const char *zip_get_view(struct zip_file *z, const char *filename, size_t *len)
+ *# Retrieves the contents of a stored (uncompressed) file without copying it,
+ *# like {{pak_get_view()}}.\n
+ *# Returns {{NULL}} if the archive is not mapped, the file is compressed
+ *# or the file is not found.
+ */
+const char *zip_get_view(struct zip_file *z, const char *filename, size_t *len);
+
+/*@ int zip_is_view(struct zip_file *z, const void *ptr)
+ *# Returns 1 if {{ptr}} was returned by {{zip_get_view()}}, 0 otherwise.
+ */
+int zip_is_view(struct zip_file *z, const void *ptr);
+
+#ifdef USESDL
+/*@ SDL_RWops *zip_get_rwops(struct zip_file *z, const char *filename)
+ *# Opens a new read-only {{SDL_RWops}} stream over a file within the archive,
+ *# like {{pak_get_rwops()}}: Deflated files are inflated as they are read and
+ *# every stream has its own position, so several can be read at the same
+ *# time, even from different threads.\n
+ *# Close it with {{SDL_RWclose()}} before closing the archive.\n
+ *# It returns {{NULL}} if the file could not be found.
+ */
+SDL_RWops *zip_get_rwops(struct zip_file *z, const char *filename);
+#endif
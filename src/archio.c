@@ -0,0 +1,285 @@
+/*
+Shared by the PAK and ZIP readers. See archio.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+#ifdef USESDL
+#  include <SDL2/SDL.h>
+#  include <zlib.h>
+#endif
+
+#include "archio.h"
+
+const char *archio_map(const char *name, size_t *len) {
+#ifdef _WIN32
+	HANDLE file, mapping;
+	DWORD size;
+	const char *map;
+
+	file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return NULL;
+	size = GetFileSize(file, NULL);
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if(!mapping)
+		return NULL;
+	map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if(!map)
+		return NULL;
+	*len = size;
+	return map;
+#else
+	struct stat st;
+	void *m;
+	int fd = open(name, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED)
+		return NULL;
+	*len = st.st_size;
+	return m;
+#endif
+}
+
+void archio_unmap(const char *map, size_t len) {
+	if(!map)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(map);
+#else
+	munmap((void *)map, len);
+#endif
+}
+
+#ifdef USESDL
+/* A read-only stream over a range of bytes in a file */
+struct range_stream {
+	SDL_RWops *f;
+	Sint64 offset, length, pos;
+};
+
+static Sint64 range_size(SDL_RWops *rw) {
+	struct range_stream *s = rw->hidden.unknown.data1;
+	return s->length;
+}
+
+static Sint64 range_seek(SDL_RWops *rw, Sint64 offset, int whence) {
+	struct range_stream *s = rw->hidden.unknown.data1;
+	Sint64 pos;
+	switch(whence) {
+		case RW_SEEK_SET: pos = offset; break;
+		case RW_SEEK_CUR: pos = s->pos + offset; break;
+		case RW_SEEK_END: pos = s->length + offset; break;
+		default: return SDL_SetError("[archio] bad whence");
+	}
+	if(pos < 0 || pos > s->length)
+		return SDL_SetError("[archio] seek outside of file");
+	if(SDL_RWseek(s->f, s->offset + pos, RW_SEEK_SET) < 0)
+		return -1;
+	s->pos = pos;
+	return pos;
+}
+
+static size_t range_read(SDL_RWops *rw, void *ptr, size_t size, size_t maxnum) {
+	struct range_stream *s = rw->hidden.unknown.data1;
+	size_t n;
+	if(!size)
+		return 0;
+	/* Don't read past the end of the range into the next file */
+	n = (s->length - s->pos) / size;
+	if(n > maxnum)
+		n = maxnum;
+	n = SDL_RWread(s->f, ptr, size, n);
+	s->pos += n * size;
+	return n;
+}
+
+static size_t read_only_write(SDL_RWops *rw, const void *ptr, size_t size, size_t num) {
+	SDL_SetError("[archio] stream is read-only");
+	return 0;
+}
+
+static int range_close(SDL_RWops *rw) {
+	struct range_stream *s = rw->hidden.unknown.data1;
+	int rv = SDL_RWclose(s->f);
+	free(s);
+	SDL_FreeRW(rw);
+	return rv;
+}
+
+SDL_RWops *archio_open_range(const char *name, long offset, long length) {
+	struct range_stream *s;
+	SDL_RWops *rw;
+
+	s = malloc(sizeof *s);
+	if(!s) {
+		SDL_SetError("[archio] out of memory");
+		return NULL;
+	}
+	s->offset = offset;
+	s->length = length;
+	s->pos = 0;
+	s->f = SDL_RWFromFile(name, "rb");
+	if(!s->f) {
+		free(s);
+		return NULL;
+	}
+	if(SDL_RWseek(s->f, s->offset, RW_SEEK_SET) < 0) {
+		SDL_RWclose(s->f);
+		free(s);
+		return NULL;
+	}
+
+	rw = SDL_AllocRW();
+	if(!rw) {
+		SDL_RWclose(s->f);
+		free(s);
+		return NULL;
+	}
+	rw->size = range_size;
+	rw->seek = range_seek;
+	rw->read = range_read;
+	rw->write = read_only_write;
+	rw->close = range_close;
+	rw->type = SDL_RWOPS_UNKNOWN;
+	rw->hidden.unknown.data1 = s;
+	return rw;
+}
+
+#define INFLATE_BUFFER 4096
+struct inflate_stream {
+	SDL_RWops *src;
+	z_stream z;
+	Sint64 size, pos;
+	unsigned char buffer[INFLATE_BUFFER];
+};
+
+static Sint64 inflate_size(SDL_RWops *rw) {
+	struct inflate_stream *s = rw->hidden.unknown.data1;
+	return s->size;
+}
+
+static size_t inflate_read(SDL_RWops *rw, void *ptr, size_t size, size_t maxnum) {
+	struct inflate_stream *s = rw->hidden.unknown.data1;
+	size_t n, want;
+	int r;
+	if(!size)
+		return 0;
+	n = (s->size - s->pos) / size;
+	if(n > maxnum)
+		n = maxnum;
+	want = n * size;
+
+	s->z.next_out = ptr;
+	s->z.avail_out = want;
+	while(s->z.avail_out) {
+		if(!s->z.avail_in) {
+			s->z.avail_in = SDL_RWread(s->src, s->buffer, 1, INFLATE_BUFFER);
+			s->z.next_in = s->buffer;
+			if(!s->z.avail_in)
+				break;
+		}
+		r = inflate(&s->z, Z_NO_FLUSH);
+		if(r == Z_STREAM_END)
+			break;
+		if(r != Z_OK) {
+			SDL_SetError("[archio] %s", s->z.msg ? s->z.msg : "inflate failed");
+			break;
+		}
+	}
+	want -= s->z.avail_out;
+	s->pos += want;
+	return want / size;
+}
+
+static Sint64 inflate_seek(SDL_RWops *rw, Sint64 offset, int whence) {
+	struct inflate_stream *s = rw->hidden.unknown.data1;
+	char skip[512];
+	Sint64 pos;
+	switch(whence) {
+		case RW_SEEK_SET: pos = offset; break;
+		case RW_SEEK_CUR: pos = s->pos + offset; break;
+		case RW_SEEK_END: pos = s->size + offset; break;
+		default: return SDL_SetError("[archio] bad whence");
+	}
+	if(pos < 0 || pos > s->size)
+		return SDL_SetError("[archio] seek outside of file");
+	if(pos < s->pos) {
+		if(SDL_RWseek(s->src, 0, RW_SEEK_SET) < 0 || inflateReset(&s->z) != Z_OK)
+			return -1;
+		s->z.avail_in = 0;
+		s->pos = 0;
+	}
+	/* Inflate and discard everything up to pos */
+	while(s->pos < pos) {
+		size_t n = pos - s->pos;
+		if(n > sizeof skip)
+			n = sizeof skip;
+		if(inflate_read(rw, skip, 1, n) != n)
+			return -1;
+	}
+	return s->pos;
+}
+
+static int inflate_close(SDL_RWops *rw) {
+	struct inflate_stream *s = rw->hidden.unknown.data1;
+	int rv = SDL_RWclose(s->src);
+	inflateEnd(&s->z);
+	free(s);
+	SDL_FreeRW(rw);
+	return rv;
+}
+
+SDL_RWops *archio_open_inflate(SDL_RWops *src, long size, int format) {
+	struct inflate_stream *s;
+	SDL_RWops *rw;
+
+	s = calloc(1, sizeof *s);
+	if(!s) {
+		SDL_SetError("[archio] out of memory");
+		return NULL;
+	}
+	/* Negative window bits tell zlib there's no header */
+	if(inflateInit2(&s->z, format == ARCHIO_RAW ? -MAX_WBITS : MAX_WBITS) != Z_OK) {
+		SDL_SetError("[archio] unable to initialize zlib");
+		free(s);
+		return NULL;
+	}
+	s->src = src;
+	s->size = size;
+	s->pos = 0;
+
+	rw = SDL_AllocRW();
+	if(!rw) {
+		inflateEnd(&s->z);
+		free(s);
+		return NULL;
+	}
+	rw->size = inflate_size;
+	rw->seek = inflate_seek;
+	rw->read = inflate_read;
+	rw->write = read_only_write;
+	rw->close = inflate_close;
+	rw->type = SDL_RWOPS_UNKNOWN;
+	rw->hidden.unknown.data1 = s;
+	return rw;
+}
+#endif
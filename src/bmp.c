@@ -109,7 +109,7 @@ struct rgb_triplet {
 
 #define BM_BPP			4 /* Bytes per Pixel */
 #define BM_BLOB_SIZE(B)	(B->w * B->h * BM_BPP)
-#define BM_ROW_SIZE(B)	(B->w * BM_BPP)
+#define BM_ROW_SIZE(B)	(B->stride)
 
 #define BM_SETRGB(BMP, X, Y, R, G, B, A) do { \
 		int _p = ((Y) * BM_ROW_SIZE(BMP) + (X)*BM_BPP);	\
@@ -138,11 +138,15 @@ Bitmap *bm_create(int w, int h) {
 	
 	b->w = w;
 	b->h = h;
+	b->stride = w * BM_BPP;
+	b->parent = NULL;
 	
 	b->clip.x0 = 0;
 	b->clip.y0 = 0;
 	b->clip.x1 = w;
 	b->clip.y1 = h;
+	
+	b->version = 0;
 		
 	b->data = malloc(BM_BLOB_SIZE(b));
 	memset(b->data, 0x00, BM_BLOB_SIZE(b));
@@ -205,6 +209,49 @@ static BmReader make_rwops_reader(SDL_RWops *rw) {
 }
 #endif
 
+/* Reads a bitmap straight out of a block of memory, such as a file in a 
+	memory mapped PAK archive. */
+typedef struct {
+	const unsigned char *data;
+	long len, pos;
+} BmMemStream;
+
+static size_t mem_fread(void *ptr, size_t size, size_t nobj, BmMemStream *m) {
+	size_t n;
+	if(!size)
+		return 0;
+	n = (m->len - m->pos) / size;
+	if(n > nobj)
+		n = nobj;
+	memcpy(ptr, m->data + m->pos, n * size);
+	m->pos += n * size;
+	return n;
+}
+static long mem_ftell(BmMemStream *m) {
+	return m->pos;
+}
+static int mem_fseek(BmMemStream *m, long offset, int origin) {
+	long pos;
+	switch (origin) {
+		case SEEK_SET: pos = offset; break;
+		case SEEK_CUR: pos = m->pos + offset; break;
+		case SEEK_END: pos = m->len + offset; break;
+		default: return 1;
+	}
+	if(pos < 0 || pos > m->len)
+		return 1;
+	m->pos = pos;
+	return 0;
+}
+static BmReader make_mem_reader(BmMemStream *m) {
+	BmReader rd;
+	rd.data = m;
+	rd.fread = (size_t(*)(void*,size_t,size_t,void*))mem_fread;
+	rd.ftell = (long(*)(void* ))mem_ftell;
+	rd.fseek = (int(*)(void*,long,int))mem_fseek;
+	return rd;
+}
+
 Bitmap *bm_load(const char *filename) {	
 	Bitmap *bmp;
 	FILE *f = fopen(filename, "rb");
@@ -219,6 +266,12 @@ static Bitmap *bm_load_bmp_rd(BmReader rd);
 static Bitmap *bm_load_gif_rd(BmReader rd);
 static Bitmap *bm_load_pcx_rd(BmReader rd);
 #ifdef USEPNG
+static Bitmap *bm_load_png_rd(BmReader rd);
+#endif
+#ifdef USEJPG
+static Bitmap *bm_load_jpg_rd(BmReader rd);
+#endif
+#ifdef USEPNG
 static Bitmap *bm_load_png_fp(FILE *f);
 #endif
 #ifdef USEJPG
@@ -574,7 +627,7 @@ error:
 	bmp = NULL;
 done:
 	if (info != NULL) png_free_data(png, info, PNG_FREE_ALL, -1);
-	if (png != NULL) png_destroy_read_struct(&png, NULL, NULL);
+	if (png != NULL) png_destroy_read_struct(&png, &info, NULL);
 	if(rows) {
 		for(y = 0; y < h; y++) {
 			free(rows[y]);
@@ -772,13 +825,6 @@ static int bm_save_jpg(Bitmap *b, const char *fname) {
 /* Some functions to load graphics through the SDL_RWops
     related functions.
 */
-#  ifdef USEPNG
-static Bitmap *bm_load_png_rw(SDL_RWops *rw);
-#  endif
-#  ifdef USEJPG
-static Bitmap *bm_load_jpg_rw(SDL_RWops *rw);
-#  endif
-
 Bitmap *bm_load_rw(SDL_RWops *rw) {
 	unsigned char magic[3];	
     long start = SDL_RWtell(rw);
@@ -799,14 +845,18 @@ Bitmap *bm_load_rw(SDL_RWops *rw) {
 	SDL_RWseek(rw, start, RW_SEEK_SET);
     
 #  ifdef USEJPG
-	if(isjpg)
-		return bm_load_jpg_rw(rw);
+	if(isjpg) {
+		BmReader rd = make_rwops_reader(rw);
+		return bm_load_jpg_rd(rd);
+	}
 #  else
 	(void)isjpg;
 #  endif
 #  ifdef USEPNG
-	if(ispng)
-		return bm_load_png_rw(rw);
+	if(ispng) {
+		BmReader rd = make_rwops_reader(rw);
+		return bm_load_png_rd(rd);
+	}
 #  else
 	(void)ispng;
 #  endif
@@ -825,18 +875,22 @@ Bitmap *bm_load_rw(SDL_RWops *rw) {
     return NULL;
 }
 
-#  ifdef USEPNG
+
+#endif /* USESDL */
+
+#ifdef USEPNG
 /* 
-Code to read a PNG from a SDL_RWops
+Code to read a PNG through a BmReader
 http://www.libpng.org/pub/png/libpng-1.2.5-manual.html 
 http://blog.hammerian.net/2009/reading-png-images-from-memory/
 */
-static void read_rwo_data(png_structp png_ptr, png_bytep data, png_size_t length) {
-    SDL_RWops *rw = png_get_io_ptr(png_ptr);
-    SDL_RWread(rw, data, 1, length);
+static void read_rd_data(png_structp png_ptr, png_bytep data, png_size_t length) {
+    BmReader *rd = png_get_io_ptr(png_ptr);
+    if(rd->fread(data, 1, length, rd->data) != length)
+        png_error(png_ptr, "unexpected end of data");
 }
 
-static Bitmap *bm_load_png_rw(SDL_RWops *rw) {
+static Bitmap *bm_load_png_rd(BmReader rd) {
     	Bitmap *bmp = NULL;
 	
 	unsigned char header[8];
@@ -847,7 +901,7 @@ static Bitmap *bm_load_png_rw(SDL_RWops *rw) {
 
 	int w, h, ct, bpp, x, y;
 
-	if((SDL_RWread(rw, header, 1, 8) != 8) || png_sig_cmp(header, 0, 8)) {
+	if((rd.fread(header, 1, 8, rd.data) != 8) || png_sig_cmp(header, 0, 8)) {
 		goto error;
 	}
 	
@@ -864,7 +918,7 @@ static Bitmap *bm_load_png_rw(SDL_RWops *rw) {
 	}
 	
 	png_init_io(png, NULL);
-    png_set_read_fn(png, rw, read_rwo_data);
+    png_set_read_fn(png, &rd, read_rd_data);
         
 	png_set_sig_bytes(png, 8);
 	
@@ -921,7 +975,7 @@ error:
 	bmp = NULL;
 done:
 	if (info != NULL) png_free_data(png, info, PNG_FREE_ALL, -1);
-	if (png != NULL) png_destroy_read_struct(&png, NULL, NULL);
+	if (png != NULL) png_destroy_read_struct(&png, &info, NULL);
 	if(rows) {
 		for(y = 0; y < h; y++) {
 			free(rows[y]);
@@ -930,31 +984,31 @@ done:
 	}
 	return bmp;
 }
-#  endif /* USEPNG */
-#  ifdef USEJPG
+#endif /* USEPNG */
 
+#ifdef USEJPG
 /*
-Code to read a JPEG from an SDL_RWops.
+Code to read a JPEG through a BmReader.
 Refer to jdatasrc.c in libjpeg's code.
 See also 
 http://www.cs.stanford.edu/~acoates/decompressJpegFromMemory.txt
 */
 #define JPEG_INPUT_BUFFER_SIZE  4096
-struct rw_jpeg_src_mgr {
+struct rd_jpeg_src_mgr {
     struct jpeg_source_mgr pub;
-    SDL_RWops *rw;
+    BmReader *rd;
     JOCTET *buffer;
     boolean start_of_file;
 };
 
-static void rw_init_source(j_decompress_ptr cinfo) {
-    struct rw_jpeg_src_mgr *src = (struct rw_jpeg_src_mgr *)cinfo->src;
+static void rd_init_source(j_decompress_ptr cinfo) {
+    struct rd_jpeg_src_mgr *src = (struct rd_jpeg_src_mgr *)cinfo->src;
     src->start_of_file = TRUE;
 }
 
-static boolean rw_fill_input_buffer(j_decompress_ptr cinfo) {
-    struct rw_jpeg_src_mgr *src = (struct rw_jpeg_src_mgr *)cinfo->src;
-    size_t nbytes = SDL_RWread(src->rw, src->buffer, 1, JPEG_INPUT_BUFFER_SIZE);
+static boolean rd_fill_input_buffer(j_decompress_ptr cinfo) {
+    struct rd_jpeg_src_mgr *src = (struct rd_jpeg_src_mgr *)cinfo->src;
+    size_t nbytes = src->rd->fread(src->buffer, 1, JPEG_INPUT_BUFFER_SIZE, src->rd->data);
     
     if(nbytes <= 0) {
         /*if(src->start_of_file) 
@@ -972,8 +1026,8 @@ static boolean rw_fill_input_buffer(j_decompress_ptr cinfo) {
     return TRUE;
 }
 
-static void rw_skip_input_data(j_decompress_ptr cinfo, long nbytes) {
-    struct rw_jpeg_src_mgr *src = (struct rw_jpeg_src_mgr *)cinfo->src;
+static void rd_skip_input_data(j_decompress_ptr cinfo, long nbytes) {
+    struct rd_jpeg_src_mgr *src = (struct rd_jpeg_src_mgr *)cinfo->src;
     if(nbytes > 0) {
         while(nbytes > src->pub.bytes_in_buffer) {
             nbytes -= src->pub.bytes_in_buffer;
@@ -984,33 +1038,33 @@ static void rw_skip_input_data(j_decompress_ptr cinfo, long nbytes) {
     }
 }
 
-static void rw_term_source(j_decompress_ptr cinfo) {
+static void rd_term_source(j_decompress_ptr cinfo) {
     /* Apparently nothing to do here */
 }
 
-static void rw_set_source_mgr(j_decompress_ptr cinfo, SDL_RWops *rw) {
-    struct rw_jpeg_src_mgr *src;
+static void rd_set_source_mgr(j_decompress_ptr cinfo, BmReader *rd) {
+    struct rd_jpeg_src_mgr *src;
     if(!cinfo->src) {
         cinfo->src = (struct jpeg_source_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof *src);
-        src = (struct rw_jpeg_src_mgr *)cinfo->src;
+        src = (struct rd_jpeg_src_mgr *)cinfo->src;
         src->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, JPEG_INPUT_BUFFER_SIZE * sizeof(JOCTET));
     }
     
-    src = (struct rw_jpeg_src_mgr *)cinfo->src;
+    src = (struct rd_jpeg_src_mgr *)cinfo->src;
     
-    src->pub.init_source = rw_init_source;
-    src->pub.fill_input_buffer = rw_fill_input_buffer;
-    src->pub.skip_input_data = rw_skip_input_data;
-    src->pub.term_source = rw_term_source;
+    src->pub.init_source = rd_init_source;
+    src->pub.fill_input_buffer = rd_fill_input_buffer;
+    src->pub.skip_input_data = rd_skip_input_data;
+    src->pub.term_source = rd_term_source;
     src->pub.resync_to_restart = jpeg_resync_to_restart;
     
     src->pub.bytes_in_buffer = 0;
     src->pub.next_input_byte = NULL;
         
-    src->rw = rw;
+    src->rd = rd;
 }
 
-static Bitmap *bm_load_jpg_rw(SDL_RWops *rw) {
+static Bitmap *bm_load_jpg_rd(BmReader rd) {
     struct jpeg_decompress_struct cinfo;
 	struct jpg_err_handler jerr;
 	Bitmap *bmp = NULL;
@@ -1027,7 +1081,7 @@ static Bitmap *bm_load_jpg_rw(SDL_RWops *rw) {
 	jpeg_create_decompress(&cinfo);	
     
 	/* jpeg_stdio_src(&cinfo, f); */
-    rw_set_source_mgr(&cinfo, rw);
+    rd_set_source_mgr(&cinfo, &rd);
 	
 	jpeg_read_header(&cinfo, TRUE);	
 	cinfo.out_color_space = JCS_RGB;
@@ -1060,9 +1114,41 @@ static Bitmap *bm_load_jpg_rw(SDL_RWops *rw) {
 	
 	return bmp;
 }
-#  endif /* USEJPG */
+#endif /* USEJPG */
 
-#endif /* USESDL */
+Bitmap *bm_load_mem(const void *data, long len) {
+	BmMemStream m;
+	BmReader rd;
+	const unsigned char *magic = data;
+	
+	if(!data || len < 3)
+		return NULL;
+	
+	m.data = data;
+	m.len = len;
+	m.pos = 0;
+	rd = make_mem_reader(&m);
+	
+	/* Same detection as bm_load_fp() */
+	if(!memcmp(magic, "BM", 2))
+		return bm_load_bmp_rd(rd);
+	if(!memcmp(magic, "GIF", 3))
+		return bm_load_gif_rd(rd);
+	if(magic[0] == 0xFF && magic[1] == 0xD8) {
+#ifdef USEJPG
+		return bm_load_jpg_rd(rd);
+#else
+		return NULL;
+#endif
+	}
+	if(magic[0] == 0x0A)
+		return bm_load_pcx_rd(rd);
+#ifdef USEPNG
+	return bm_load_png_rd(rd);
+#else
+	return NULL;
+#endif
+}
 
 /* These functions are used for the palettes in my GIF and PCX support: */
 
@@ -1076,10 +1162,11 @@ static int cnt_comp_mask(const void*ap, const void*bp);
  * is useful for bsrch_palette_lookup().
  */
 static int count_colors_build_palette(Bitmap *b, struct rgb_triplet rgb[256]) {	
-	int count = 1, i, c;
+	int count = 1, i, c, y;
 	int npx = b->w * b->h;
 	int *sort = malloc(npx * sizeof *sort);
-	memcpy(sort, b->data, npx * sizeof *sort);
+	for(y = 0; y < b->h; y++)
+		memcpy(sort + y * b->w, b->data + y * BM_ROW_SIZE(b), b->w * sizeof *sort);
 	qsort(sort, npx, sizeof(int), cnt_comp_mask);
 	c = sort[0] & 0x00FFFFFF;
 	rgb[0].r = (c >> 16) & 0xFF;
@@ -2137,9 +2224,21 @@ static int bm_save_pcx(Bitmap *b, const char *fname) {
 	return rv;
 }
 
+/* Copies the pixels of src into dst row by row. They must have the same dimensions. */
+static void copy_rows(Bitmap *dst, Bitmap *src) {
+	int y;
+	assert(dst->w == src->w && dst->h == src->h);
+	if(dst->stride == src->stride && src->stride == src->w * BM_BPP) {
+		memcpy(dst->data, src->data, BM_BLOB_SIZE(src));
+		return;
+	}
+	for(y = 0; y < src->h; y++)
+		memcpy(dst->data + y * BM_ROW_SIZE(dst), src->data + y * BM_ROW_SIZE(src), src->w * BM_BPP);
+}
+
 Bitmap *bm_copy(Bitmap *b) {
 	Bitmap *out = bm_create(b->w, b->h);
-	memcpy(out->data, b->data, BM_BLOB_SIZE(b));
+	copy_rows(out, b);
 	
 	out->color = b->color;
 	
@@ -2156,7 +2255,7 @@ Bitmap *bm_copy(Bitmap *b) {
 
 void bm_free(Bitmap *b) {
 	if(!b) return;
-	if(b->data) free(b->data);
+	if(b->data && !b->parent) free(b->data);
 	if(b->font && b->font->dtor)
 		b->font->dtor(b->font);
 	free(b);
@@ -2167,11 +2266,15 @@ Bitmap *bm_bind(int w, int h, unsigned char *data) {
 	
 	b->w = w;
 	b->h = h;
+	b->stride = w * BM_BPP;
+	b->parent = NULL;
 	
 	b->clip.x0 = 0;
 	b->clip.y0 = 0;
 	b->clip.x1 = w;
 	b->clip.y1 = h;
+	
+	b->version = 0;
 		
 	b->data = data;
 	
@@ -2197,13 +2300,50 @@ void bm_unbind(Bitmap *b) {
 	free(b);
 }
 
+Bitmap *bm_view(Bitmap *parent, int x, int y, int w, int h) {
+	Bitmap *b;
+	
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	if(x + w > parent->w) w = parent->w - x;
+	if(y + h > parent->h) h = parent->h - y;
+	if(w <= 0 || h <= 0)
+		return NULL;
+	
+	b = malloc(sizeof *b);
+	if(!b)
+		return NULL;
+	
+	b->w = w;
+	b->h = h;
+	b->stride = parent->stride;
+	b->parent = parent;
+	b->data = parent->data + y * BM_ROW_SIZE(parent) + x * BM_BPP;
+	
+	b->clip.x0 = 0;
+	b->clip.y0 = 0;
+	b->clip.x1 = w;
+	b->clip.y1 = h;
+	
+	b->version = 0;
+	
+	b->font = NULL;
+#ifndef NO_FONTS
+	bm_std_font(b, BM_FONT_NORMAL);
+#endif
+	
+	b->color = parent->color;
+	
+	return b;
+}
+
 void bm_flip_vertical(Bitmap *b) {
 	int y;
-	size_t s = BM_ROW_SIZE(b);
+	size_t s = b->w * BM_BPP;
 	unsigned char *trow = malloc(s);
 	for(y = 0; y < b->h/2; y++) {
-		unsigned char *row1 = &b->data[y * s];
-		unsigned char *row2 = &b->data[(b->h - y - 1) * s];
+		unsigned char *row1 = &b->data[y * BM_ROW_SIZE(b)];
+		unsigned char *row2 = &b->data[(b->h - y - 1) * BM_ROW_SIZE(b)];
 		memcpy(trow, row1, s);
 		memcpy(row1, row2, s);
 		memcpy(row2, trow, s);
@@ -2291,6 +2431,18 @@ void bm_clip(Bitmap *b, int x0, int y0, int x1, int y1) {
 	b->clip.y1 = y1;
 }
 
+void bm_touch(Bitmap *b) {
+	while(b->parent)
+		b = b->parent;
+	b->version++;
+}
+
+unsigned int bm_version(Bitmap *b) {
+	while(b->parent)
+		b = b->parent;
+	return b->version;
+}
+
 void bm_unclip(Bitmap *b) {
 	b->clip.x0 = 0;
 	b->clip.y0 = 0;
@@ -2298,8 +2450,250 @@ void bm_unclip(Bitmap *b) {
 	b->clip.y1 = b->h;
 }
 
-void bm_blit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
-	int x,y, i, j;
+/* Blitting kernels *******************************************************
+
+The blit functions clip the blit rectangle once and then hand each row 
+to a span kernel. The kernels come in scalar and SSE2 flavours, and the 
+colour-keyed one also has an AVX2 version. The best ones for the CPU 
+we're running on are chosen the first time a blit happens.
+Compile with -DNO_SIMD to get only the scalar versions.
+
+All the kernels take the same parameters: {{mask}} is the RGB colour
+key of the source bitmap and {{a}} is a constant alpha value. Kernels
+that don't need them ignore them.
+*/
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define BM_X86_SIMD
+#  include <immintrin.h>
+#endif
+
+typedef void (*bm_span_fun)(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a);
+
+/* x / 255 with rounding, for 0 <= x <= 255*255 */
+#define DIV255(x) ((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+
+static void mask_span_c(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	int i;
+	for(i = 0; i < n; i++) {
+		unsigned int c = s[i] & 0xFFFFFF;
+		if(c != mask)
+			d[i] = c;
+	}
+}
+
+/* Source-over: d = s * sa + d * (1 - sa) */
+static void alpha_span_c(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	int i, k;
+	for(i = 0; i < n; i++) {
+		unsigned int sc = s[i] | 0xFF000000, dc = d[i], r = 0;
+		unsigned int sa = s[i] >> 24, da = 255 - sa;
+		if(sa == 0) 
+			continue;
+		for(k = 0; k < 32; k += 8) {
+			unsigned int x = ((sc >> k) & 0xFF) * sa + ((dc >> k) & 0xFF) * da;
+			r |= DIV255(x) << k;
+		}
+		d[i] = r;
+	}
+}
+
+/* Same as alpha_span_c(), but with a constant alpha and the colour key */
+static void fade_span_c(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	int i, k;
+	for(i = 0; i < n; i++) {
+		unsigned int sc = s[i] | 0xFF000000, dc = d[i], r = 0;
+		if((s[i] & 0xFFFFFF) == mask) 
+			continue;
+		for(k = 0; k < 32; k += 8) {
+			unsigned int x = ((sc >> k) & 0xFF) * a + ((dc >> k) & 0xFF) * (255 - a);
+			r |= DIV255(x) << k;
+		}
+		d[i] = r;
+	}
+}
+
+/* Saturating add of the RGB channels. The destination alpha is kept. */
+static void add_span_c(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	int i, k;
+	for(i = 0; i < n; i++) {
+		unsigned int dc = d[i], r = dc & 0xFF000000;
+		for(k = 0; k < 24; k += 8) {
+			unsigned int x = ((s[i] >> k) & 0xFF) + ((dc >> k) & 0xFF);
+			r |= (x > 0xFF ? 0xFF : x) << k;
+		}
+		d[i] = r;
+	}
+}
+
+/* Multiplies the RGB channels. The destination alpha is kept. */
+static void mul_span_c(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	int i, k;
+	for(i = 0; i < n; i++) {
+		unsigned int dc = d[i], r = dc & 0xFF000000;
+		for(k = 0; k < 24; k += 8) {
+			unsigned int x = ((s[i] >> k) & 0xFF) * ((dc >> k) & 0xFF);
+			r |= DIV255(x) << k;
+		}
+		d[i] = r;
+	}
+}
+
+#ifdef BM_X86_SIMD
+__attribute__((target("sse2")))
+static void mask_span_sse2(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	const __m128i rgb = _mm_set1_epi32(0xFFFFFF);
+	const __m128i key = _mm_set1_epi32(mask);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i sp = _mm_and_si128(_mm_loadu_si128((const __m128i*)(s + i)), rgb);
+		__m128i dp = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i eq = _mm_cmpeq_epi32(sp, key);
+		/* Keep the destination where the source matches the mask */
+		dp = _mm_or_si128(_mm_and_si128(eq, dp), _mm_andnot_si128(eq, sp));
+		_mm_storeu_si128((__m128i*)(d + i), dp);
+	}
+	mask_span_c(d + i, s + i, n - i, mask, a);
+}
+
+__attribute__((target("avx2")))
+static void mask_span_avx2(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	const __m256i rgb = _mm256_set1_epi32(0xFFFFFF);
+	const __m256i key = _mm256_set1_epi32(mask);
+	int i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256i sp = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(s + i)), rgb);
+		__m256i dp = _mm256_loadu_si256((const __m256i*)(d + i));
+		__m256i eq = _mm256_cmpeq_epi32(sp, key);
+		dp = _mm256_blendv_epi8(sp, dp, eq);
+		_mm256_storeu_si256((__m256i*)(d + i), dp);
+	}
+	mask_span_sse2(d + i, s + i, n - i, mask, a);
+}
+
+/* DIV255() on 8 16-bit lanes */
+__attribute__((target("sse2")))
+static inline __m128i div255_epu16(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Blends 2 pixels in 16-bit lanes: (s * a + d * (255 - a)) / 255 */
+__attribute__((target("sse2")))
+static inline __m128i lerp_epu16(__m128i s, __m128i d, __m128i a) {
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+	return div255_epu16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia)));
+}
+
+#define SPREAD_ALPHA(x) _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3))
+
+__attribute__((target("sse2")))
+static void alpha_span_sse2(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i sp = _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i dp = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i so = _mm_or_si128(sp, opaque);
+		__m128i lo = lerp_epu16(_mm_unpacklo_epi8(so, zero), _mm_unpacklo_epi8(dp, zero), 
+				SPREAD_ALPHA(_mm_unpacklo_epi8(sp, zero)));
+		__m128i hi = lerp_epu16(_mm_unpackhi_epi8(so, zero), _mm_unpackhi_epi8(dp, zero), 
+				SPREAD_ALPHA(_mm_unpackhi_epi8(sp, zero)));
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(lo, hi));
+	}
+	alpha_span_c(d + i, s + i, n - i, mask, a);
+}
+
+__attribute__((target("sse2")))
+static void fade_span_sse2(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
+	const __m128i rgb = _mm_set1_epi32(0xFFFFFF);
+	const __m128i key = _mm_set1_epi32(mask);
+	const __m128i av = _mm_set1_epi16(a);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i sp = _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i dp = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(sp, rgb), key);
+		__m128i so = _mm_or_si128(sp, opaque);
+		__m128i lo = lerp_epu16(_mm_unpacklo_epi8(so, zero), _mm_unpacklo_epi8(dp, zero), av);
+		__m128i hi = lerp_epu16(_mm_unpackhi_epi8(so, zero), _mm_unpackhi_epi8(dp, zero), av);
+		__m128i r = _mm_packus_epi16(lo, hi);
+		r = _mm_or_si128(_mm_and_si128(eq, dp), _mm_andnot_si128(eq, r));
+		_mm_storeu_si128((__m128i*)(d + i), r);
+	}
+	fade_span_c(d + i, s + i, n - i, mask, a);
+}
+
+__attribute__((target("sse2")))
+static void add_span_sse2(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	const __m128i rgb = _mm_set1_epi32(0xFFFFFF);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i sp = _mm_and_si128(_mm_loadu_si128((const __m128i*)(s + i)), rgb);
+		__m128i dp = _mm_loadu_si128((const __m128i*)(d + i));
+		_mm_storeu_si128((__m128i*)(d + i), _mm_adds_epu8(dp, sp));
+	}
+	add_span_c(d + i, s + i, n - i, mask, a);
+}
+
+__attribute__((target("sse2")))
+static void mul_span_sse2(unsigned int *d, const unsigned int *s, int n, unsigned int mask, int a) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128i sp = _mm_or_si128(_mm_loadu_si128((const __m128i*)(s + i)), opaque);
+		__m128i dp = _mm_loadu_si128((const __m128i*)(d + i));
+		__m128i lo = div255_epu16(_mm_mullo_epi16(_mm_unpacklo_epi8(sp, zero), _mm_unpacklo_epi8(dp, zero)));
+		__m128i hi = div255_epu16(_mm_mullo_epi16(_mm_unpackhi_epi8(sp, zero), _mm_unpackhi_epi8(dp, zero)));
+		_mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(lo, hi));
+	}
+	mul_span_c(d + i, s + i, n - i, mask, a);
+}
+#endif
+
+static bm_span_fun mask_span = mask_span_c;
+static bm_span_fun alpha_span = alpha_span_c;
+static bm_span_fun fade_span = fade_span_c;
+static bm_span_fun add_span = add_span_c;
+static bm_span_fun mul_span = mul_span_c;
+static const char *kernel_name = "C";
+static int kernels_selected = 0;
+
+static void select_kernels() {
+	kernels_selected = 1;
+#ifdef BM_X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		mask_span = mask_span_sse2;
+		alpha_span = alpha_span_sse2;
+		fade_span = fade_span_sse2;
+		add_span = add_span_sse2;
+		mul_span = mul_span_sse2;
+		kernel_name = "SSE2";
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		mask_span = mask_span_avx2;
+		kernel_name = "AVX2";
+	}
+#endif
+}
+
+const char *bm_kernel_name() {
+	if(!kernels_selected)
+		select_kernels();
+	return kernel_name;
+}
+
+/* Clips the blit of a w*h area from sx,sy on a sw*sh source to dx,dy on dst 
+ * against the bounds of the source and the clipping rectangle of dst.
+ * Returns 0 if there is nothing left to draw.
+ */
+static int clip_blit(Bitmap *dst, int *dxp, int *dyp, int sw, int sh, int *sxp, int *syp, int *wp, int *hp) {
+	int dx = *dxp, dy = *dyp, sx = *sxp, sy = *syp, w = *wp, h = *hp;
 	
 	if(sx < 0) {
 		int delta = -sx;
@@ -2315,8 +2709,8 @@ void bm_blit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, in
 		dx = dst->clip.x0;
 	}
 
-	if(sx + w > src->w) {
-		int delta = sx + w - src->w;
+	if(sx + w > sw) {
+		int delta = sx + w - sw;
 		w -= delta;
 	}
 	
@@ -2339,8 +2733,8 @@ void bm_blit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, in
 		dy = dst->clip.y0;
 	}
 	
-	if(sy + h > src->h) {
-		int delta = sy + h - src->h;
+	if(sy + h > sh) {
+		int delta = sy + h - sh;
 		h -= delta;
 	}
 	
@@ -2350,130 +2744,214 @@ void bm_blit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, in
 	}
 	
 	if(w <= 0 || h <= 0)
-		return;
+		return 0;
 	if(dx >= dst->clip.x1 || dx + w < dst->clip.x0)
-		return;
+		return 0;
 	if(dy >= dst->clip.y1 || dy + h < dst->clip.y0)
-		return;
-	if(sx >= src->w || sx + w < 0)
-		return;
-	if(sy >= src->h || sy + h < 0)
-		return;
-	
-	if(sx + w > src->w) {
-		int delta = sx + w - src->w;
-		w -= delta;
-	}
-	
-	if(sy + h > src->h) {
-		int delta = sy + h - src->h;
-		h -= delta;
-	}
+		return 0;
+	if(sx >= sw || sx + w < 0)
+		return 0;
+	if(sy >= sh || sy + h < 0)
+		return 0;
 	
 	assert(dx >= 0 && dx + w <= dst->clip.x1);
 	assert(dy >= 0 && dy + h <= dst->clip.y1);	
-	assert(sx >= 0 && sx + w <= src->w);
-	assert(sy >= 0 && sy + h <= src->h);
+	assert(sx >= 0 && sx + w <= sw);
+	assert(sy >= 0 && sy + h <= sh);
 	
-	j = sy;
-	for(y = dy; y < dy + h; y++) {		
-		i = sx;
-		for(x = dx; x < dx + w; x++) {
-			int c = BM_GET(src, i, j);
-			BM_SET(dst, x, y, c);
-			i++;
-		}
-		j++;
-	}
+	*dxp = dx; *dyp = dy; *sxp = sx; *syp = sy; *wp = w; *hp = h;
+	return 1;
 }
 
-void bm_maskedblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
-	int x,y, i, j;
-
-	if(sx < 0) {
-		int delta = -sx;
-		sx = 0;
-		dx += delta;
-		w -= delta;
-	}
+void bm_blit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
+	int j;
+	size_t len;
+	unsigned char *dp, *sp;
 	
-	if(dx < dst->clip.x0) {
-		int delta = dst->clip.x0 - dx;
-		sx += delta;
-		w -= delta;
-		dx = dst->clip.x0;
+	if(!clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	
+	len = w * BM_BPP;
+	dp = dst->data + dy * BM_ROW_SIZE(dst) + dx * BM_BPP;
+	sp = src->data + sy * BM_ROW_SIZE(src) + sx * BM_BPP;
+	if(dst == src && dy > sy) {
+		/* Overlapping rows: copy bottom-up */
+		dp += (h - 1) * BM_ROW_SIZE(dst);
+		sp += (h - 1) * BM_ROW_SIZE(src);
+		for(j = 0; j < h; j++) {
+			memmove(dp, sp, len);
+			dp -= BM_ROW_SIZE(dst);
+			sp -= BM_ROW_SIZE(src);
+		}
+	} else if(dst == src) {
+		for(j = 0; j < h; j++) {
+			memmove(dp, sp, len);
+			dp += BM_ROW_SIZE(dst);
+			sp += BM_ROW_SIZE(src);
+		}
+	} else {
+		for(j = 0; j < h; j++) {
+			memcpy(dp, sp, len);
+			dp += BM_ROW_SIZE(dst);
+			sp += BM_ROW_SIZE(src);
+		}
 	}
+}
 
-	if(sx + w > src->w) {
-		int delta = sx + w - src->w;
-		w -= delta;
-	}
+/* Clips the blit and then runs the span kernel on each row */
+static void blit_spans(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h, bm_span_fun *span, int a) {
+	int j;
+	unsigned int mask = src->color & 0xFFFFFF;
+	unsigned char *dp, *sp;
 	
-	if(dx + w > dst->clip.x1) {
-		int delta = dx + w - dst->clip.x1;
-		w -= delta;
+	if(!clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	if(!kernels_selected)
+		select_kernels();
+	
+	dp = dst->data + dy * BM_ROW_SIZE(dst) + dx * BM_BPP;
+	sp = src->data + sy * BM_ROW_SIZE(src) + sx * BM_BPP;
+	for(j = 0; j < h; j++) {
+		(*span)((unsigned int *)dp, (const unsigned int *)sp, w, mask, a);
+		dp += BM_ROW_SIZE(dst);
+		sp += BM_ROW_SIZE(src);
 	}
+}
 
-	if(sy < 0) {
-		int delta = -sy;
-		sy = 0;
-		dy += delta;
-		h -= delta;
-	}
+void bm_maskedblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
+	blit_spans(dst, dx, dy, src, sx, sy, w, h, &mask_span, 0);
+}
+
+void bm_alphablit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
+	blit_spans(dst, dx, dy, src, sx, sy, w, h, &alpha_span, 0);
+}
+
+void bm_fadeblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h, int a) {
+	if(a <= 0)
+		return;
+	if(a > 255)
+		a = 255;
+	blit_spans(dst, dx, dy, src, sx, sy, w, h, &fade_span, a);
+}
+
+void bm_addblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
+	blit_spans(dst, dx, dy, src, sx, sy, w, h, &add_span, 0);
+}
+
+void bm_mulblit(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int w, int h) {
+	blit_spans(dst, dx, dy, src, sx, sy, w, h, &mul_span, 0);
+}
+
+/* Run-length encoded sprites *******************************************
+
+Each row of the sprite is stored in the {{data}} array at {{rows[y]}} as
+the number of opaque runs in the row, followed by the runs themselves. 
+Each run is its starting x position, its length n and then its n pixels.
+*/
+
+BmRle *bm_rle_create(Bitmap *b) {
+	int x, y, n;
+	unsigned int *p, mask = b->color & 0xFFFFFF;
+	size_t size = 0;
+	BmRle *r;
 	
-	if(dy < dst->clip.y0) {
-		int delta = dst->clip.y0 - dy;
-		sy += delta;
-		h -= delta;
-		dy = dst->clip.y0;
+	/* First pass to determine the size of the data */
+	for(y = 0; y < b->h; y++) {
+		p = (unsigned int *)(b->data + y * BM_ROW_SIZE(b));
+		size++;
+		for(x = 0; x < b->w;) {
+			if((p[x] & 0xFFFFFF) == mask) {
+				x++;
+				continue;
+			}
+			for(n = 0; x < b->w && (p[x] & 0xFFFFFF) != mask; x++, n++);
+			size += 2 + n;
+		}
 	}
 	
-	if(sy + h > src->h) {
-		int delta = sy + h - src->h;
-		h -= delta;
+	r = malloc(sizeof *r);
+	if(!r)
+		return NULL;
+	r->w = b->w;
+	r->h = b->h;
+	r->color = mask;
+	r->rows = malloc(b->h * sizeof *r->rows);
+	r->data = malloc(size * sizeof *r->data);
+	if(!r->rows || !r->data) {
+		bm_rle_free(r);
+		return NULL;
 	}
 	
-	if(dy + h > dst->clip.y1) {
-		int delta = dy + h - dst->clip.y1;
-		h -= delta;
+	size = 0;
+	for(y = 0; y < b->h; y++) {
+		size_t count;
+		p = (unsigned int *)(b->data + y * BM_ROW_SIZE(b));
+		r->rows[y] = size;
+		count = size++;
+		r->data[count] = 0;
+		for(x = 0; x < b->w;) {
+			size_t len;
+			if((p[x] & 0xFFFFFF) == mask) {
+				x++;
+				continue;
+			}
+			r->data[size++] = x;
+			len = size++;
+			for(n = 0; x < b->w && (p[x] & 0xFFFFFF) != mask; x++, n++)
+				r->data[size++] = p[x] & 0xFFFFFF;
+			r->data[len] = n;
+			r->data[count]++;
+		}
 	}
-	
-	if(w <= 0 || h <= 0)
-		return;
-	if(dx >= dst->clip.x1 || dx + w < dst->clip.x0)
-		return;
-	if(dy >= dst->clip.y1 || dy + h < dst->clip.y0)
-		return;
-	if(sx >= src->w || sx + w < 0)
-		return;
-	if(sy >= src->h || sy + h < 0)
+	return r;
+}
+
+void bm_rle_free(BmRle *r) {
+	if(!r) 
 		return;
+	free(r->rows);
+	free(r->data);
+	free(r);
+}
+
+size_t bm_rle_size(BmRle *r) {
+	size_t size = 0;
+	unsigned int runs;
+	if(!r)
+		return 0;
+	/* The data ends with the runs of the last row */
+	if(r->h > 0) {
+		size = r->rows[r->h - 1];
+		runs = r->data[size++];
+		while(runs--)
+			size += 2 + r->data[size + 1];
+	}
+	return sizeof *r + r->h * sizeof *r->rows + size * sizeof *r->data;
+}
+
+void bm_rle_blit(Bitmap *dst, int dx, int dy, BmRle *src, int sx, int sy, int w, int h) {
+	int j;
+	unsigned char *dp;
 	
-	if(sx + w > src->w) {
-		int delta = sx + w - src->w;
-		w -= delta;
-	}
-	
-	if(sy + h > src->h) {
-		int delta = sy + h - src->h;
-		h -= delta;
-	}
+	if(!clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
 	
-	assert(dx >= 0 && dx + w <= dst->clip.x1);
-	assert(dy >= 0 && dy + h <= dst->clip.y1);	
-	assert(sx >= 0 && sx + w <= src->w);
-	assert(sy >= 0 && sy + h <= src->h);
-	
-	j = sy;
-	for(y = dy; y < dy + h; y++) {		
-		i = sx;
-		for(x = dx; x < dx + w; x++) {
-			int c = BM_GET(src, i, j) & 0xFFFFFF;
-			if(c != (src->color & 0xFFFFFF))
-				BM_SET(dst, x, y, c);
-			i++;
+	dp = dst->data + dy * BM_ROW_SIZE(dst) + dx * BM_BPP;
+	for(j = 0; j < h; j++) {
+		const unsigned int *run = src->data + src->rows[sy + j];
+		unsigned int *d = (unsigned int *)dp;
+		unsigned int nruns = *run++;
+		while(nruns--) {
+			int x = run[0], n = run[1];
+			int a = x > sx ? x : sx;
+			int b = x + n < sx + w ? x + n : sx + w;
+			if(x >= sx + w) 
+				break;
+			if(a < b)
+				memcpy(d + a - sx, run + 2 + a - x, (b - a) * BM_BPP);
+			run += 2 + n;
 		}
-		j++;
+		dp += BM_ROW_SIZE(dst);
 	}
 }
 
@@ -2641,7 +3119,6 @@ void bm_blit_ex_fun(Bitmap *dst, int dx, int dy, int dw, int dh, Bitmap *src, in
 
 void bm_smooth(Bitmap *b) {
 	Bitmap *tmp = bm_create(b->w, b->h);
-	unsigned char *t = b->data;
 	int x, y;
 	
 	/* http://prideout.net/archive/bloom/ */
@@ -2682,14 +3159,12 @@ void bm_smooth(Bitmap *b) {
 			BM_SETRGB(tmp, x, y, R/c, G/c, B/c, A/c);
 		}
 	
-	b->data = tmp->data;
-	tmp->data = t;
+	copy_rows(b, tmp);
 	bm_free(tmp);
 }
 
 void bm_apply_kernel(Bitmap *b, int dim, float kernel[]) {
 	Bitmap *tmp = bm_create(b->w, b->h);
-	unsigned char *t = b->data;
 	int x, y;	
 	int kf = dim >> 1;
 	
@@ -2721,8 +3196,7 @@ void bm_apply_kernel(Bitmap *b, int dim, float kernel[]) {
 		}
 	}
 	
-	b->data = tmp->data;
-	tmp->data = t;
+	copy_rows(b, tmp);
 	bm_free(tmp);
 }
 
@@ -2870,10 +3344,11 @@ int bm_count_colors(Bitmap *b, int use_mask) {
 	implementations may have problems with large
 	images if it is recursive)
 	*/
-	int count = 1, i;
+	int count = 1, i, y;
 	int npx = b->w * b->h;
 	int *sort = malloc(npx * sizeof *sort);
-	memcpy(sort, b->data, npx * sizeof *sort);
+	for(y = 0; y < b->h; y++)
+		memcpy(sort + y * b->w, b->data + y * BM_ROW_SIZE(b), b->w * sizeof *sort);
 	if(use_mask) {
 		qsort(sort, npx, sizeof(int), cnt_comp_mask);
 	} else {
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include <unistd.h>  /* may not be portable, works with MinGW on Windows */
@@ -19,9 +20,12 @@
 #include "utils.h"
 #include "states.h"
 #include "resources.h"
+#include "imgcache.h"
 #include "log.h"
 #include "gamedb.h"
 #include "sound.h"
+#include "tileset.h"
+#include "map.h"
 #include "bmpfont.h"
 #include "json.h"
 
@@ -39,6 +43,8 @@
 
 #define GAME_INI		"game.ini"
 
+#define MAX_PAKS	16
+
 #define PARAM(x) (#x)
 
 /* Globals *************************************************/
@@ -50,9 +56,15 @@ int quit = 0;
 static int screenWidth = SCREEN_WIDTH,
 	screenHeight = SCREEN_HEIGHT;
 
-/* The desired frame rate */
+/* The desired frame rate. 
+The game logic is updated at this fixed rate, regardless of how
+often frames are actually presented. */
 int fps = DEFAULT_FPS;
 
+/* The maximum number of updates to run in one frame when
+catching up after a slow frame */
+#define MAX_TICKS	5
+
 /* The dimensions of the virtual screen */
 int virt_width = VIRT_WIDTH,
     virt_height = VIRT_HEIGHT;
@@ -62,8 +74,22 @@ static SDL_Window *win = NULL;
 static SDL_Renderer *ren = NULL;
 static SDL_Texture *tex = NULL;
 
-/* The start time of the current animation frame */
-static Uint32 frameStart;
+/* How frames are paced; see "pacing" in the [screen] section of game.ini:
+ - vsync: SDL_RenderPresent() waits for the vertical retrace.
+ - sleep: SDL_Delay() for most of the wait, then spin for the rest. */
+enum {PACE_VSYNC, PACE_SLEEP};
+static int pacing = PACE_SLEEP;
+
+/* The start time of the current animation frame, and the 
+time not yet consumed by updates, in performance counter units */
+static Uint64 frameStart;
+static Uint64 accumulator;
+
+/* When the last frame was presented */
+static Uint64 lastPresent;
+
+/* The measured time between the last two frames presented, in seconds */
+double frame_time = 0.0;
 
 unsigned int frame_counter = 0;
 
@@ -74,6 +100,16 @@ static const char *filter = "0";
 It is rendered to `tex` once per frame */
 static struct bitmap *bmp = NULL;
 
+/* If set, `bmp` is bound to the pixels of the locked `tex` so that 
+the game draws directly into the texture ("present = lock" in the 
+[screen] section of game.ini) instead of copying `bmp` into it every 
+frame. Falls back to copying if the texture can't be used that way. */
+static int lock_tex = 0;
+
+/* Memory that `bmp` is bound to if locking the texture fails.
+It is allocated up front, so that falling back can't fail mid-game */
+static unsigned char *shadow = NULL;
+
 /* The game.ini configuration file */
 struct ini_file *game_ini = NULL;
 
@@ -92,6 +128,31 @@ char initial_dir[256];
 
 /* Functions *************************************************/
 
+/* Binds `bmp` to the pixels of the locked texture.
+If the texture can't be locked, or its pitch isn't a whole number of 
+pixels, `bmp` is bound to the `shadow` buffer instead and the game 
+falls back to SDL_UpdateTexture() */
+static int lock_screen() {
+	void *pixels;
+	int pitch;
+	if(SDL_LockTexture(tex, NULL, &pixels, &pitch) < 0) {
+		rerror("SDL_LockTexture: %s", SDL_GetError());
+	} else if(pitch % 4 || pitch < virt_width * 4) {
+		rerror("Unusable texture pitch %d", pitch);
+		SDL_UnlockTexture(tex);
+	} else {
+		bm_rebind(bmp, pixels);
+		bmp->stride = pitch;
+		return 1;
+	}
+	
+	rlog("Falling back to copying the screen to the texture.");
+	lock_tex = 0;
+	bm_rebind(bmp, shadow);
+	bmp->stride = virt_width * 4;
+	return 0;
+}
+
 int init(const char *appTitle, int flags) {
 	flags |= SDL_WINDOW_SHOWN;
 
@@ -103,7 +164,7 @@ int init(const char *appTitle, int flags) {
 		return 0;
 	}
 
-	ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | (pacing == PACE_VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0));
 	if(!ren) {
 		rerror("SDL_CreateRenderer: %s", SDL_GetError());
 		return 0;
@@ -117,15 +178,40 @@ int init(const char *appTitle, int flags) {
         rerror("SDL_ShowCursor: %s", SDL_GetError());
     }
 
-	bmp = bm_create(virt_width, virt_height);
-
-	tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, bmp->w, bmp->h);
+	tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, virt_width, virt_height);
 	if(!tex) {
 		rerror("SDL_CreateTexture: %s", SDL_GetError());
 		return 0;
 	}
 	rlog("Texture Created.");
 
+	if(lock_tex) {
+		shadow = calloc(virt_width * virt_height, 4);
+		if(!shadow) {
+			rerror("Unable to allocate the screen buffer");
+			return 0;
+		}
+		bmp = bm_bind(virt_width, virt_height, NULL);
+		if(!bmp) {
+			rerror("Unable to create the screen bitmap");
+			return 0;
+		}
+		if(lock_screen()) {
+			int y;
+			for(y = 0; y < bmp->h; y++)
+				memset(bmp->data + y * bmp->stride, 0, bmp->w * 4);
+			rlog("Drawing directly to the locked texture.");
+		}
+	} else {
+		bmp = bm_create(virt_width, virt_height);
+		if(!bmp) {
+			rerror("Unable to create the screen bitmap");
+			return 0;
+		}
+	}
+
+	rlog("Using %s blitting kernels.", bm_kernel_name());
+
 	reset_keys();
 
 	return 1;
@@ -166,11 +252,20 @@ int screen_to_virt_y(int in) {
 }
 
 void render() {
-	/* FIXME: Docs says SDL_UpdateTexture() be slow */
-	SDL_UpdateTexture(tex, NULL, bmp->data, bmp->w*4);
+	if(lock_tex) {
+		SDL_UnlockTexture(tex);
+	} else {
+		/* FIXME: Docs says SDL_UpdateTexture() be slow */
+		SDL_UpdateTexture(tex, NULL, bmp->data, bmp->stride);
+	}
 	SDL_RenderClear(ren);
 	SDL_RenderCopy(ren, tex, NULL, NULL);
 	SDL_RenderPresent(ren);
+	
+	/* The locked pixels are write-only and not preserved between
+	frames, so the next frame has to be drawn in its entirety */
+	if(lock_tex)
+		lock_screen();
 }
 
 static SDL_Scancode last_key = SDL_SCANCODE_UNKNOWN;
@@ -183,25 +278,100 @@ int readkey() {
 	return last_key;
 }
 
+/* Length of an update in performance counter units */
+static Uint64 tick_length() {
+	return SDL_GetPerformanceFrequency() / fps;
+}
+
+/* Waits until the next update is due, according to the pacing mode.
+If a frame was just presented with vsync on, the wait already happened. */
+static void wait_for_tick(int presented) {
+	Uint64 step = tick_length(), now, target;
+	
+	if(pacing == PACE_VSYNC && presented)
+		return;
+	
+	now = SDL_GetPerformanceCounter();
+	if(accumulator + (now - frameStart) >= step)
+		return;
+	target = frameStart + step - accumulator;
+	
+	/* SDL_Delay() is only accurate to a millisecond or two 
+	(worse on some OSes), so spin for the last bit */
+	while(now < target) {
+		Uint64 ms = (target - now) * 1000 / SDL_GetPerformanceFrequency();
+		if(ms > 2)
+			SDL_Delay(ms - 2);
+		now = SDL_GetPerformanceCounter();
+	}
+}
+
+/* Measures the time since the previous iteration and adds it to 
+the accumulator. At most MAX_TICKS updates are kept so that the
+game doesn't spiral if the updates themselves are too slow.
+frame_time only changes when a frame was presented, so that it is 
+the length of a frame even if some iterations didn't update. */
+static void measure_frame(int presented) {
+	Uint64 now = SDL_GetPerformanceCounter();
+	Uint64 step = tick_length();
+	if(presented) {
+		frame_time = (double)(now - lastPresent) / SDL_GetPerformanceFrequency();
+		lastPresent = now;
+	}
+	accumulator += now - frameStart;
+	if(accumulator > MAX_TICKS * step)
+		accumulator = MAX_TICKS * step;
+	frameStart = now;
+}
+
+static void poll_input();
+
+static int reload_state = 0;
+
+static void file_changed(const char *filename) {
+	if(state_uses_file(filename))
+		reload_state = 1;
+}
+
+/* Reloads whatever changed on disk; see re_watch().
+ * It restarts the current state if its script or map changed,
+ * so it can't be called from within the state's update. */
+static void hot_reload() {
+	struct game_state *gs;
+	reload_state = 0;
+	if(!re_watch_update(file_changed) || !reload_state)
+		return;
+	gs = current_state();
+	if(gs) {
+		rlog("Reloading state %s", gs->name);
+		set_state(gs->name);
+	}
+}
+
 /* advanceFrame() is kept separate so that it
- * can be exposed to the scripting system later
+ * can be exposed to the scripting system later.
+ * Each call counts as one update of the game logic.
  */
 void advanceFrame() {
-	SDL_Event event;
-	Uint32 end;
-	int new_btns, cursor;
+	Uint64 step = tick_length();
 
     frame_counter++;
 
 	render();
+	wait_for_tick(1);
+	measure_frame(1);
+	accumulator = accumulator > step ? accumulator - step : 0;
 
-	end = SDL_GetTicks();
-	assert(end > frameStart);
-
-	if(end - frameStart < 1000/fps)
-		SDL_Delay(1000/fps - (end - frameStart));
+	/* The caller's update saw the previous key presses and clicks */
+	last_key = SDL_SCANCODE_UNKNOWN;
+	mouse_clck = 0;
+	poll_input();
+	re_preload_update();
+}
 
-	frameStart = SDL_GetTicks();
+static void poll_input() {
+	SDL_Event event;
+	int new_btns, cursor;
 
     cursor = SDL_ShowCursor(-1);
     if(cursor < 0) {
@@ -213,8 +383,9 @@ void advanceFrame() {
         int mx, my;
         new_btns = SDL_GetMouseState(&mx, &my);
 
-        /* clicked = buttons that were down in the previous frame and aren't down anymore */
-        mouse_clck = mouse_btns & ~new_btns;
+        /* clicked = buttons that were down in the previous frame and aren't down anymore.
+        Clicks are kept until an update has seen them; see the main loop. */
+        mouse_clck |= mouse_btns & ~new_btns;
         mouse_btns = new_btns;
 
         mouse_x = screen_to_virt_x(mx);
@@ -227,8 +398,6 @@ void advanceFrame() {
         mouse_x = -1;
         mouse_y = -1;
     }
-	
-	last_key = SDL_SCANCODE_UNKNOWN;
 
 	while(SDL_PollEvent(&event)) {
 		if(event.type == SDL_QUIT) {
@@ -273,13 +442,24 @@ void reset_keys() {
 	}
 }
 
+/* Paths given on the command line are relative to the initial directory */
+static int mount_path(const char *path) {
+	char buffer[512];
+	if(path[0] == '/' || path[0] == '\\' || (path[0] && path[1] == ':'))
+		return rs_mount(path);
+	snprintf(buffer, sizeof buffer, "%s/%s", initial_dir, path);
+	return rs_mount(buffer);
+}
+
 void usage(const char *name) {
 	/* Unfortunately this doesn't work in Windows.
 	MinGW does give you a stderr.txt though.
 	*/
 	fprintf(stderr, "Usage: %s [options]\n", name);
 	fprintf(stderr, "where options:\n");
-	fprintf(stderr, " -p pakfile  : Load game from PAK file.\n");
+	fprintf(stderr, " -p pakfile  : Load game from a PAK or ZIP file.\n");
+	fprintf(stderr, "               Repeat it to mount patches over the game;\n");
+	fprintf(stderr, "               files in later ones replace earlier ones.\n");
 	fprintf(stderr, " -g dir      : Use a directory containing a game.ini\n");
 	fprintf(stderr, "               file instead of a pak file.\n");
 	fprintf(stderr, " -l logfile  : Use specific log file.\n");
@@ -293,11 +473,12 @@ int main(int argc, char *argv[]) {
 	const char *appTitle = DEFAULT_APP_TITLE;
 
 	const char *game_dir = NULL;
-	const char *pak_filename = "game.pak";
+	const char *pak_files[MAX_PAKS];
+	int npaks = 0, i;
 
 	const char *rlog_filename = "rengine.log";
 
-	const char *startstate;
+	const char *startstate, *pace;
 
 	struct game_state *gs = NULL;
 
@@ -317,11 +498,14 @@ int main(int argc, char *argv[]) {
 	while((opt = getopt(argc, argv, "p:g:l:d?")) != -1) {
 		switch(opt) {
 			case 'p': {
-				pak_filename = optarg;
+				if(npaks == MAX_PAKS) {
+					rerror("Too many PAK files; ignoring %s", optarg);
+					break;
+				}
+				pak_files[npaks++] = optarg;
 			} break;
 			case 'g' : {
 				game_dir = optarg;
-				pak_filename = NULL;
 			} break;
 			case 'l': {
 				rlog_filename = optarg;
@@ -364,22 +548,45 @@ int main(int argc, char *argv[]) {
 	rlog("SDL version %d.%d.%d (link)", linked.major, linked.minor, linked.patch);
 
 	if(!demo) {
-		if(pak_filename) {
-			rlog("Loading game PAK file: %s", pak_filename);
-			if(!rs_read_pak(pak_filename)) {
-				rerror("Unable to open PAK file '%s'; Playing demo mode.", pak_filename);
-				goto start_demo;
-			}
-		} else {
+		if(game_dir) {
 			rlog("Not using a PAK file. Using '%s' instead.", game_dir);
 			if(chdir(game_dir)) {
 				rerror("Unable to change to '%s': %s", game_dir, strerror(errno));
 				return 1;
 			}
+			/* Without patches the files are read from the directory 
+				directly, so that new files are picked up */
+			if(npaks && !rs_mount(".")) {
+				rerror("Unable to mount '%s'", game_dir);
+				return 1;
+			}
+		} else if(!npaks) {
+			pak_files[npaks++] = "game.pak";
+		}
+		for(i = 0; i < npaks; i++) {
+			rlog("Loading game PAK file: %s", pak_files[i]);
+			if(!mount_path(pak_files[i])) {
+				rerror("Unable to open PAK file '%s'; Playing demo mode.", pak_files[i]);
+				goto start_demo;
+			}
 		}
 
 		game_ini = re_get_ini(GAME_INI);
 		if(game_ini) {
+			/* More archives to mount over the ones above, such as DLC,
+				separated by semicolons and relative to the working directory */
+			const char *mount_list = ini_get(game_ini, "resources", "mount", NULL);
+			if(mount_list) {
+				char *list = my_strdup(mount_list), *save, *path;
+				if(game_dir && !npaks)
+					rs_mount(".");
+				for(path = my_strtok_r(list, "; \t", &save); path; path = my_strtok_r(NULL, "; \t", &save)) {
+					if(!rs_mount(path))
+						rerror("Unable to mount '%s' listed in %s", path, GAME_INI);
+				}
+				free(list);
+			}
+
 			appTitle = ini_get(game_ini, "init", "appTitle", "Rengine");
 
 			screenWidth = atoi(ini_get(game_ini, "screen", "width", PARAM(SCREEN_WIDTH)));
@@ -391,13 +598,40 @@ int main(int argc, char *argv[]) {
 			if(fps <= 0)
 				fps = DEFAULT_FPS;
 
+			pace = ini_get(game_ini, "screen", "pacing", "sleep");
+			if(!my_stricmp(pace, "vsync"))
+				pacing = PACE_VSYNC;
+			else {
+				if(my_stricmp(pace, "sleep"))
+					rwarn("Unknown pacing '%s' in %s; using 'sleep'", pace, GAME_INI);
+				pacing = PACE_SLEEP;
+			}
+
 			filter = !my_stricmp(ini_get(game_ini, "screen", "filter", "nearest"), "linear")? "1": "0";
 
+			lock_tex = !my_stricmp(ini_get(game_ini, "screen", "present", "copy"), "lock");
+
 			virt_width = atoi(ini_get(game_ini, "virtual", "width", PARAM(VIRT_WIDTH)));
 			virt_height = atoi(ini_get(game_ini, "virtual", "height", PARAM(VIRT_HEIGHT)));
 
             show_cursor = atoi(ini_get(game_ini, "mouse", "show-cursor", PARAM(1)))? 1 : 0;
 
+			if(atoi(ini_get(game_ini, "init", "image-cache", "1"))) {
+				char cache_dir[300];
+				snprintf(cache_dir, sizeof cache_dir, "%s/cache", initial_dir);
+				ic_init(cache_dir);
+			}
+
+			/* Memory budgets of the resource cache, in megabytes */
+			re_set_budget(RE_BITMAP, (size_t)atoi(ini_get(game_ini, "resources", "bitmap-budget", "64")) << 20);
+			re_set_budget(RE_SOUND, (size_t)atoi(ini_get(game_ini, "resources", "sound-budget", "32")) << 20);
+			re_set_budget(RE_MUSIC, (size_t)atoi(ini_get(game_ini, "resources", "music-budget", "0")) << 20);
+			map_set_cache_budget((size_t)atoi(ini_get(game_ini, "resources", "map-budget", "32")) << 20);
+
+			/* Pick up changes to the game's files while it runs */
+			if(game_dir && atoi(ini_get(game_ini, "init", "hot-reload", "1")))
+				re_watch(".");
+
 			startstate = ini_get(game_ini, "init", "startstate", NULL);
 			if(startstate) {
                 gs = get_state(startstate);
@@ -430,6 +664,10 @@ start_demo:
         return 1;
 	}
 
+	/* The mixer has to be open before WAVs can be loaded in the background */
+	if(game_ini)
+		re_preload_init(atoi(ini_get(game_ini, "init", "preload-threads", "2")));
+
     assert(gs);
 	rlog("Entering initial state...");
     if(!change_state(gs)) {
@@ -437,20 +675,49 @@ start_demo:
         return 1;
     }
 	
-    frameStart = SDL_GetTicks();
+	frameStart = SDL_GetPerformanceCounter();
+	lastPresent = frameStart;
+	accumulator = tick_length();
 
 	rlog("Event loop starting...");
 
 	while(!quit) {
-		gs = current_state();
+		Uint64 step = tick_length();
+		int ticks;
+		
+		/* Run as many fixed length updates as the time since the 
+		last frame calls for, then present the result */
+		for(ticks = 0; accumulator >= step && !quit; ticks++) {
+			gs = current_state();
+			if(!gs) {
+				break;
+			}
+			if(ticks > 0) {
+				/* Key presses and clicks are only reported once */
+				last_key = SDL_SCANCODE_UNKNOWN;
+				mouse_clck = 0;
+			}
+			if(gs->update)
+				gs->update(gs, bmp);
+			accumulator -= step;
+		}
 		if(!gs) {
 			break;
 		}
 
-		if(gs->update)
-			gs->update(gs, bmp);
-
-		advanceFrame();
+		if(ticks > 0) {
+			/* Key presses and clicks are kept until an update has seen 
+			them, since an iteration doesn't necessarily update */
+			last_key = SDL_SCANCODE_UNKNOWN;
+			mouse_clck = 0;
+			frame_counter++;
+			render();
+		}
+		wait_for_tick(ticks > 0);
+		measure_frame(ticks > 0);
+		poll_input();
+		re_preload_update();
+		hot_reload();
 	}
 
 	rlog("Event loop stopped.");
@@ -459,7 +726,14 @@ start_demo:
 	if(gs && gs->deinit)
 		gs->deinit(gs);
 
-	bm_free(bmp);
+	if(lock_tex)
+		SDL_UnlockTexture(tex);
+	if(shadow) {
+		bm_unbind(bmp);
+		free(shadow);
+	} else {
+		bm_free(bmp);
+	}
 
 	SDL_DestroyTexture(tex);
 	SDL_DestroyRenderer(ren);
@@ -470,6 +744,7 @@ start_demo:
 	ini_free(game_ini);
 
 	re_clean_up();
+	lus_clean_up();
 
 	bmf_deinit();
 	
@@ -0,0 +1,171 @@
+/*
+Image cache:
+Each cached image is a file named after a hash of its name. It contains
+a header, the name, and the pixels exactly as they are in a Bitmap, so
+loading it is a matter of reading the pixels into a buffer and binding
+a Bitmap to it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#  include <direct.h>
+#else
+#  include <sys/stat.h>
+#  include <sys/types.h>
+#endif
+
+#include "bmp.h"
+#include "log.h"
+#include "imgcache.h"
+#include "utils.h"
+
+#define IC_MAGIC    "RBMC"
+#define IC_VERSION  1
+
+struct ic_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t w, h;
+	uint32_t color;
+	uint32_t name_len;
+	/* Size and hash of the file the image was decoded from */
+	uint64_t src_len;
+	uint64_t src_hash;
+};
+
+static char cache_dir[256] = "";
+
+int ic_init(const char *dir) {
+	int r;
+#ifdef _WIN32
+	r = _mkdir(dir);
+#else
+	r = mkdir(dir, 0755);
+#endif
+	if(r && errno != EEXIST) {
+		rerror("Unable to create image cache %s: %s", dir, strerror(errno));
+		cache_dir[0] = '\0';
+		return 0;
+	}
+	snprintf(cache_dir, sizeof cache_dir, "%s", dir);
+	rlog("Caching decoded images in %s", cache_dir);
+	return 1;
+}
+
+/* Only formats that are slow to decode are worth caching */
+static int worth_caching(const unsigned char *data, size_t len) {
+	if(len < 4)
+		return 0;
+	if(!memcmp(data, "\x89PNG", 4))
+		return 1;
+	if(data[0] == 0xFF && data[1] == 0xD8)
+		return 1;
+	return 0;
+}
+
+static void cache_path(const char *name, char *path, size_t size) {
+	snprintf(path, size, "%s/%016llx.rbm", cache_dir, my_fnv1a(name, strlen(name)));
+}
+
+static Bitmap *read_cached(const char *path, const char *name, size_t len, uint64_t hash) {
+	struct ic_header hdr;
+	size_t name_len = strlen(name), size;
+	char stored[256];
+	unsigned char *pixels;
+	Bitmap *b;
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return NULL;
+
+	if(fread(&hdr, sizeof hdr, 1, f) != 1
+		|| memcmp(hdr.magic, IC_MAGIC, 4) || hdr.version != IC_VERSION
+		|| hdr.src_len != len || hdr.src_hash != hash
+		|| hdr.name_len != name_len || name_len >= sizeof stored
+		|| fread(stored, 1, name_len, f) != name_len || memcmp(stored, name, name_len)) {
+		fclose(f);
+		return NULL;
+	}
+
+	size = (size_t)hdr.w * hdr.h * 4;
+	pixels = malloc(size);
+	if(!pixels || fread(pixels, 1, size, f) != size) {
+		free(pixels);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	/* The bitmap owns the pixels, so bm_free() frees them */
+	b = bm_bind(hdr.w, hdr.h, pixels);
+	if(!b) {
+		free(pixels);
+		return NULL;
+	}
+	bm_set_color(b, hdr.color);
+	return b;
+}
+
+static void write_cached(const char *path, const char *name, size_t len, uint64_t hash, Bitmap *b) {
+	struct ic_header hdr;
+	char tmp[300];
+	size_t size = (size_t)b->w * b->h * 4;
+	FILE *f;
+
+	/* Written to a temporary file first so that a half written
+		image is never read, even if two threads decode it at once. */
+	snprintf(tmp, sizeof tmp, "%s.%p", path, (void *)b);
+	f = fopen(tmp, "wb");
+	if(!f) {
+		rerror("Unable to cache %s in %s: %s", name, tmp, strerror(errno));
+		return;
+	}
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, IC_MAGIC, 4);
+	hdr.version = IC_VERSION;
+	hdr.w = b->w;
+	hdr.h = b->h;
+	hdr.color = bm_get_color(b);
+	hdr.name_len = strlen(name);
+	hdr.src_len = len;
+	hdr.src_hash = hash;
+	if(fwrite(&hdr, sizeof hdr, 1, f) != 1
+		|| fwrite(name, 1, hdr.name_len, f) != hdr.name_len
+		|| fwrite(b->data, 1, size, f) != size) {
+		rerror("Unable to cache %s in %s: %s", name, tmp, strerror(errno));
+		fclose(f);
+		remove(tmp);
+		return;
+	}
+	fclose(f);
+#ifdef _WIN32
+	remove(path);
+#endif
+	if(rename(tmp, path)) {
+		remove(tmp);
+	}
+}
+
+Bitmap *ic_decode(const char *name, const void *data, size_t len) {
+	char path[300];
+	uint64_t hash;
+	Bitmap *b;
+
+	if(!cache_dir[0] || !worth_caching(data, len) || strlen(name) >= 256)
+		return bm_load_mem(data, len);
+
+	hash = my_fnv1a(data, len);
+	cache_path(name, path, sizeof path);
+
+	b = read_cached(path, name, len, hash);
+	if(b)
+		return b;
+
+	b = bm_load_mem(data, len);
+	if(b && b->stride == b->w * 4 && !b->parent)
+		write_cached(path, name, len, hash, b);
+	return b;
+}
@@ -76,11 +76,13 @@ static void log_deinit() {
 
 #ifndef USESDL
 static void inlog(const char *subsys, const char *fmt, va_list arg) {
-	fputs(subsys, log_file);
-	fputs(": ", log_file);
-	vfprintf(log_file, fmt, arg);
-	fputs("\n", log_file);
-	fflush(log_file);
+	/* Tools like pakr may log without calling log_init() */
+	FILE *f = log_file ? log_file : stderr;
+	fputs(subsys, f);
+	fputs(": ", f);
+	vfprintf(f, fmt, arg);
+	fputs("\n", f);
+	fflush(f);
 }
 
 void sublog(const char *subsys, const char *fmt, ...) {
@@ -34,6 +34,7 @@ static int new_wav_obj(lua_State *L) {
 	if(!*cp) {
 		luaL_error(L, "Unable to load WAV file '%s'", filename);
 	}
+	re_retain(*cp);
 	return 1;
 }
 
@@ -51,7 +52,9 @@ static int wav_tostring(lua_State *L) {
  *# Garbage collects the `SndObj` instance.
  */
 static int gc_wav_obj(lua_State *L) {
-	/* No need to free the Mix_Chunk: It's in the resource cache. */
+	/* The Mix_Chunk stays in the resource cache until it's evicted */
+	struct Mix_Chunk **cp = luaL_checkudata(L,1, "SndObj");
+	re_release(*cp);
 	return 0;
 }
 
@@ -253,6 +256,7 @@ static int new_mus_obj(lua_State *L) {
 	if(!*mp) {
 		luaL_error(L, "Unable to load music file '%s'", filename);
 	}
+	re_retain(*mp);
 	return 1;
 }
 
@@ -301,7 +305,9 @@ static int mus_tostring(lua_State *L) {
  *# Garbage collects the `MusObj` instance.
  */
 static int gc_mus_obj(lua_State *L) {
-	/* No need to free the Mix_Music: It's in the resource cache. */
+	/* The Mix_Music stays in the resource cache until it's evicted */
+	Mix_Music **mp = luaL_checkudata(L,1, "MusicObj");
+	re_release(*mp);
 	return 0;
 }
 
@@ -36,6 +36,7 @@ static int new_bmp_obj(lua_State *L) {
 	if(!*bp) {
 		luaL_error(L, "Unable to load bitmap '%s'", filename);
 	}
+	re_retain(*bp);
 	return 1;
 }
 
@@ -53,7 +54,10 @@ static int bmp_tostring(lua_State *L) {
  *# Garbage collects the `BmpObj` instance.
  */
 static int gc_bmp_obj(lua_State *L) {
-	/* No need to free the bitmap: It's in the resource cache. */
+	/* The bitmap stays in the resource cache until it's evicted 
+		(or freed, if it's a clone or a view) */
+	struct bitmap **bp = luaL_checkudata(L,1, "BmpObj");
+	re_release(*bp);
 	return 0;
 }
 
@@ -66,12 +70,35 @@ static int bmp_clone(lua_State *L) {
 	char buffer[32];
 	static int nextnum = 1;
 	snprintf(buffer, sizeof buffer, "clone%d", nextnum++);
-	struct bitmap *clone = re_clone_bmp(b, buffer);
-	if(!clone)
+	bp = lua_newuserdata(L, sizeof *bp);	
+	luaL_setmetatable(L, "BmpObj");
+	*bp = re_clone_bmp(b, buffer);
+	if(!*bp)
 		luaL_error(L, "Unable to clone bitmap");
+	return 1;
+}
+
+/*@ BmpObj:view(x, y, w, h)
+ *# Returns a `BmpObj` for the {{w}} by {{h}} area at {{x,y}} of this bitmap.\n
+ *# Unlike {{clone()}} the pixels are not copied: The view shares them
+ *# with the original bitmap, so it is cheap to use for sprite frames 
+ *# and tiles. It has its own mask colour.
+ */
+static int bmp_view(lua_State *L) {	
+	struct bitmap **bp = luaL_checkudata(L,1, "BmpObj");
+	int x = luaL_checknumber(L,2);
+	int y = luaL_checknumber(L,3);
+	int w = luaL_checknumber(L,4);
+	int h = luaL_checknumber(L,5);
+	char buffer[32];
+	static int nextnum = 1;
+	snprintf(buffer, sizeof buffer, "view%d", nextnum++);
+	struct bitmap *b = *bp;
 	bp = lua_newuserdata(L, sizeof *bp);	
 	luaL_setmetatable(L, "BmpObj");
-	*bp = clone;
+	*bp = re_view_bmp(b, x, y, w, h, buffer);
+	if(!*bp)
+		luaL_error(L, "Unable to create view of bitmap");
 	return 1;
 }
 
@@ -124,6 +151,7 @@ static int bmp_adjust(lua_State *L) {
 			A = luaL_checknumber(L,5);
 		bm_adjust_rgba(*bp, R, G, B, A);
 	}
+	re_dirty_bmp(*bp);
 	return 0;
 }
 
@@ -160,6 +188,8 @@ static void bmp_obj_meta(lua_State *L) {
 	/* Add methods */
 	lua_pushcfunction(L, bmp_clone);
 	lua_setfield(L, -2, "clone");
+	lua_pushcfunction(L, bmp_view);
+	lua_setfield(L, -2, "view");
 	lua_pushcfunction(L, bmp_set_mask);
 	lua_setfield(L, -2, "setMask");
 	lua_pushcfunction(L, bmp_width);
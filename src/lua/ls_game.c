@@ -14,6 +14,7 @@
 
 #include "game.h"
 #include "states.h"
+#include "resources.h"
 #include "luastate.h"
 
 /*1 Game object
@@ -25,7 +26,7 @@
  */
 static int l_changeState(lua_State *L) {
 	const char *next_state = luaL_checkstring(L, -1);
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	
 	sd->next_state = strdup(next_state);
 	sd->change_state = 1;
@@ -37,7 +38,7 @@ static int l_changeState(lua_State *L) {
  *# Retrieves a specific [[Style]] from the [[game.ini]] file.
  */
 static int l_getstyle(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	const char * s = luaL_checkstring(L,1);
     const char * d = "";
     const char * v;
@@ -80,18 +81,82 @@ static int l_advanceFrame(lua_State *L) {
 	lua_pushstring(L, "frameCounter"); 
 	lua_pushinteger(L, frame_counter); 
 	lua_rawset(L, -3);
+	SET_TABLE_NUM_VAL("frameTime", frame_time);
 	lua_pop(L, 1);
 	return 1;
 }
 
+/*@ Game.preload(file, ...)
+ *# Loads the bitmaps, sounds or music in the files listed in the background,
+ *# so that they're in the cache when they're needed.\n
+ *# If a file is a map, its tilesets are loaded.
+ */
+static int l_preload(lua_State *L) {
+	int i, n = lua_gettop(L);
+	for(i = 1; i <= n; i++)
+		re_preload(luaL_checkstring(L, i));
+	return 0;
+}
+
+/*@ Game.preloadState(state)
+ *# Loads the resources that the [[state|State Machine]] {{state}} needs in 
+ *# the background, as listed in its {{preload}} setting in the [[game.ini]] file.\n
+ *# Call it ahead of {{Game.changeState()}} to avoid a pause when the state starts.
+ */
+static int l_preloadState(lua_State *L) {
+	const char *state = luaL_checkstring(L, 1);
+	lua_pushboolean(L, preload_state(state));
+	return 1;
+}
+
+/*@ Game.preloadProgress()
+ *# Returns how much of the resources queued with {{Game.preload()}} or 
+ *# {{Game.preloadState()}} has been loaded, as a number between 0 and 1.\n
+ *# It returns 1 when there is nothing left to load.
+ */
+static int l_preloadProgress(lua_State *L) {
+	lua_pushnumber(L, re_preload_progress());
+	return 1;
+}
+
+/*@ Game.cacheStats()
+ *# Returns a table with statistics of the resource cache, with a 
+ *# {{bitmaps}}, {{sounds}} and {{music}} table that each has the fields
+ *# {{count}}, {{unused}} (not referenced by anything), {{bytes}}, 
+ *# {{budget}}, {{hits}}, {{misses}} and {{evictions}}.
+ */
+static int l_cacheStats(lua_State *L) {
+	static const char *names[] = {"bitmaps", "sounds", "music"};
+	struct re_stats st;
+	int i;
+	lua_newtable(L);
+	for(i = 0; i < RE_NUM_KINDS; i++) {
+		re_get_stats(i, &st);
+		lua_newtable(L);
+		SET_TABLE_INT_VAL("count", st.count);
+		SET_TABLE_INT_VAL("unused", st.unused);
+		SET_TABLE_NUM_VAL("bytes", st.bytes);
+		SET_TABLE_NUM_VAL("budget", st.budget);
+		SET_TABLE_NUM_VAL("hits", st.hits);
+		SET_TABLE_NUM_VAL("misses", st.misses);
+		SET_TABLE_NUM_VAL("evictions", st.evictions);
+		lua_setfield(L, -2, names[i]);
+	}
+	return 1;
+}
+
 static const luaL_Reg game_funcs[] = {
   {"changeState",     l_changeState},
   {"getStyle",        l_getstyle},
   {"advanceFrame",    l_advanceFrame},
+  {"preload",         l_preload},
+  {"preloadState",    l_preloadState},
+  {"preloadProgress", l_preloadProgress},
+  {"cacheStats",      l_cacheStats},
   {0, 0}
 };
 
 void register_game_functions(lua_State *L) {
-	luaL_newlib(L, game_funcs);
+	STATE_LIB(game_funcs);
 	lua_setglobal(L, "Game");    
 }
\ No newline at end of file
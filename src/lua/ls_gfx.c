@@ -12,11 +12,13 @@
 #include <lua5.2/lualib.h>
 #endif
 #include <assert.h>
+#include <string.h>
 
 #include "bmp.h"
 #include "game.h"
 #include "luastate.h"
 #include "states.h"
+#include "resources.h"
 
 /*1 G
  *# {{G}} is the Graphics object that allows you to draw primitives on the screen. \n
@@ -27,31 +29,40 @@
  ** {{G.SCREEN_WIDTH}} - The configured width of the screen.
  ** {{G.SCREEN_HEIGHT}} - The configured height of the screen.
  ** {{G.frameCounter}} - A counter that gets incremented on every frame. It may be useful for certain kinds of animations.
+ ** {{G.frameTime}} - The measured length of the previous frame in seconds. The game logic is updated {{G.FPS}} times 
+ *#   per second regardless, but it can be used to smooth out movement if frames are being dropped.
  *}
  */
 
 /*@ G.setColor("color"), G.setColor(R, G, B), G.setColor()
  *# Sets the [[color|Colors]] used to draw the graphics primitives\n
- *# {{G.setColor("color")}} sets the color to the specified string value.\n
+ *# {{G.setColor("color")}} sets the color to the specified string value.
+ *# A number, like the value returned by {{G.lerp()}}, is used as the color as is.\n
  *# {{G.setColor(R, G, B)}} sets the color to the specified R, G, B values.
  *# R,G,B values must be in the range [0..255].\n
  *# {{G.setColor()}} sets the color to the foreground specified in the styles.
  */
 static int gr_setcolor(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);	
-	if(lua_gettop(L) == 3) {
-		int R = luaL_checknumber(L,1);
-		int G = luaL_checknumber(L,2);
-		int B = luaL_checknumber(L,3);		
-		bm_set_color_rgb(sd->bmp, R, G, B);
-	} else if(lua_gettop(L) == 1) {
-		const char *c = luaL_checkstring(L,1);
-		bm_set_color_s(sd->bmp, c);
-	} else if(lua_gettop(L) == 0) {
-		bm_set_color_s(sd->bmp, get_style(sd->state, "foreground", "white"));
-	} else
-		luaL_error(L, "Invalid parameters to G.setColor()");	
+	switch(lua_gettop(L)) {
+		case 3: {
+			int R = luaL_checknumber(L,1);
+			int G = luaL_checknumber(L,2);
+			int B = luaL_checknumber(L,3);		
+			bm_set_color_rgb(sd->bmp, R, G, B);
+		} break;
+		case 1: {
+			/* A number would otherwise be converted to a string of decimal 
+				digits, which bm_color_atoi() reads as hexadecimal */
+			if(lua_type(L, 1) == LUA_TNUMBER)
+				bm_set_color(sd->bmp, lua_tointeger(L, 1));
+			else
+				bm_set_color_s(sd->bmp, luaL_checkstring(L,1)); 
+		} break;
+		case 0: bm_set_color_s(sd->bmp, get_style(sd->state, "foreground", "white")); break;
+		default: luaL_error(L, "Invalid parameters to G.setColor()");	
+	}
 	return 0;
 }
 
@@ -60,7 +71,7 @@ static int gr_setcolor(lua_State *L) {
  */
 static int gr_getcolor(lua_State *L) {
 	int r,g,b;
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	bm_get_color_rgb(sd->bmp, &r, &g, &b);
 	lua_pushinteger(L, r);
@@ -73,7 +84,7 @@ static int gr_getcolor(lua_State *L) {
  *# Sets the clipping rectangle when drawing primitives.
  */
 static int gr_clip(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);	
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -87,7 +98,7 @@ static int gr_clip(lua_State *L) {
  *# Gets the current clipping rectangle for drawing primitives.
  */
 static int gr_getclip(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
     lua_pushinteger(L, sd->bmp->clip.x0);
     lua_pushinteger(L, sd->bmp->clip.y0);
@@ -100,7 +111,7 @@ static int gr_getclip(lua_State *L) {
  *# Resets the clipping rectangle when drawing primitives.
  */
 static int gr_unclip(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	bm_unclip(sd->bmp);
 	return 0;
@@ -109,7 +120,7 @@ static int gr_unclip(lua_State *L) {
  *# Plots a pixel at {{x,y}} on the screen.
  */
 static int gr_putpixel(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x = luaL_checknumber(L,1);
 	int y = luaL_checknumber(L,2);
@@ -121,7 +132,7 @@ static int gr_putpixel(lua_State *L) {
  *# Draws a line from {{x0,y0}} to {{x1,y1}}
  */
 static int gr_line(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -135,7 +146,7 @@ static int gr_line(lua_State *L) {
  *# Draws a rectangle from {{x0,y0}} to {{x1,y1}}
  */
 static int gr_rect(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -149,7 +160,7 @@ static int gr_rect(lua_State *L) {
  *# Draws a filled rectangle from {{x0,y0}} to {{x1,y1}}
  */
 static int gr_fillrect(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -163,7 +174,7 @@ static int gr_fillrect(lua_State *L) {
  *# Draws a dithered rectangle from {{x0,y0}} to {{x1,y1}}
  */
 static int gr_dithrect(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -177,7 +188,7 @@ static int gr_dithrect(lua_State *L) {
  *# Draws a circle centered at {{x,y}} with radius {{r}}
  */
 static int gr_circle(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x = luaL_checknumber(L,1);
 	int y = luaL_checknumber(L,2);
@@ -190,7 +201,7 @@ static int gr_circle(lua_State *L) {
  *# Draws a filled circle centered at {{x,y}} with radius {{r}}
  */
 static int gr_fillcircle(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x = luaL_checknumber(L,1);
 	int y = luaL_checknumber(L,2);
@@ -203,7 +214,7 @@ static int gr_fillcircle(lua_State *L) {
  *# Draws an ellipse from {{x0,y0}} to {{x1,y1}}
  */
 static int gr_ellipse(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -218,7 +229,7 @@ static int gr_ellipse(lua_State *L) {
  *# with rounded corners of radius {{r}}
  */
 static int gr_roundrect(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -234,7 +245,7 @@ static int gr_roundrect(lua_State *L) {
  *# with rounded corners of radius {{r}}
  */
 static int gr_fillroundrect(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -251,7 +262,7 @@ static int gr_fillroundrect(lua_State *L) {
  *# Note that it doesn't pass through {{x1,y1}}
  */
 static int gr_bezier3(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x0 = luaL_checknumber(L,1);
 	int y0 = luaL_checknumber(L,2);
@@ -270,7 +281,7 @@ static int gr_bezier3(lua_State *L) {
  *# that is 1/3rd of the way from red to blue.
  */
 static int gr_lerp(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	const char *c1 = luaL_checkstring(L,1);
 	const char *c2 = luaL_checkstring(L,2);
@@ -286,7 +297,7 @@ static int gr_lerp(lua_State *L) {
  *# Sets the [[font|Fonts]] used for the {{G.print()}} function. 
  */
 static int gr_setfont(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	enum bm_fonts font;	
 	if(lua_gettop(L) > 0) {
@@ -303,7 +314,7 @@ static int gr_setfont(lua_State *L) {
  *# Prints the {{text}} to the screen, with its top left position at {{x,y}}.
  */
 static int gr_print(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	int x = luaL_checknumber(L, 1);
 	int y = luaL_checknumber(L, 2);
@@ -320,7 +331,7 @@ static int gr_print(lua_State *L) {
  *X local w,h = G.textDims(message);
  */
 static int gr_textdims(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	const char *s = luaL_checkstring(L, 1);
 	
@@ -330,7 +341,28 @@ static int gr_textdims(lua_State *L) {
 	return 2;
 }
 
-/*@ G.blit(bmp, dx, dy, [sx, sy, [dw, dh, [sw, sh]]])
+static const char *const blit_modes[] = {"mask", "copy", "alpha", "add", "multiply", "fade", NULL};
+
+/* Draws src in one of the blit_modes; rle is src's run-length encoded 
+	version for the "mask" mode, if it has one */
+static void draw_blit(struct bitmap *dst, int mode, int dx, int dy, struct bitmap *src, struct bm_rle *rle, 
+		int sx, int sy, int w, int h, int alpha) {
+	switch(mode) {
+		case 0: {
+			if(rle)
+				bm_rle_blit(dst, dx, dy, rle, sx, sy, w, h);
+			else
+				bm_maskedblit(dst, dx, dy, src, sx, sy, w, h);
+		} break;
+		case 1: bm_blit(dst, dx, dy, src, sx, sy, w, h); break;
+		case 2: bm_alphablit(dst, dx, dy, src, sx, sy, w, h); break;
+		case 3: bm_addblit(dst, dx, dy, src, sx, sy, w, h); break;
+		case 4: bm_mulblit(dst, dx, dy, src, sx, sy, w, h); break;
+		case 5: bm_fadeblit(dst, dx, dy, src, sx, sy, w, h, alpha); break;
+	}
+}
+
+/*@ G.blit(bmp, dx, dy, [sx, sy, [dw, dh, [sw, sh]]], [mode, [alpha]])
  *# Draws an instance {{bmp}} of {{BmpObj}} to the screen at {{dx, dy}}.\n
  *# {{sx,sy}} specify the source x,y position and {{dw,dh}} specifies the
  *# width and height of the destination area to draw.\n
@@ -338,10 +370,21 @@ static int gr_textdims(lua_State *L) {
  *# source bitmap.\n
  *# If {{sw,sh}} is specified, the bitmap is scaled so that the area on the 
  *# source bitmap from {{sx,sy}} with dimensions {{sw,sh}} is drawn onto the
- *# screen at {{dx,dy}} with dimensions {{dw, dh}}.
+ *# screen at {{dx,dy}} with dimensions {{dw, dh}}.\n
+ *# The optional {{mode}} string specifies how the pixels are drawn:
+ *{
+ ** {{"mask"}} - the default; pixels matching the bitmap's mask colour are skipped.
+ *#   The bitmap is compiled to a run-length encoded sprite the first time it is drawn this way.
+ ** {{"copy"}} - the pixels are copied as is.
+ ** {{"alpha"}} - the pixels are blended using the bitmap's alpha channel.
+ ** {{"add"}} - the pixel colours are added to the screen.
+ ** {{"multiply"}} - the pixel colours are multiplied with the screen.
+ ** {{"fade"}} - like {{"mask"}}, but blended with the constant {{alpha}} value in the range [0-255].
+ *}
+ *# Scaled blits only support the {{"mask"}} and {{"copy"}} modes.
  */
 static int gr_blit(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 	assert(sd->bmp);
 	struct bitmap **bp = luaL_checkudata(L, 1, "BmpObj");
 	
@@ -350,25 +393,214 @@ static int gr_blit(lua_State *L) {
 	
 	int sx = 0, sy = 0, w = (*bp)->w, h = (*bp)->h;
 	
-	if(lua_gettop(L) > 4) {
+	int top = lua_gettop(L), mode = 0, alpha = 255;
+	if(top == 3) {
+		/* G.blit(bmp, dx, dy) is by far the most common call, so it 
+			doesn't go through the argument parsing below */
+		draw_blit(sd->bmp, 0, dx, dy, *bp, re_get_rle(*bp), 0, 0, w, h, alpha);
+		return 0;
+	}
+	
+	/* The mode, if present, follows the numeric arguments */
+	if(top > 3 && lua_type(L, top) == LUA_TSTRING) {
+		mode = luaL_checkoption(L, top, NULL, blit_modes);
+		top--;
+	} else if(top > 4 && lua_type(L, top - 1) == LUA_TSTRING) {
+		mode = luaL_checkoption(L, top - 1, NULL, blit_modes);
+		alpha = luaL_checknumber(L, top);
+		top -= 2;
+	}
+	
+	if(top > 4) {
 		sx = luaL_checknumber(L, 4);
 		sy = luaL_checknumber(L, 5);
 	}
-	if(lua_gettop(L) > 6) {
+	if(top > 6) {
 		w = luaL_checknumber(L, 6);
 		h = luaL_checknumber(L, 7);
 	}
-	if(lua_gettop(L) > 8) {
+	if(top > 8) {
 		int sw = luaL_checknumber(L, 8);
 		int sh = luaL_checknumber(L, 9);
-		bm_blit_ex(sd->bmp, dx, dy, w, h, *bp, sx, sy, sw, sh, 1);
-	} else {
-		bm_maskedblit(sd->bmp, dx, dy, *bp, sx, sy, w, h);
-	}
+		if(mode > 1)
+			luaL_error(L, "G.blit(): mode '%s' not supported when scaling", blit_modes[mode]);
+		bm_blit_ex(sd->bmp, dx, dy, w, h, *bp, sx, sy, sw, sh, mode == 0);
+		return 0;
+	} 
+	
+	draw_blit(sd->bmp, mode, dx, dy, *bp, mode == 0 ? re_get_rle(*bp) : NULL, sx, sy, w, h, alpha);
 	
 	return 0;
 }
 
+/* Gets the number at t[i] as an integer, for G.batch() and G.draw() */
+static int table_int(lua_State *L, int t, int i, const char *fun) {
+	int isnum, v;
+	lua_rawgeti(L, t, i);
+	v = lua_tonumberx(L, -1, &isnum);
+	if(!isnum)
+		luaL_error(L, "%s: expected a number at index %d", fun, i);
+	lua_pop(L, 1);
+	return v;
+}
+
+/*@ G.batch(bmp, records, [mode, [alpha]])
+ *# Draws many parts of the {{BmpObj}} {{bmp}} to the screen in one call.
+ *# It is much quicker than calling {{G.blit()}} for every sprite in 
+ *# scenes with lots of particles or tiles.\n
+ *# {{records}} is a flat array of numbers, six for every part to draw:
+ *# {{dx, dy, sx, sy, w, h}}, which have the same meaning as in {{G.blit()}}.\n
+ *# {{mode}} and {{alpha}} are the same as for {{G.blit()}} and apply to all the parts.
+ *X local parts = {}
+ *X for i, p in ipairs(particles) do
+ *X     local n = #parts
+ *X     parts[n+1], parts[n+2] = p.x, p.y
+ *X     parts[n+3], parts[n+4], parts[n+5], parts[n+6] = p.frame * 8, 0, 8, 8
+ *X end
+ *X G.batch(sparks, parts, "add")
+ */
+static int gr_batch(lua_State *L) {
+	struct lustate_data *sd = STATE_DATA(L);
+	struct bitmap **bp = luaL_checkudata(L, 1, "BmpObj");
+	int mode = luaL_checkoption(L, 3, "mask", blit_modes);
+	int alpha = luaL_optnumber(L, 4, 255);
+	struct bm_rle *rle = NULL;
+	int i, n;
+	assert(sd->bmp);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	n = lua_rawlen(L, 2);
+	if(n % 6)
+		luaL_error(L, "G.batch(): the number of values (%d) is not a multiple of 6", n);
+
+	/* Everything that is the same for all the parts is worked out once */
+	if(mode == 0)
+		rle = re_get_rle(*bp);
+	for(i = 1; i <= n; i += 6) {
+		int dx = table_int(L, 2, i, "G.batch()");
+		int dy = table_int(L, 2, i + 1, "G.batch()");
+		int sx = table_int(L, 2, i + 2, "G.batch()");
+		int sy = table_int(L, 2, i + 3, "G.batch()");
+		int w = table_int(L, 2, i + 4, "G.batch()");
+		int h = table_int(L, 2, i + 5, "G.batch()");
+		draw_blit(sd->bmp, mode, dx, dy, *bp, rle, sx, sy, w, h, alpha);
+	}
+	return 0;
+}
+
+enum draw_command {
+	DC_COLOR, DC_PIXEL, DC_LINE, DC_RECT, DC_FILLRECT, DC_DITHRECT, 
+	DC_CIRCLE, DC_FILLCIRCLE, DC_ELLIPSE, DC_ROUNDRECT, DC_FILLROUNDRECT, 
+	DC_CURVE, DC_PRINT, DC_BLIT
+};
+
+static const char *const draw_commands[] = {
+	"color", "pixel", "line", "rect", "fillRect", "dithRect", 
+	"circle", "fillCircle", "ellipse", "roundRect", "fillRoundRect", 
+	"curve", "print", "blit", NULL
+};
+
+/* The number of values that follow each command */
+static const int draw_command_args[] = {
+	1, 2, 4, 4, 4, 4, 
+	3, 3, 4, 5, 5, 
+	6, 3, 3
+};
+
+/*@ G.draw(commands)
+ *# Executes a list of drawing commands in one call, which is much quicker
+ *# than calling the {{G}} functions one by one when there are many of them.\n
+ *# {{commands}} is a flat array in which every command's name is followed by
+ *# its arguments, which are the same as those of the {{G}} function with 
+ *# that name:
+ *{
+ ** {{"color", c}} - like {{G.setColor(c)}}; {{c}} may also be a value returned by {{G.lerp()}}.
+ ** {{"pixel", x, y}}
+ ** {{"line", x0, y0, x1, y1}}
+ ** {{"rect", x0, y0, x1, y1}}, {{"fillRect", ...}} and {{"dithRect", ...}}
+ ** {{"circle", x, y, r}} and {{"fillCircle", ...}}
+ ** {{"ellipse", x0, y0, x1, y1}}
+ ** {{"roundRect", x0, y0, x1, y1, r}} and {{"fillRoundRect", ...}}
+ ** {{"curve", x0, y0, x1, y1, x2, y2}}
+ ** {{"print", x, y, text}}
+ ** {{"blit", bmp, dx, dy}} - like {{G.blit(bmp, dx, dy)}}.
+ *}
+ *X G.draw{"color", "red", "fillRect", 10, 10, 50, 20, "color", "white", "print", 12, 12, "Hello"}
+ */
+static int gr_draw(lua_State *L) {
+	struct lustate_data *sd = STATE_DATA(L);
+	int i = 1, n, c, j, a[6];
+	assert(sd->bmp);
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	n = lua_rawlen(L, 1);
+	while(i <= n) {
+		const char *name;
+		lua_rawgeti(L, 1, i);
+		if(lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "G.draw(): expected a command at index %d", i);
+		name = lua_tostring(L, -1);
+		for(c = 0; draw_commands[c] && strcmp(draw_commands[c], name); c++);
+		if(!draw_commands[c])
+			luaL_error(L, "G.draw(): unknown command '%s' at index %d", name, i);
+		lua_pop(L, 1);
+		if(i + draw_command_args[c] > n)
+			luaL_error(L, "G.draw(): not enough arguments to '%s' at index %d", draw_commands[c], i);
+
+		switch(c) {
+			case DC_COLOR: {
+				lua_rawgeti(L, 1, i + 1);
+				if(lua_type(L, -1) == LUA_TNUMBER)
+					bm_set_color(sd->bmp, lua_tointeger(L, -1));
+				else if(lua_type(L, -1) == LUA_TSTRING)
+					bm_set_color_s(sd->bmp, lua_tostring(L, -1));
+				else
+					luaL_error(L, "G.draw(): expected a color at index %d", i + 1);
+				lua_pop(L, 1);
+			} break;
+			case DC_PRINT: {
+				a[0] = table_int(L, 1, i + 1, "G.draw()");
+				a[1] = table_int(L, 1, i + 2, "G.draw()");
+				lua_rawgeti(L, 1, i + 3);
+				if(!lua_isstring(L, -1))
+					luaL_error(L, "G.draw(): expected text at index %d", i + 3);
+				bm_puts(sd->bmp, a[0], a[1], lua_tostring(L, -1));
+				lua_pop(L, 1);
+			} break;
+			case DC_BLIT: {
+				struct bitmap **bp;
+				a[0] = table_int(L, 1, i + 2, "G.draw()");
+				a[1] = table_int(L, 1, i + 3, "G.draw()");
+				lua_rawgeti(L, 1, i + 1);
+				bp = luaL_testudata(L, -1, "BmpObj");
+				if(!bp)
+					luaL_error(L, "G.draw(): expected a BmpObj at index %d", i + 1);
+				draw_blit(sd->bmp, 0, a[0], a[1], *bp, re_get_rle(*bp), 0, 0, (*bp)->w, (*bp)->h, 255);
+				lua_pop(L, 1);
+			} break;
+			default: {
+				for(j = 0; j < draw_command_args[c]; j++)
+					a[j] = table_int(L, 1, i + 1 + j, "G.draw()");
+				switch(c) {
+					case DC_PIXEL: bm_putpixel(sd->bmp, a[0], a[1]); break;
+					case DC_LINE: bm_line(sd->bmp, a[0], a[1], a[2], a[3]); break;
+					case DC_RECT: bm_rect(sd->bmp, a[0], a[1], a[2], a[3]); break;
+					case DC_FILLRECT: bm_fillrect(sd->bmp, a[0], a[1], a[2], a[3]); break;
+					case DC_DITHRECT: bm_dithrect(sd->bmp, a[0], a[1], a[2], a[3]); break;
+					case DC_CIRCLE: bm_circle(sd->bmp, a[0], a[1], a[2]); break;
+					case DC_FILLCIRCLE: bm_fillcircle(sd->bmp, a[0], a[1], a[2]); break;
+					case DC_ELLIPSE: bm_ellipse(sd->bmp, a[0], a[1], a[2], a[3]); break;
+					case DC_ROUNDRECT: bm_roundrect(sd->bmp, a[0], a[1], a[2], a[3], a[4]); break;
+					case DC_FILLROUNDRECT: bm_fillroundrect(sd->bmp, a[0], a[1], a[2], a[3], a[4]); break;
+					case DC_CURVE: bm_bezier3(sd->bmp, a[0], a[1], a[2], a[3], a[4], a[5]); break;
+				}
+			}
+		}
+		i += 1 + draw_command_args[c];
+	}
+	return 0;
+}
+
 static const luaL_Reg graphics_funcs[] = {
   {"setColor",      gr_setcolor},
   {"getColor",      gr_getcolor},
@@ -391,14 +623,17 @@ static const luaL_Reg graphics_funcs[] = {
   {"setFont",       gr_setfont},
   {"textDims",      gr_textdims},
   {"blit",          gr_blit},
+  {"batch",         gr_batch},
+  {"draw",          gr_draw},
   {0, 0}
 };
 
 void register_gfx_functions(lua_State *L) {
-    luaL_newlib(L, graphics_funcs);
+    STATE_LIB(graphics_funcs);
 	SET_TABLE_INT_VAL("FPS", fps);
 	SET_TABLE_INT_VAL("SCREEN_WIDTH", virt_width);
 	SET_TABLE_INT_VAL("SCREEN_HEIGHT", virt_height);
 	SET_TABLE_INT_VAL("frameCounter", frame_counter);
+	SET_TABLE_NUM_VAL("frameTime", frame_time);
 	lua_setglobal(L, "G");
 }
\ No newline at end of file
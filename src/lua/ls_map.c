@@ -36,18 +36,19 @@
  *# in the {{game.ini}} file.
  */
 
-/*@ Map.render(layer, [scroll_x, scroll_y])
+/*@ Map.render(layer, [scroll_x, scroll_y, [wrap]])
  *# Renders the specified layer of the map (background, center or foreground).
  *# The center layer is where all the action in the game occurs and sprites and so on moves around.
  *# The background is drawn behind the center layer for objects in the background. It needs to be drawn first,
  *# so that the center and foreground layers are drawn over it.
- *# The foreground layer is drawn last and contains objects in the foreground. 
+ *# The foreground layer is drawn last and contains objects in the foreground.\n
+ *# If {{wrap}} is true, the map is tiled so that it repeats endlessly in all directions.
  */
 static int render_map(lua_State *L) {	
 	int layer = luaL_checknumber(L,1) - 1;
 	
-	int sx = 0, sy = 0;
-	struct lustate_data *sd = get_state_data(L);
+	int sx = 0, sy = 0, wrap = 0;
+	struct lustate_data *sd = STATE_DATA(L);
 	
 	if(!sd->map) {
 		luaL_error(L, "Attempt to render non-existent Map");
@@ -63,8 +64,11 @@ static int render_map(lua_State *L) {
 		sx = luaL_checknumber(L,2);
 		sy = luaL_checknumber(L,3);
 	}
+	if(lua_gettop(L) > 3) {
+		wrap = lua_toboolean(L,4);
+	}
 	
-	map_render(sd->map, sd->bmp, layer, sx, sy);
+	map_render_cached(sd->map, sd->bmp, layer, sx, sy, wrap);
 	return 0;
 }
 
@@ -77,8 +81,8 @@ static int render_map(lua_State *L) {
 static int get_cell_obj(lua_State *L) {
 	int r = luaL_checknumber(L,1) - 1;
 	int c = luaL_checknumber(L,2) - 1;	
-	struct lustate_data *sd = get_state_data(L);	
-	struct map_cell **o;
+	struct lustate_data *sd = STATE_DATA(L);	
+	struct map_cell *o;
 	
 	assert(sd->map);
 	
@@ -122,7 +126,7 @@ static int cell_tostring(lua_State *L) {
  *# Frees the CellObj when it is garbage collected.
  */
 static int gc_cell_obj(lua_State *L) {
-	/* Nothing to do, since we don't actually own the pointer to the map_cell */
+	/* Nothing to do, since the map_cell is just a reference into the map */
 	return 0;
 }
 
@@ -135,9 +139,8 @@ static int gc_cell_obj(lua_State *L) {
  *}
  */
 static int cell_set(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
-	struct map_cell **cp = luaL_checkudata(L,1, "CellObj");
-	struct map_cell *c = *cp;
+	struct lustate_data *sd = STATE_DATA(L);
+	struct map_cell *c = luaL_checkudata(L,1, "CellObj");
 	
 	int l = luaL_checknumber(L,2) - 1;
 	int si = luaL_checknumber(L,3);
@@ -155,8 +158,8 @@ static int cell_set(lua_State *L) {
 	
 	/* TODO: Maybe you ought to store this change in some sort of list
 	   so that the savedgames can handle changes to the map like this. */
-	c->tiles[l].ti = ti;
-	c->tiles[l].si = si;
+	/* map_set() also marks the cell's chunk in the layer cache as dirty */
+	map_set(c->map, l, c->x, c->y, si, ti);
 	
 	/* Push the CellObj back onto the stack so that other methods can be called on it */
 	lua_pushvalue(L, -4);
@@ -168,9 +171,9 @@ static int cell_set(lua_State *L) {
  *# Returns the {/id/} of a cell as defined in the Rengine Editor
  */
 static int cell_get_id(lua_State *L) {
-	struct map_cell **cp = luaL_checkudata(L,1, "CellObj");
-	struct map_cell *c = *cp;	
-	lua_pushstring(L, c->id ? c->id : "");
+	struct map_cell *c = luaL_checkudata(L,1, "CellObj");
+	const char *id = map_get_id(c->map, c->x, c->y);
+	lua_pushstring(L, id ? id : "");
 	return 1;
 }
 
@@ -178,9 +181,9 @@ static int cell_get_id(lua_State *L) {
  *# Returns the {/class/} of a cell as defined in the Rengine Editor
  */
 static int cell_get_class(lua_State *L) {
-	struct map_cell **cp = luaL_checkudata(L,1, "CellObj");
-	struct map_cell *c = *cp;	
-	lua_pushstring(L, c->clas ? c->clas : "");
+	struct map_cell *c = luaL_checkudata(L,1, "CellObj");
+	const char *clas = map_get_class(c->map, c->x, c->y);
+	lua_pushstring(L, clas ? clas : "");
 	return 1;
 }
 
@@ -188,9 +191,8 @@ static int cell_get_class(lua_State *L) {
  *# Returns whether the cell is a barrier
  */
 static int cell_is_barrier(lua_State *L) {
-	struct map_cell **cp = luaL_checkudata(L,1, "CellObj");
-	struct map_cell *c = *cp;	
-	lua_pushboolean(L, c->flags & TS_FLAG_BARRIER);
+	struct map_cell *c = luaL_checkudata(L,1, "CellObj");
+	lua_pushboolean(L, map_get_flags(c->map, c->x, c->y) & TS_FLAG_BARRIER);
 	return 1;
 }
 
@@ -198,14 +200,15 @@ static int cell_is_barrier(lua_State *L) {
  *# Sets whether the cell is a barrier
  */
 static int cell_set_barrier(lua_State *L) {
-	struct map_cell **cp = luaL_checkudata(L,1, "CellObj");
-	struct map_cell *c = *cp;	
+	struct map_cell *c = luaL_checkudata(L,1, "CellObj");
 	luaL_checktype(L, 2, LUA_TBOOLEAN);
 	int b = lua_toboolean(L, 2);
+	int flags = map_get_flags(c->map, c->x, c->y);
 	if(b)
-		c->flags |= TS_FLAG_BARRIER;
+		flags |= TS_FLAG_BARRIER;
 	else
-		c->flags &= ~TS_FLAG_BARRIER;
+		flags &= ~TS_FLAG_BARRIER;
+	map_set_flags(c->map, c->x, c->y, flags);
 	return 0;
 }
 
@@ -219,8 +222,7 @@ static void cell_obj_meta(lua_State *L) {
 	lua_setfield(L, -2, "__index"); /* CellObj.__index = CellObj */
 	
 	/* Add methods here */
-	lua_pushcfunction(L, cell_set);
-	lua_setfield(L, -2, "set");
+	STATE_METHOD("set", cell_set);
 	lua_pushcfunction(L, cell_get_id);
 	lua_setfield(L, -2, "getId");
 	lua_pushcfunction(L, cell_get_class);
@@ -236,15 +238,14 @@ static void cell_obj_meta(lua_State *L) {
 	lua_setfield(L, -2, "__gc");	
 	
 	/* The global method C() */
-	lua_pushcfunction(L, get_cell_obj);
-	lua_setglobal(L, "Cell");
+	STATE_FUNCTION("Cell", get_cell_obj);
 }
 
 void register_map_functions(lua_State *L) {
     
     struct lustate_data * sd = get_state_data(L);
     
-    luaL_newlib(L, map_funcs);
+    STATE_LIB(map_funcs);
     SET_TABLE_INT_VAL("BACKGROUND", 1);
     SET_TABLE_INT_VAL("CENTER", 2);
     SET_TABLE_INT_VAL("FOREGROUND", 3);
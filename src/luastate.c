@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 
 
 #ifdef WIN32
@@ -39,6 +40,7 @@
 #include "log.h"
 #include "gamedb.h"
 #include "resources.h"
+#include "hash.h"
 #include "luastate.h"
 
 /*
@@ -50,17 +52,138 @@ a variety of built in Lua code.
 extern const char base_lua[];
 extern size_t base_lua_len;
 
+/* Loads a chunk of Lua code, which can be source or bytecode compiled 
+by pakr -l. Bytecode starts with LUA_SIGNATURE and the version of Lua 
+that compiled it, which is checked here to give a clearer error than 
+Lua's own. Returns 0 and pushes the chunk, or pushes an error message. */
+int lus_load_chunk(lua_State *L, const char *chunk, size_t len, const char *name) {
+	static const char sig[] = LUA_SIGNATURE;
+	if(len > sizeof sig && !memcmp(chunk, sig, sizeof sig - 1)) {
+		int version = (unsigned char)chunk[sizeof sig - 1];
+		int expected = (LUA_VERSION_NUM / 100) * 16 + LUA_VERSION_NUM % 100;
+		if(version != expected) {
+			lua_pushfstring(L, "%s was compiled for Lua %d.%d, but the engine uses Lua %d.%d", 
+				name, version >> 4, version & 0xF, LUA_VERSION_NUM / 100, LUA_VERSION_NUM % 100);
+			return LUA_ERRSYNTAX;
+		}
+	}
+	return luaL_loadbufferx(L, chunk, len, name, "bt");
+}
+
+/*
+Scripts are compiled once and their bytecode is kept for as long as the
+engine runs, so importing a script again, even from another state, doesn't
+parse it again. Every state has its own interpreter, so the compiled function
+itself can't be shared between states, but loading bytecode is much quicker
+than parsing. A hash of the source is kept with the bytecode, so a script
+that changed (see re_watch()) is compiled again.
+*/
+struct compiled_chunk {
+	uint64_t hash;
+	size_t src_len;
+	char *code;
+	size_t len;
+};
+
+static Hash_Tbl *chunk_cache = NULL;
+
+static int chunk_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	struct compiled_chunk *c = ud;
+	char *code = realloc(c->code, c->len + sz);
+	if(!code)
+		return 1;
+	memcpy(code + c->len, p, sz);
+	c->code = code;
+	c->len += sz;
+	return 0;
+}
+
+static void free_chunk(const char *key, void *value) {
+	struct compiled_chunk *c = value;
+	free(c->code);
+	free(c);
+}
+
+/* Compiles the source and keeps the bytecode in the cache */
+static int compile_chunk(lua_State *L, const char *script, size_t len, const char *path, uint64_t hash) {
+	struct compiled_chunk *c;
+	static const char sig[] = LUA_SIGNATURE;
+	int status = lus_load_chunk(L, script, len, path);
+	if(status || (len >= sizeof sig - 1 && !memcmp(script, sig, sizeof sig - 1)))
+		return status; /* Errors aren't cached, and neither is bytecode from pakr -l */
+
+	c = calloc(1, sizeof *c);
+	if(!c)
+		return 0;
+	c->hash = hash;
+	c->src_len = len;
+#if LUA_VERSION_NUM >= 503
+	if(lua_dump(L, chunk_writer, c, 0)) {
+#else
+	if(lua_dump(L, chunk_writer, c)) {
+#endif
+		free_chunk(path, c);
+		return 0;
+	}
+
+	if(!chunk_cache) {
+		chunk_cache = ht_create(0);
+		if(!chunk_cache) {
+			free_chunk(path, c);
+			return 0;
+		}
+	}
+	ht_put(chunk_cache, path, c);
+	return 0;
+}
+
+/* Loads the script at path through the cache of compiled chunks.
+Returns 0 and pushes the chunk, or pushes an error message. */
+int lus_load_script(lua_State *L, const char *path) {
+	struct compiled_chunk *c;
+	size_t len;
+	uint64_t hash;
+	int status;
+	const char *script = re_get_data(path, &len);
+	if(!script) {
+		lua_pushfstring(L, "%s was not found", path);
+		return LUA_ERRFILE;
+	}
+
+	hash = my_fnv1a(script, len);
+	c = chunk_cache ? ht_get(chunk_cache, path) : NULL;
+	if(c && c->hash == hash && c->src_len == len) {
+		re_free_data(script);
+		return luaL_loadbufferx(L, c->code, c->len, path, "b");
+	}
+	if(c) {
+		/* The script changed since it was compiled */
+		ht_delete(chunk_cache, path);
+		free_chunk(path, c);
+	}
+
+	status = compile_chunk(L, script, len, path, hash);
+	re_free_data(script);
+	return status;
+}
+
+void lus_clean_up() {
+	if(chunk_cache) {
+		ht_free(chunk_cache, free_chunk);
+		chunk_cache = NULL;
+	}
+}
+
 /* LUA FUNCTIONS */
 
+/* The State Data is kept in the registry, where scripts can't tamper with
+it, under the address of this variable. */
+static const char state_data_key = 0;
+
 struct lustate_data *get_state_data(lua_State *L) {
 	struct lustate_data *sd;
-	lua_getglobal(L, STATE_DATA_VAR);
-	if(!lua_islightuserdata(L, -1)) {
-		luaL_error(L, "Variable %s got tampered with.", STATE_DATA_VAR);
-		return 0; /* satisfy the compiler */
-	} else {
-		sd = lua_touserdata(L, -1);
-	}
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &state_data_key);
+	sd = lua_touserdata(L, -1);
 	lua_pop(L, 1);
 	return sd;
 }
@@ -81,28 +204,76 @@ static int l_log(lua_State *L) {
 }
 
 /*@ import(path)
- *# Loads a Lua script from the resource on the specified path.
+ *# Loads a Lua script from the resource on the specified path, runs it
+ *# and returns whatever the script returns.
  *# This function is needed because the standard Lua functions like
- *# require() and dofile() are disabled in the Rengine sandbox.
+ *# require() and dofile() are disabled in the Rengine sandbox.\n
+ *# Scripts are only compiled the first time they're imported, but
+ *# they are run every time.
  */
-static int l_import(lua_State *L) {
-	const char *path = lua_tolstring(L, 1, NULL);
-	char * script = re_get_script(path);
-	if(!script)
+/* Runs the script and returns the number of results it pushed,
+or -1 if it could not be loaded or run */
+static int run_import(lua_State *L, const char *path) {
+	int top = lua_gettop(L), status;
+	status = lus_load_script(L, path);
+	if(status == LUA_ERRFILE)
 		luaL_error(L, "Could not import %s", path);
 	rlog("Imported %s", path);
-	if(luaL_dostring(L, script)) {
+	if(status || lua_pcall(L, 0, LUA_MULTRET, 0)) {
 		SDL_LogMessage(LOG_CATEGORY_LUA, SDL_LOG_PRIORITY_INFO, "%s: %s", path, lua_tostring(L, -1));
+		lua_settop(L, top);
+		return -1;
 	}
-	free(script);
-	return 0;
+	return lua_gettop(L) - top;
+}
+
+static int l_import(lua_State *L) {
+	int n = run_import(L, luaL_checkstring(L, 1));
+	return n < 0 ? 0 : n;
+}
+
+/*@ importOnce(path)
+ *# Like {{import()}}, but the script is only run the first time it is
+ *# imported in a state. Later calls return what the script returned the
+ *# first time (or {{true}} if it returned nothing), so a script can be
+ *# imported as a module: {{local util = importOnce("lib/util.lua")}}
+ */
+static int l_import_once(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	int n;
+
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, IMPORTED_VAR);
+	if(!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, IMPORTED_VAR);
+	}
+	lua_getfield(L, -1, path);
+	if(!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 1);
+
+	/* Scripts that fail aren't remembered, so they can be tried again */
+	n = run_import(L, path);
+	if(n < 0)
+		return 0;
+	lua_settop(L, 3);
+	if(lua_isnil(L, 3)) {
+		lua_pushboolean(L, 1);
+		lua_replace(L, 3);
+	}
+	lua_pushvalue(L, 3);
+	lua_setfield(L, 2, path);
+	return 1;
 }
 
 /*@ setTimeout(func, millis)
  *# Waits for {{millis}} milliseconds, then calls {{func}}
  */
 static int l_set_timeout(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 
 	/* This link was useful:
 	http://stackoverflow.com/questions/2688040/how-to-callback-a-lua-function-from-a-c-function
@@ -132,18 +303,10 @@ static int l_set_timeout(lua_State *L) {
 }
 
 void process_timeouts(lua_State *L) {
-	struct lustate_data *sd;
+	struct lustate_data *sd = get_state_data(L);
 	int i = 0;
 
-	lua_getglobal(L, STATE_DATA_VAR);
-	if(!lua_islightuserdata(L, -1)) {
-		/* Can't call LuaL_error here. */
-		rerror("Variable %s got tampered with.", STATE_DATA_VAR);
-		return;
-	} else {
-		sd = lua_touserdata(L, -1);
-	}
-	lua_pop(L, 1);
+	assert(sd);
 
 	while(i < sd->n_timeout) {
 		Uint32 elapsed = SDL_GetTicks() - sd->timeout[i].start;
@@ -171,7 +334,7 @@ void process_timeouts(lua_State *L) {
  *# when Rengine draws the screen.
  */
 static int l_onUpdate(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 
 	if(lua_gettop(L) == 1 && lua_isfunction(L, -1)) {
 		struct callback_function *fn;
@@ -209,7 +372,7 @@ static int l_onUpdate(lua_State *L) {
  *# These functions should not do any drawing.
  */
 static int l_atExit(lua_State *L) {
-	struct lustate_data *sd = get_state_data(L);
+	struct lustate_data *sd = STATE_DATA(L);
 
 	if(lua_gettop(L) == 1 && lua_isfunction(L, -1)) {
 		struct callback_function *fn;
@@ -300,23 +463,19 @@ static int lua_stacktrace(lua_State *L) {
 static int lus_init(struct game_state *s) {
 
 	const char *map_file, *script_file;
-	char *map_text, *script;
+	const char *map_text;
+	size_t map_len;
 	lua_State *L = NULL;
 	struct lustate_data *sd;
 
 	rlog("Initializing Lua state '%s'", s->name);
 
-	/* Load the Lua script */
+	/* Find the Lua script */
 	script_file = ini_get(game_ini, s->name, "script", NULL);
 	if(!script_file) {
 		rerror("Lua state '%s' doesn't specify a script file.", s->name);
 		return 0;
 	}
-	script = re_get_script(script_file);
-	if(!script) {
-		rerror("Script %s was not found (state %s).", script_file, s->name);
-		return 0;
-	}
 
 	/* Create the Lua interpreter */
 	L = luaL_newstate();
@@ -350,23 +509,24 @@ static int lus_init(struct game_state *s) {
 
 	/* Store the State Data in the interpreter */
 	lua_pushlightuserdata(L, sd);
-	lua_setglobal(L, STATE_DATA_VAR);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &state_data_key);
 
 	/* Load the map, if one is specified. */
 	map_file = ini_get(game_ini, s->name, "map", NULL);
 	if(map_file) {
-		map_text = re_get_script(map_file);
+		/* The map may be in either the JSON or the binary format */
+		map_text = re_get_data(map_file, &map_len);
 		if(!map_text) {
 			rerror("Unable to retrieve map resource '%s' (state %s).", map_file, s->name);
 			return 0;
 		}
 
-		sd->map = map_parse(map_text, 0);
+		sd->map = map_parse_mem(map_text, map_len, 0);
+		re_free_data(map_text);
 		if(!sd->map) {
 			rerror("Unable to parse map '%s' (state %s).", map_file, s->name);
 			return 0;
 		}
-		free(map_text);
 
         register_map_functions(L);
 
@@ -377,10 +537,11 @@ static int lus_init(struct game_state *s) {
 	lua_setglobal(L, "Map");
 
 	GLOBAL_FUNCTION("log", l_log);
-	GLOBAL_FUNCTION("setTimeout", l_set_timeout);
-	GLOBAL_FUNCTION("onUpdate", l_onUpdate);
-	GLOBAL_FUNCTION("atExit", l_atExit);
+	STATE_FUNCTION("setTimeout", l_set_timeout);
+	STATE_FUNCTION("onUpdate", l_onUpdate);
+	STATE_FUNCTION("atExit", l_atExit);
 	GLOBAL_FUNCTION("import", l_import);
+	GLOBAL_FUNCTION("importOnce", l_import_once);
 
 	/* Register some Lua variables. */
 	register_game_functions(L);
@@ -400,21 +561,19 @@ static int lus_init(struct game_state *s) {
 
     register_sound_functions(L);
 
-	if(luaL_dostring(L, base_lua)) {
+	/* base_lua is compiled to bytecode when the engine is built */
+	if(lus_load_chunk(L, base_lua, base_lua_len, "base.lua") || lua_pcall(L, 0, 0, 0)) {
 		rerror("Unable load base library.");
 		SDL_LogMessage(LOG_CATEGORY_LUA, SDL_LOG_PRIORITY_INFO, "%s", lua_tostring(L, -1));
-		free(script);
 		return 0;
 	}
 
 	/* Load the Lua script itself, and execute it. */
-	if(luaL_loadstring(L, script)) {
+	if(lus_load_script(L, script_file)) {
 		rerror("Unable to load script %s (state %s).", script_file, s->name);
 		SDL_LogMessage(LOG_CATEGORY_LUA, SDL_LOG_PRIORITY_INFO, "%s", lua_tostring(L, -1));
-		free(script);
 		return 0;
 	}
-	free(script);
 
 	rlog("Running script %s", script_file);
 	if(lua_pcall(L, 0, 0, 0)) {
@@ -441,21 +600,12 @@ static int lus_update(struct game_state *s, struct bitmap *bmp) {
 
 	assert(L);
 
-	lua_getglobal(L, STATE_DATA_VAR);
-	if(!lua_isnil(L,-1)) {
-		if(!lua_islightuserdata(L, -1)) {
-			rerror("Variable %s got tampered with (lus_update)", STATE_DATA_VAR);
-			return 0;
-		}
-		sd = lua_touserdata(L, -1);
-	} else {
-		rerror("Variable %s got tampered with (lus_update)", STATE_DATA_VAR);
-		return 0;
-	}
-	lua_pop(L, 1);
+	sd = get_state_data(L);
+	assert(sd);
 
     lua_getglobal (L, "G");
 	SET_TABLE_INT_VAL("frameCounter", frame_counter);
+	SET_TABLE_NUM_VAL("frameTime", frame_time);
 	lua_pop(L, 1);
 
 	/* TODO: Maybe background colour metadata in the map file? */
@@ -500,44 +650,37 @@ static int lus_deinit(struct game_state *s) {
 	if(!L)
 		return 0;
 
-	lua_getglobal(L, STATE_DATA_VAR);
-	if(!lua_isnil(L,-1)) {
-		if(!lua_islightuserdata(L, -1)) {
-			rerror("Variable %s got tampered with (lus_deinit)", STATE_DATA_VAR);
-		} else {
-			struct callback_function *fn;
-
-			sd = lua_touserdata(L, -1);
-
-			/* Execute the atExit() callbacks */
-			fn = sd->atexit_fcn;
-			while(fn) {
-				struct callback_function *old = fn;
-				lua_rawgeti(L, LUA_REGISTRYINDEX, fn->ref);
-				if(lua_pcall(L, 0, 0, 0)) {
-					rerror("Unable to execute atExit() callback (%d)", fn->ref);
-					SDL_LogMessage(LOG_CATEGORY_LUA, SDL_LOG_PRIORITY_INFO, "%s", lua_tostring(L, -1));
-				}
-				fn = fn->next;
-				free(old);
-			}
-
-			/* Remove the map */
-			map_free(sd->map);
+	sd = get_state_data(L);
+	if(sd) {
+		struct callback_function *fn;
 
-			while(sd->update_fcn) {
-				fn = sd->update_fcn;
-				sd->update_fcn = sd->update_fcn->next;
-				free(fn);
+		/* Execute the atExit() callbacks */
+		fn = sd->atexit_fcn;
+		while(fn) {
+			struct callback_function *old = fn;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, fn->ref);
+			if(lua_pcall(L, 0, 0, 0)) {
+				rerror("Unable to execute atExit() callback (%d)", fn->ref);
+				SDL_LogMessage(LOG_CATEGORY_LUA, SDL_LOG_PRIORITY_INFO, "%s", lua_tostring(L, -1));
 			}
+			fn = fn->next;
+			free(old);
+		}
 
-			if(sd->next_state);
-				free(sd->next_state);
+		/* Remove the map */
+		map_free(sd->map);
 
-			free(sd);
+		while(sd->update_fcn) {
+			fn = sd->update_fcn;
+			sd->update_fcn = sd->update_fcn->next;
+			free(fn);
 		}
+
+		if(sd->next_state);
+			free(sd->next_state);
+
+		free(sd);
 	}
-	lua_pop(L, 1);
 
 	/* Stop all sounds */
 	Mix_HaltChannel(-1);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <errno.h>
 
@@ -13,9 +14,47 @@
 #include "utils.h"
 #include "log.h"
 #include "paths.h"
+#include "hash.h"
+#ifndef EDITOR
+#  include "resources.h"
+#endif
 
 #define MAP_FILE_VERSION 1.2
 
+/* See 'Binary map files' below */
+#define MAP_BIN_MAGIC "RMAP"
+#define MAP_BIN_VERSION 1
+
+/* Approximate size in pixels of the chunks in the layer cache.
+The actual size is rounded down to a whole number of tiles. */
+#define MAP_CHUNK_SIZE 256
+
+/* Default memory budget of each map's layer cache; See map_set_cache_budget() */
+#define MAP_CACHE_BUDGET (32 << 20)
+
+/* The layer cache used by map_render_cached().
+Each layer is divided into chunks of tpcx*tpcy cells that 
+are pre-rendered and compiled into RLE sprites when needed. */
+struct map_chunks {
+	int tpcx, tpcy; /* Tiles per chunk */
+	int ncx, ncy;   /* Number of chunks */
+	int nl;
+	struct map_chunk {
+		struct bm_rle *rle;
+		int dirty;
+		size_t size;
+		/* tiles_version() when the chunk was rendered */
+		unsigned int version;
+		/* The value of clock when the chunk was last drawn */
+		unsigned int used;
+	} *chunks;
+	struct bitmap *scratch;
+	size_t size;   /* Memory used by all the chunks */
+	unsigned int clock; /* Counts the calls to map_render_cached() */
+};
+
+static size_t cache_budget = MAP_CACHE_BUDGET;
+
 struct map *map_create(int nr, int nc, int tw, int th, int nl) {
 	int i;
 	struct map *m = malloc(sizeof *m);	
@@ -25,84 +64,201 @@ struct map *map_create(int nr, int nc, int tw, int th, int nl) {
 	m->nc = nc;
 	m->nl = nl;
 	m->dirty = 0;
+	m->chunks = NULL;
 	
 	ts_init(&m->tiles, tw, th);
 	
-	m->cells = calloc(nr * nc, sizeof *m->cells);
+	/* All the storage is in a couple of big blocks */
+	m->layers = malloc(nl * nr * nc * sizeof *m->layers);
+	m->flags = calloc(nr * nc, sizeof *m->flags);
+	m->ids = calloc(nr * nc, sizeof *m->ids);
+	m->classes = calloc(nr * nc, sizeof *m->classes);
 	
-	for(i = 0; i < nr * nc; i++) {
-		int j;
-		struct map_cell *c = &m->cells[i];
-		c->tiles = calloc(nl, sizeof *c->tiles);
-		for(j = 0; j < nl; j++) {
-			c->tiles[j].ti = -1;
-		}
+	m->strings = NULL;
+	m->nstrings = 1; /* index 0 means "no string" */
+	m->astrings = 0;
+	m->string_index = ht_create(64);
+	
+	if(!m->layers || !m->flags || !m->ids || !m->classes || !m->string_index) {
+		map_free(m);
+		return NULL;
+	}
+	
+	for(i = 0; i < nl * nr * nc; i++) {
+		m->layers[i].si = 0;
+		m->layers[i].ti = -1;
 	}
 	
 	return m;
 }
 
+/* Returns the index of the string in the map's string table, adding it if necessary.
+ * Returns 0 for NULL or empty strings. */
+static int intern(struct map *m, const char *str) {
+	int i;
+	char *copy;
+	if(!str || !str[0])
+		return 0;
+	i = (int)(intptr_t)ht_get(m->string_index, str);
+	if(i)
+		return i;
+	if(m->nstrings >= m->astrings) {
+		int na = m->astrings ? m->astrings << 1 : 16;
+		char **ns = realloc(m->strings, na * sizeof *ns);
+		if(!ns) {
+			rerror("Out of memory interning map string");
+			return 0;
+		}
+		m->strings = ns;
+		m->astrings = na;
+	}
+	i = m->nstrings;
+	copy = strdup(str);
+	if(!copy || !ht_put(m->string_index, str, (void *)(intptr_t)i)) {
+		rerror("Out of memory interning map string");
+		free(copy);
+		return 0;
+	}
+	m->strings[i] = copy;
+	m->nstrings++;
+	return i;
+}
+
+#define CELL_OK(m, x, y) ((x) >= 0 && (x) < (m)->nc && (y) >= 0 && (y) < (m)->nr)
+
 void map_set(struct map *m, int layer, int x, int y, int tsi, int ti) {
-	struct map_cell *c;
 	struct map_tile *tile;
 	
-	if(layer >= m->nl || x < 0 || x >= m->nc || y < 0 || y >= m->nr) 
+	if(layer >= m->nl || !CELL_OK(m, x, y)) 
 		return;
 	
-	assert(y * m->nc + x < m->nr * m->nc);
-	
-	c = &m->cells[y * m->nc + x];
-	tile = &c->tiles[layer];
+	tile = &m->layers[(layer * m->nr + y) * m->nc + x];
 	
 	tile->si = tsi;
 	tile->ti = ti;
 	
 	m->dirty = 1;
+	
+	if(m->chunks) {
+		struct map_chunks *mc = m->chunks;
+		mc->chunks[(layer * mc->ncy + y / mc->tpcy) * mc->ncx + x / mc->tpcx].dirty = 1;
+	}
 }
 
 void map_get(struct map *m, int layer, int x, int y, int *tsi, int *ti) {
-	struct map_cell *c;
 	struct map_tile *tile;
 	
 	assert(tsi);
 	assert(ti);
 	
-	if(layer >= m->nl || x < 0 || x >= m->nc || y < 0 || y >= m->nr) 
+	if(layer >= m->nl || !CELL_OK(m, x, y)) 
 		return;
 	
-	assert(y * m->nc + x < m->nr * m->nc);
-	
-	c = &m->cells[y * m->nc + x];
-	tile = &c->tiles[layer];
+	tile = &m->layers[(layer * m->nr + y) * m->nc + x];
 	
 	*tsi = tile->si;
 	*ti = tile->ti;
 }
 
+int map_get_flags(struct map *m, int x, int y) {
+	if(!CELL_OK(m, x, y))
+		return 0;
+	return m->flags[y * m->nc + x];
+}
+
+void map_set_flags(struct map *m, int x, int y, int flags) {
+	if(!CELL_OK(m, x, y))
+		return;
+	m->flags[y * m->nc + x] = flags;
+	m->dirty = 1;
+}
+
+const char *map_get_id(struct map *m, int x, int y) {
+	int i;
+	if(!CELL_OK(m, x, y))
+		return NULL;
+	i = m->ids[y * m->nc + x];
+	return i ? m->strings[i] : NULL;
+}
+
+void map_set_id(struct map *m, int x, int y, const char *id) {
+	if(!CELL_OK(m, x, y))
+		return;
+	m->ids[y * m->nc + x] = intern(m, id);
+	m->dirty = 1;
+}
+
+const char *map_get_class(struct map *m, int x, int y) {
+	int i;
+	if(!CELL_OK(m, x, y))
+		return NULL;
+	i = m->classes[y * m->nc + x];
+	return i ? m->strings[i] : NULL;
+}
+
+void map_set_class(struct map *m, int x, int y, const char *clas) {
+	if(!CELL_OK(m, x, y))
+		return;
+	m->classes[y * m->nc + x] = intern(m, clas);
+	m->dirty = 1;
+}
+
+/* Division that rounds towards negative infinity */
+static int floor_div(int a, int b) {
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
 void map_render(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int scroll_y) {
+	map_render_ex(m, bmp, layer, scroll_x, scroll_y, 0);
+}
+
+void map_render_ex(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int scroll_y, int wrap) {
 	
 	struct tileset *ts = NULL;
+	struct bm_rle *rle = NULL;
 	int tsi = -1, nht = 0;
 	
-	int i, j;
+	int tw = m->tiles.tw, th = m->tiles.th;
+	int i, j, i0, i1, j0, j1;
 	int x, y;
 	
-	if(layer >= m->nl)
+	if(layer >= m->nl || tw <= 0 || th <= 0 || m->nr <= 0 || m->nc <= 0)
 		return;
 
-	y = -scroll_y;	
-	for(j = 0; j < m->nr; j++) {
-		x = -scroll_x;
-		for(i = 0; i < m->nc; i++) {
-			struct map_cell *cl = &m->cells[j * m->nc + i];
-			struct map_tile *tile = &cl->tiles[layer];
+	/* Only visit the cells that are visible within the 
+	clipping rectangle; Partial tiles at the edges are 
+	clipped by the blitter as usual. */
+	i0 = floor_div(bmp->clip.x0 + scroll_x, tw);
+	i1 = floor_div(bmp->clip.x1 - 1 + scroll_x, tw);
+	j0 = floor_div(bmp->clip.y0 + scroll_y, th);
+	j1 = floor_div(bmp->clip.y1 - 1 + scroll_y, th);
+	if(!wrap) {
+		if(i0 < 0) i0 = 0;
+		if(j0 < 0) j0 = 0;
+		if(i1 >= m->nc) i1 = m->nc - 1;
+		if(j1 >= m->nr) j1 = m->nr - 1;
+	}
+
+	y = j0 * th - scroll_y;
+	for(j = j0; j <= j1; j++) {
+		/* In wrapping mode the map repeats in all directions */
+		int row = wrap ? j - floor_div(j, m->nr) * m->nr : j;
+		struct map_tile *tiles = &m->layers[(layer * m->nr + row) * m->nc];
+		x = i0 * tw - scroll_x;
+		for(i = i0; i <= i1; i++) {
+			int col = wrap ? i - floor_div(i, m->nc) * m->nc : i;
+			struct map_tile *tile = &tiles[col];
 			if(tile->ti >= 0) {
 				int r, c;
 				if(tsi != tile->si) {
 					ts = ts_get(&m->tiles, tile->si);
 					assert(ts);
 					tsi = tile->si;
-					nht = ts->bm->w / m->tiles.tw;
+					nht = ts->bm->w / tw;
+#ifndef EDITOR
+					/* The editor doesn't use the resource cache */
+					rle = re_get_rle(ts->bm);
+#endif
 				}
 				assert(ts != NULL);
 				assert(nht > 0);
@@ -110,28 +266,223 @@ void map_render(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int
 				r = tile->ti / nht;
 				c = tile->ti % nht;
 				
-				bm_maskedblit(bmp, x, y, ts->bm, c * (m->tiles.tw + ts->border), r * (m->tiles.th + ts->border), m->tiles.tw, m->tiles.th);
+				if(rle)
+					bm_rle_blit(bmp, x, y, rle, c * (tw + ts->border), r * (th + ts->border), tw, th);
+				else
+					bm_maskedblit(bmp, x, y, ts->bm, c * (tw + ts->border), r * (th + ts->border), tw, th);
 			}
-			x += m->tiles.tw;
+			x += tw;
 		}
-		y += m->tiles.th;
+		y += th;
 	}
 }
 
-struct map_cell *map_get_cell(struct map *m, int x, int y) {
-	return &m->cells[y * m->nc + x];
+static struct map_chunks *create_chunks(struct map *m) {
+	int i, tw = m->tiles.tw, th = m->tiles.th;
+	struct map_chunks *mc = malloc(sizeof *mc);
+	if(!mc)
+		return NULL;
+	
+	mc->tpcx = MAP_CHUNK_SIZE / tw;
+	if(mc->tpcx < 1) mc->tpcx = 1;
+	mc->tpcy = MAP_CHUNK_SIZE / th;
+	if(mc->tpcy < 1) mc->tpcy = 1;
+	mc->ncx = (m->nc + mc->tpcx - 1) / mc->tpcx;
+	mc->ncy = (m->nr + mc->tpcy - 1) / mc->tpcy;
+	mc->nl = m->nl;
+	mc->size = 0;
+	mc->clock = 0;
+	
+	mc->chunks = calloc(mc->nl * mc->ncx * mc->ncy, sizeof *mc->chunks);
+	mc->scratch = bm_create(mc->tpcx * tw, mc->tpcy * th);
+	if(!mc->chunks || !mc->scratch) {
+		free(mc->chunks);
+		bm_free(mc->scratch);
+		free(mc);
+		return NULL;
+	}
+	for(i = 0; i < mc->nl * mc->ncx * mc->ncy; i++)
+		mc->chunks[i].dirty = 1;
+	return mc;
+}
+
+static void free_chunks(struct map_chunks *mc) {
+	int i;
+	if(!mc) return;
+	for(i = 0; i < mc->nl * mc->ncx * mc->ncy; i++)
+		bm_rle_free(mc->chunks[i].rle);
+	free(mc->chunks);
+	bm_free(mc->scratch);
+	free(mc);
+}
+
+/* Renders a chunk's tiles onto the scratch bitmap, 
+and compiles the result into a RLE sprite */
+static struct bm_rle *render_chunk(struct map *m, int layer, int cx, int cy) {
+	struct map_chunks *mc = m->chunks;
+	struct bitmap *b = mc->scratch;
+	int tw = m->tiles.tw, th = m->tiles.th;
+	int x0 = cx * mc->tpcx * tw, y0 = cy * mc->tpcy * th;
+	int w = m->nc * tw - x0, h = m->nr * th - y0;
+	
+	/* The chunks at the right and bottom edges may be smaller */
+	if(w > b->w) w = b->w;
+	if(h > b->h) h = b->h;
+	
+	/* Areas without tiles get the tilesets' mask colour */
+	bm_clip(b, 0, 0, w, h);
+	bm_set_color_s(b, "#FF00FF");
+	bm_fillrect(b, 0, 0, w - 1, h - 1);
+	map_render_ex(m, b, layer, x0, y0, 0);
+	bm_unclip(b);
+	
+	if(w == b->w && h == b->h) 
+		return bm_rle_create(b);
+	else {
+		struct bm_rle *rle;
+		struct bitmap *v = bm_view(b, 0, 0, w, h);
+		if(!v)
+			return NULL;
+		v->color = b->color;
+		rle = bm_rle_create(v);
+		bm_free(v);
+		return rle;
+	}
+}
+
+/* Sum of the change counters of the tilesets' bitmaps.
+The counters only ever go up, so the sum changes whenever
+the pixels of any of the tilesets change. */
+static unsigned int tiles_version(struct map *m) {
+	int i;
+	unsigned int version = 0;
+	for(i = 0; i < m->tiles.ntilesets; i++) {
+		struct tileset *ts = m->tiles.tilesets[i];
+		if(ts->bm)
+			version += bm_version(ts->bm);
+	}
+	return version;
+}
+
+static void drop_chunk(struct map_chunks *mc, struct map_chunk *c) {
+	bm_rle_free(c->rle);
+	c->rle = NULL;
+	mc->size -= c->size;
+	c->size = 0;
+	c->dirty = 1;
+}
+
+/* Frees the chunks that were drawn the longest ago until the cache is
+within its budget again, with some room to spare so that it doesn't have
+to happen again on the next call. Chunks drawn by this call are kept. */
+static void evict_chunks(struct map_chunks *mc) {
+	int i, n = mc->nl * mc->ncx * mc->ncy;
+	while(mc->size > cache_budget / 4 * 3) {
+		struct map_chunk *lru = NULL;
+		for(i = 0; i < n; i++) {
+			struct map_chunk *c = &mc->chunks[i];
+			if(!c->rle || c->used == mc->clock)
+				continue;
+			if(!lru || (int)(c->used - lru->used) < 0)
+				lru = c;
+		}
+		if(!lru)
+			break;
+		drop_chunk(mc, lru);
+	}
+}
+
+void map_set_cache_budget(size_t bytes) {
+	cache_budget = bytes;
+}
+
+void map_render_cached(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int scroll_y, int wrap) {
+	struct map_chunks *mc;
+	unsigned int version;
+	int mw = m->nc * m->tiles.tw, mh = m->nr * m->tiles.th;
+	int cw, ch;
+	int vx0 = bmp->clip.x0 + scroll_x, vx1 = bmp->clip.x1 + scroll_x;
+	int vy0 = bmp->clip.y0 + scroll_y, vy1 = bmp->clip.y1 + scroll_y;
+	int px, py, px0, px1, py0, py1;
+	
+	if(layer >= m->nl || mw <= 0 || mh <= 0 || vx0 >= vx1 || vy0 >= vy1)
+		return;
+	
+	if(!m->chunks) {
+		m->chunks = create_chunks(m);
+		if(!m->chunks) {
+			rerror("Unable to create the map's layer cache");
+			map_render_ex(m, bmp, layer, scroll_x, scroll_y, wrap);
+			return;
+		}
+	}
+	mc = m->chunks;
+	mc->clock++;
+	version = tiles_version(m);
+	cw = mc->tpcx * m->tiles.tw;
+	ch = mc->tpcy * m->tiles.th;
+	
+	/* In wrapping mode, draw every repetition of the map that is visible */
+	if(wrap) {
+		px0 = floor_div(vx0, mw); px1 = floor_div(vx1 - 1, mw);
+		py0 = floor_div(vy0, mh); py1 = floor_div(vy1 - 1, mh);
+	} else {
+		px0 = px1 = py0 = py1 = 0;
+	}
+	
+	for(py = py0; py <= py1; py++) {
+		int oy = py * mh, cy, cy0, cy1;
+		cy0 = floor_div(vy0 - oy, ch); if(cy0 < 0) cy0 = 0;
+		cy1 = floor_div(vy1 - 1 - oy, ch); if(cy1 >= mc->ncy) cy1 = mc->ncy - 1;
+		for(px = px0; px <= px1; px++) {
+			int ox = px * mw, cx, cx0, cx1;
+			cx0 = floor_div(vx0 - ox, cw); if(cx0 < 0) cx0 = 0;
+			cx1 = floor_div(vx1 - 1 - ox, cw); if(cx1 >= mc->ncx) cx1 = mc->ncx - 1;
+			for(cy = cy0; cy <= cy1; cy++) {
+				for(cx = cx0; cx <= cx1; cx++) {
+					struct map_chunk *c = &mc->chunks[(layer * mc->ncy + cy) * mc->ncx + cx];
+					if(c->dirty || c->version != version) {
+						drop_chunk(mc, c);
+						c->rle = render_chunk(m, layer, cx, cy);
+						c->size = bm_rle_size(c->rle);
+						mc->size += c->size;
+						c->version = version;
+						c->dirty = 0;
+					}
+					c->used = mc->clock;
+					if(c->rle)
+						bm_rle_blit(bmp, ox + cx * cw - scroll_x, oy + cy * ch - scroll_y, c->rle, 0, 0, c->rle->w, c->rle->h);
+				}
+			}
+		}
+	}
+	
+	if(mc->size > cache_budget)
+		evict_chunks(mc);
+}
+
+struct map_cell map_get_cell(struct map *m, int x, int y) {
+	struct map_cell c;
+	c.map = m;
+	c.x = x;
+	c.y = y;
+	return c;
 }
 
 void map_free(struct map *m) {
 	int i;
 	if(!m) return;
-	for(i = 0; i < m->nr * m->nc; i++) {
-		free(m->cells[i].tiles);
-		free(m->cells[i].id);
-		free(m->cells[i].clas);
-	}
+	for(i = 1; i < m->nstrings; i++)
+		free(m->strings[i]);
+	free(m->strings);
+	if(m->string_index)
+		ht_free(m->string_index, NULL);
 	ts_deinit(&m->tiles);
-	free(m->cells);
+	free_chunks(m->chunks);
+	free(m->layers);
+	free(m->flags);
+	free(m->ids);
+	free(m->classes);
 	free(m);
 }
 
@@ -180,20 +531,19 @@ int map_save(struct map *m, const char *filename) {
 	fprintf(f, "\"num_layers\" : %d,\n", m->nl);
 	fprintf(f, "\"cells\" : [\n");
 	for(i = 0; i < m->nr * m->nc; i++) {
-		struct map_cell *c = &m->cells[i];
 		fprintf(f, "  {\"tiles\": [");
 		for(j = 0; j < m->nl; j++) {
-			struct map_tile *t = &c->tiles[j];
+			struct map_tile *t = &m->layers[j * m->nr * m->nc + i];
 			fprintf(f, "{\"si\":%d, \"ti\":%d}", t->si, t->ti);
 			if(j < m->nl - 1) fputc(',', f);
 		}
 		fprintf(f, "]");
-		if(c->flags)
-			fprintf(f, ", \"flags\": %d", c->flags);
-		if(c->clas)
-				fprintf(f, ", \"class\":\"%s\"", json_escape(c->clas, buffer, sizeof buffer));
-		if(c->id)
-			fprintf(f, ", \"id\":\"%s\"", json_escape(c->id, buffer, sizeof buffer));
+		if(m->flags[i])
+			fprintf(f, ", \"flags\": %d", m->flags[i]);
+		if(m->classes[i])
+				fprintf(f, ", \"class\":\"%s\"", json_escape(m->strings[m->classes[i]], buffer, sizeof buffer));
+		if(m->ids[i])
+			fprintf(f, ", \"id\":\"%s\"", json_escape(m->strings[m->ids[i]], buffer, sizeof buffer));
 		fprintf(f, "}%c\n", (i < m->nr * m->nc - 1) ? ',' : ' ');	
 	}
 	fprintf(f, "],\n");
@@ -208,41 +558,36 @@ int map_save(struct map *m, const char *filename) {
 	
 struct map *map_load(const char *filename, int cd) {	
 	struct map *m;
-	char *text = my_readfile (filename);	
-	if(!text) {
+	size_t len;
+	char *data = my_readblob(filename, &len);	
+	if(!data) {
 		rerror("Unable to read map file %s", filename);
 		return NULL;
 	}
 	rlog("Parsing map file %s", filename);
-	m = map_parse(text, cd);	
-	free(text);
+	m = map_parse_mem(data, len, cd);	
+	free(data);
 	return m;
 }
 
-struct map *map_parse(const char *text, int cd) {
+/* Creates a map from its JSON object.
+If tilesets is zero the tilesets are not loaded, only the tile size is read. */
+static struct map *json_to_map(JSON *j, int cd, int tilesets) {
 	double version;
 	struct map *m = NULL;
 	int nr, nc, tw, th, nl;
-	JSON *j, *a, *e;
+	JSON *a, *e;
 	int p,q;
 	const char *s;
 	
-	j = json_parse(text);
-	if(!j) {
-		rerror("Unable to parse map file JSON");
-		return 0;
-	}
-	
 	if(!json_get_string(j, "type") || strcmp(json_get_string(j, "type"), "2D_TILE_MAP")) {
 		rerror("JSON object is not of type 2D_TILE_MAP");
-		json_free(j);
 		return 0;
 	}
 		
 	version = json_get_number(j, "version");
 	if(version < 1.2) {
 		rerror("Map version (%f) is too old", version);
-		json_free(j);
 		return NULL;
 	}
 	
@@ -266,33 +611,35 @@ struct map *map_parse(const char *text, int cd) {
 	}
 		
 	a = json_get_object(j, "tilesets");
-	if(!ts_read_all(&m->tiles, a)) {
-		rerror("Not loading map because tilesets couldn't be loaded.");
-		return NULL;
+	if(tilesets) {
+		if(!ts_read_all(&m->tiles, a)) {
+			rerror("Not loading map because tilesets couldn't be loaded.");
+			map_free(m);
+			return NULL;
+		}
+	} else if(a) {
+		m->tiles.tw = json_get_number(a, "tw");
+		m->tiles.th = json_get_number(a, "th");
 	}
 	
 	a = json_get_array(j, "cells");
 	e = a->value;
 	p = 0;
 	while(e) {		
-		struct map_cell *c;	
 		JSON *aa, *ee;
 		
 		assert(p < nr * nc);
-		c = &m->cells[p++];	
 		
 		ee = json_get_member(e, "flags");
 		if(ee)
-			c->flags = json_as_number(ee);
-		else
-			c->flags = 0;
+			m->flags[p] = json_as_number(ee);
 		
 		s = json_get_string(e, "id");
 		if(s)
-			c->id = strdup(s);
+			m->ids[p] = intern(m, s);
 		s = json_get_string(e, "class");
 		if(s)
-			c->clas = strdup(s);
+			m->classes[p] = intern(m, s);
 		
 		aa = json_get_array(e, "tiles");
 		ee = aa->value;
@@ -300,7 +647,7 @@ struct map *map_parse(const char *text, int cd) {
 		while(ee) {
 			struct map_tile *mt;
 			assert(q < m->nl);
-			mt = &c->tiles[q++];
+			mt = &m->layers[q++ * nr * nc + p];
 			
 			mt->ti = json_get_number(ee, "ti");
 			mt->si = json_get_number(ee, "si");
@@ -308,10 +655,509 @@ struct map *map_parse(const char *text, int cd) {
 			ee = ee->next;
 		}
 		
+		p++;
 		e = e->next;
 	}
 	
+	return m;
+}
+
+static struct map *parse_bin(const unsigned char *data, size_t len, int cd);
+
+struct map *map_parse(const char *text, int cd) {
+	return map_parse_mem(text, strlen(text), cd);
+}
+
+struct map *map_parse_mem(const char *data, size_t len, int cd) {
+	struct map *m;
+	char *text;
+	JSON *j;
+	
+	if(len >= 4 && !memcmp(data, MAP_BIN_MAGIC, 4))
+		return parse_bin((const unsigned char *)data, len, cd);
+	
+	/* The JSON parser needs a NUL terminated string */
+	text = malloc(len + 1);
+	if(!text) {
+		rerror("Out of memory parsing map");
+		return NULL;
+	}
+	memcpy(text, data, len);
+	text[len] = '\0';
+	
+	j = json_parse(text);
+	free(text);
+	if(!j) {
+		rerror("Unable to parse map file JSON");
+		return 0;
+	}
+	
+	m = json_to_map(j, cd, 1);
+	
 	json_free(j);
 	
 	return m;
 }
+
+/* Binary map files ****************************************************
+
+All values are 32-bit little-endian words, except the tiles, which are
+16-bit (si, ti) pairs. Each section starts on a 4-byte boundary, so the 
+planes can be copied (or used) directly from the file's bytes.
+
+  header   - "RMAP", version, file size, rows, columns, layers, 
+             tile width, tile height and the offsets of the 
+             strings, tilesets, layers, flags, ids and classes sections
+  strings  - count, followed by the strings. String 0 is always "".
+  tilesets - rel-work-directory, count, and for each tileset its
+             name, border, mask, nmeta, followed by nmeta 
+             (ti, flags, class) tile meta entries.
+  layers   - num_layers * rows * columns tiles, as in struct map.
+  flags, ids, classes - rows * columns words each. 
+             ids and classes are indexes into the strings section.
+
+Strings are stored as a length word followed by the characters and a
+NUL terminator, padded to the next 4-byte boundary.
+*/
+
+enum {
+	H_MAGIC, H_VERSION, H_SIZE, H_ROWS, H_COLS, H_LAYERS, H_TW, H_TH,
+	H_STRINGS, H_TILESETS, H_TILES, H_FLAGS, H_IDS, H_CLASSES,
+	H_WORDS
+};
+
+static int little_endian() {
+	const unsigned int one = 1;
+	return *(const unsigned char *)&one;
+}
+
+static void put_word(FILE *f, unsigned int w) {
+	unsigned char b[4];
+	b[0] = w; b[1] = w >> 8; b[2] = w >> 16; b[3] = w >> 24;
+	fwrite(b, 1, 4, f);
+}
+
+static void put_string(FILE *f, const char *s) {
+	static const char pad[4];
+	size_t len = s ? strlen(s) : 0;
+	put_word(f, len);
+	if(len)
+		fwrite(s, 1, len, f);
+	fwrite(pad, 1, 4 - (len & 3), f);
+}
+
+static void put_tilesets(FILE *f, struct tile_collection *tc) {
+	int i, j;
+	put_word(f, tc->ntilesets);
+	for(i = 0; i < tc->ntilesets; i++) {
+		struct tileset *t = tc->tilesets[i];
+		put_string(f, t->name);
+		put_word(f, t->border);
+		put_word(f, bm_get_color(t->bm));
+		put_word(f, t->nmeta);
+		for(j = 0; j < t->nmeta; j++) {
+			put_word(f, t->meta[j].ti);
+			put_word(f, t->meta[j].flags);
+			put_string(f, t->meta[j].clas);
+		}
+	}
+}
+
+/* Same as put_tilesets(), but the tilesets come straight from the 
+JSON file, so that the bitmaps need not be loaded. See ts_read_all() */
+static void put_json_tilesets(FILE *f, JSON *j) {
+	JSON *a, *e, *ee;
+	double version = json_get_number(j, "version");
+	
+	a = json_get_array(j, "tilesets");
+	put_word(f, a ? json_array_len(a) : 0);
+	for(e = a ? a->value : NULL; e; e = e->next) {
+		const char *clas;
+		if(version > 1.1f) {
+			put_string(f, json_get_string(e, "name"));
+			put_word(f, json_get_number(e, "border"));
+			put_word(f, bm_color_atoi(json_get_string(e, "mask")));
+		} else {
+			put_string(f, json_get_string(e, "name"));
+			put_word(f, json_get_number(j, "border"));
+			put_word(f, 0xFF00FF);
+		}
+		a = json_get_array(e, "meta");
+		put_word(f, a ? json_array_len(a) : 0);
+		for(ee = a ? a->value : NULL; ee; ee = ee->next) {
+			put_word(f, json_get_number(ee, "ti"));
+			put_word(f, json_get_number(ee, "flags"));
+			clas = json_get_string(ee, "class");
+			put_string(f, clas ? clas : "");
+		}
+	}
+}
+
+/* Strings stay interned after the last cell that used them changes,
+	so only the ones that are still used are saved. Returns an array 
+	that maps the indexes in m->strings to the saved ones, and the 
+	number of saved strings (including string 0) in count. */
+static int *saved_strings(struct map *m, int *count) {
+	int i, n = m->nr * m->nc;
+	int *remap = calloc(m->nstrings, sizeof *remap);
+	if(!remap)
+		return NULL;
+	for(i = 0; i < n; i++) {
+		remap[m->ids[i]] = 1;
+		remap[m->classes[i]] = 1;
+	}
+	*count = 1;
+	for(i = 1; i < m->nstrings; i++)
+		remap[i] = remap[i] ? (*count)++ : 0;
+	remap[0] = 0;
+	return remap;
+}
+
+static int write_bin(struct map *m, FILE *f, const char *rwd, JSON *tilesets) {
+	unsigned int hdr[H_WORDS];
+	int i, n = m->nr * m->nc, count;
+	long start = ftell(f);
+	int *remap = saved_strings(m, &count);
+	if(!remap) {
+		rerror("Out of memory saving map");
+		return 0;
+	}
+	
+	/* The header is written again at the end, when the offsets are known */
+	memset(hdr, 0, sizeof hdr);
+	for(i = 0; i < H_WORDS; i++)
+		put_word(f, 0);
+	
+	hdr[H_STRINGS] = ftell(f) - start;
+	put_word(f, count);
+	put_string(f, "");
+	for(i = 1; i < m->nstrings; i++)
+		if(remap[i])
+			put_string(f, m->strings[i]);
+	
+	hdr[H_TILESETS] = ftell(f) - start;
+	put_string(f, rwd);
+	if(tilesets)
+		put_json_tilesets(f, tilesets);
+	else
+		put_tilesets(f, &m->tiles);
+	
+	hdr[H_TILES] = ftell(f) - start;
+	for(i = 0; i < m->nl * n; i++) {
+		unsigned char b[4];
+		unsigned short si = m->layers[i].si, ti = m->layers[i].ti;
+		b[0] = si; b[1] = si >> 8; b[2] = ti; b[3] = ti >> 8;
+		fwrite(b, 1, 4, f);
+	}
+	
+	hdr[H_FLAGS] = ftell(f) - start;
+	for(i = 0; i < n; i++)
+		put_word(f, m->flags[i]);
+	hdr[H_IDS] = ftell(f) - start;
+	for(i = 0; i < n; i++)
+		put_word(f, remap[m->ids[i]]);
+	hdr[H_CLASSES] = ftell(f) - start;
+	for(i = 0; i < n; i++)
+		put_word(f, remap[m->classes[i]]);
+	free(remap);
+	
+	hdr[H_SIZE] = ftell(f) - start;
+	hdr[H_VERSION] = MAP_BIN_VERSION;
+	hdr[H_ROWS] = m->nr;
+	hdr[H_COLS] = m->nc;
+	hdr[H_LAYERS] = m->nl;
+	hdr[H_TW] = m->tiles.tw;
+	hdr[H_TH] = m->tiles.th;
+	
+	fseek(f, start, SEEK_SET);
+	fwrite(MAP_BIN_MAGIC, 1, 4, f);
+	for(i = 1; i < H_WORDS; i++)
+		put_word(f, hdr[i]);
+	fseek(f, start + hdr[H_SIZE], SEEK_SET);
+	
+	return !ferror(f);
+}
+
+int map_save_bin(struct map *m, const char *filename) {
+	char rwd[128];
+	int r;
+	
+	FILE *f = fopen(filename, "wb");
+	if(!f) {
+		rerror("Unable to open %s for writing map file.", filename);
+		return 0;
+	}
+	rlog("Saving binary map file %s", filename);
+	
+	get_relpath(filename, rwd, sizeof rwd);
+	r = write_bin(m, f, rwd, NULL);
+	if(!r)
+		rerror("Unable to write map file %s", filename);
+	
+	fclose(f);
+	return r;
+}
+
+int map_convert(const char *text, FILE *f) {
+	struct map *m;
+	const char *rwd;
+	int r;
+	JSON *j = json_parse(text);
+	if(!j) {
+		rerror("Unable to parse map file JSON");
+		return 0;
+	}
+	m = json_to_map(j, 0, 0);
+	if(!m) {
+		json_free(j);
+		return 0;
+	}
+	rwd = json_get_string(j, "rel-work-directory");
+	r = write_bin(m, f, rwd ? rwd : "", json_get_object(j, "tilesets"));
+	map_free(m);
+	json_free(j);
+	return r;
+}
+
+/* Reads words and strings from a binary map, with bounds checks. */
+struct bin_reader {
+	const unsigned char *data;
+	size_t len, pos;
+	int error;
+};
+
+static unsigned int get_word(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int read_word(struct bin_reader *r) {
+	unsigned int w;
+	if(r->error || r->len - r->pos < 4) {
+		r->error = 1;
+		return 0;
+	}
+	w = get_word(r->data + r->pos);
+	r->pos += 4;
+	return w;
+}
+
+static const char *read_string(struct bin_reader *r) {
+	const char *s;
+	size_t len = read_word(r), size = (len + 4) & ~(size_t)3;
+	if(r->error || size > r->len - r->pos || r->data[r->pos + len]) {
+		r->error = 1;
+		return "";
+	}
+	s = (const char *)r->data + r->pos;
+	r->pos += size;
+	return s;
+}
+
+static int read_tilesets(struct tile_collection *tc, struct bin_reader *r) {
+	unsigned int i, j, count = read_word(r);
+	for(i = 0; i < count && !r->error; i++) {
+		struct tileset *t;
+		const char *name = read_string(r);
+		int border = read_word(r);
+		unsigned int mask = read_word(r);
+		unsigned int nmeta = read_word(r);
+		int y;
+		
+		/* Each meta entry takes at least 12 bytes */
+		if(r->error || nmeta > (r->len - r->pos) / 12)
+			return 0;
+		
+		y = ts_add(tc, name);
+		if(y < 0) 
+			return 0;
+		t = ts_get(tc, y);
+		
+		t->border = border;
+		bm_set_color(t->bm, mask);
+		
+		t->nmeta = 0;
+		t->meta = nmeta ? malloc(nmeta * sizeof *t->meta) : NULL;
+		if(nmeta && !t->meta)
+			return 0;
+		for(j = 0; j < nmeta; j++) {
+			struct tile_meta *m = &t->meta[j];
+			m->ti = read_word(r);
+			m->flags = read_word(r);
+			m->clas = strdup(read_string(r));
+			t->nmeta++;
+		}
+	}
+	return !r->error;
+}
+
+static struct map *parse_bin(const unsigned char *data, size_t len, int cd) {
+	struct bin_reader r;
+	unsigned int hdr[H_WORDS];
+	struct map *m;
+	int *remap = NULL;
+	size_t n, i, count;
+	const char *rwd;
+	
+	if(len < H_WORDS * 4) {
+		rerror("Binary map file is truncated");
+		return NULL;
+	}
+	for(i = 0; i < H_WORDS; i++)
+		hdr[i] = get_word(data + i * 4);
+	
+	if(hdr[H_VERSION] != MAP_BIN_VERSION) {
+		rerror("Binary map version %u is not supported", hdr[H_VERSION]);
+		return NULL;
+	}
+	if(hdr[H_SIZE] > len) {
+		rerror("Binary map file is truncated");
+		return NULL;
+	}
+	len = hdr[H_SIZE];
+	
+	n = (size_t)hdr[H_ROWS] * hdr[H_COLS];
+	if(!hdr[H_ROWS] || !hdr[H_COLS] || !hdr[H_LAYERS] || hdr[H_LAYERS] > len || n > len
+		|| hdr[H_STRINGS] > len || hdr[H_TILESETS] > len
+		|| hdr[H_TILES] > len || n * hdr[H_LAYERS] > (len - hdr[H_TILES]) / 4
+		|| hdr[H_FLAGS] > len || n > (len - hdr[H_FLAGS]) / 4
+		|| hdr[H_IDS] > len || n > (len - hdr[H_IDS]) / 4
+		|| hdr[H_CLASSES] > len || n > (len - hdr[H_CLASSES]) / 4) {
+		rerror("Binary map file is corrupt");
+		return NULL;
+	}
+	
+	r.data = data;
+	r.len = len;
+	r.error = 0;
+	
+	r.pos = hdr[H_TILESETS];
+	rwd = read_string(&r);
+	if(r.error) {
+		rerror("Binary map file is corrupt");
+		return NULL;
+	}	
+	if(cd && chdir(rwd)) {
+		rerror("chdir(%s): %s", rwd, strerror(errno));
+	}
+	
+	m = map_create(hdr[H_ROWS], hdr[H_COLS], hdr[H_TW], hdr[H_TH], hdr[H_LAYERS]);
+	if(!m) {
+		rerror("Unable to create map.");
+		return NULL;
+	}
+	
+	if(!read_tilesets(&m->tiles, &r)) {
+		rerror("Not loading map because tilesets couldn't be loaded.");
+		goto error;
+	}
+	
+	/* The strings are interned again, so remap their indexes */
+	r.pos = hdr[H_STRINGS];
+	count = read_word(&r);
+	if(r.error || count > (len - r.pos) / 4) {
+		rerror("Binary map file is corrupt");
+		goto error;
+	}
+	remap = malloc((count + 1) * sizeof *remap);
+	if(!remap) {
+		rerror("Out of memory loading map");
+		goto error;
+	}
+	for(i = 0; i < count && !r.error; i++)
+		remap[i] = intern(m, read_string(&r));
+	if(r.error) {
+		rerror("Binary map file is corrupt");
+		goto error;
+	}
+	
+	if(little_endian() && sizeof *m->layers == 4 && sizeof *m->flags == 4) {
+		memcpy(m->layers, data + hdr[H_TILES], n * hdr[H_LAYERS] * 4);
+		memcpy(m->flags, data + hdr[H_FLAGS], n * 4);
+	} else {
+		const unsigned char *p = data + hdr[H_TILES];
+		for(i = 0; i < n * hdr[H_LAYERS]; i++, p += 4) {
+			m->layers[i].si = (short)(p[0] | (p[1] << 8));
+			m->layers[i].ti = (short)(p[2] | (p[3] << 8));
+		}
+		for(i = 0; i < n; i++)
+			m->flags[i] = get_word(data + hdr[H_FLAGS] + i * 4);
+	}
+	
+	for(i = 0; i < n; i++) {
+		unsigned int id = get_word(data + hdr[H_IDS] + i * 4);
+		unsigned int clas = get_word(data + hdr[H_CLASSES] + i * 4);
+		if(id >= count || clas >= count) {
+			rerror("Binary map file is corrupt");
+			goto error;
+		}
+		m->ids[i] = remap[id];
+		m->classes[i] = remap[clas];
+	}
+	
+	free(remap);
+	return m;
+error:
+	free(remap);
+	map_free(m);
+	return NULL;
+}
+
+/* Lists the tilesets of a map without loading them or the map, so that
+	they can be loaded ahead of time. */
+int map_tilesets(const char *data, size_t len, void (*fun)(const char *name, void *udata), void *udata) {
+	int count = 0;
+	
+	if(len >= H_WORDS * 4 && !memcmp(data, MAP_BIN_MAGIC, 4)) {
+		struct bin_reader r;
+		unsigned int i, j, n, nmeta;
+		const char *name;
+		
+		r.data = (const unsigned char *)data;
+		r.len = len;
+		r.pos = get_word(r.data + H_TILESETS * 4);
+		r.error = r.pos > len;
+		
+		read_string(&r); /* rel-work-directory */
+		n = read_word(&r);
+		for(i = 0; i < n && !r.error; i++) {
+			name = read_string(&r);
+			read_word(&r); /* border */
+			read_word(&r); /* mask */
+			nmeta = read_word(&r);
+			for(j = 0; j < nmeta && !r.error; j++) {
+				read_word(&r);
+				read_word(&r);
+				read_string(&r);
+			}
+			if(r.error)
+				break;
+			fun(name, udata);
+			count++;
+		}
+		return r.error ? -1 : count;
+	} else {
+		JSON *j, *a, *e;
+		char *text = malloc(len + 1);
+		if(!text)
+			return -1;
+		memcpy(text, data, len);
+		text[len] = '\0';
+		j = json_parse(text);
+		free(text);
+		if(!j)
+			return -1;
+		
+		a = json_get_object(j, "tilesets");
+		if(a)
+			a = json_get_array(a, "tilesets");
+		for(e = a ? a->value : NULL; e; e = e->next) {
+			const char *name = json_get_string(e, "name");
+			if(name) {
+				fun(name, udata);
+				count++;
+			}
+		}
+		json_free(j);
+	}
+	return count;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -8,7 +9,12 @@
 #  include <SDL2/SDL.h>
 #endif
 
+#include <zlib.h>
+
 #include "pak.h"
+#include "archio.h"
+#include "utils.h"
+#include "hash.h"
 
 int pak_verbose = 0;
 
@@ -17,20 +23,48 @@ struct pak_hdr {
 	int offset, length;
 };
 
+/* A Quake PAK (magic "PACK") stores only the first 64 bytes
+	(name, offset and length) of every directory entry. 
+	Archives with compressed files (magic "PAKZ") store all of it. */
 struct pak_dir {	
 	char name[56];
-	int offset, length;
+	int offset, length; /* length is the number of bytes stored */
+	int size;   /* Size of the file when uncompressed */
+	int method; /* PAK_STORE or PAK_DEFLATE */
 };
 
+#define QUAKE_DIR_SIZE 64
+
 struct pak_file {
 #ifdef USESDL
     SDL_RWops *f;
 #else
 	FILE *f;
 #endif
+	char *name;
 	int nf;
 	struct pak_dir *dir;
 	
+	/* Maps file names to their index in dir (plus one) */
+	Hash_Tbl *index;
+	
+	int sorted; /* Is dir currently sorted by name? */
+	int sort;   /* Sort dir by name when it is written? */
+	
+	int method;     /* Compression method for files being appended */
+	int compressed; /* Are any of the files compressed? */
+	
+	/* Files appended since the archive was opened, keyed by their 
+		hash, size and compression method, so that duplicates are 
+		only stored once */
+	Hash_Tbl *contents;
+	
+	int align; /* Files are stored at multiples of this */
+	
+	/* The whole archive, if it was opened with pak_open_mapped() */
+	const char *map;
+	size_t map_len;
+	
 	int dirty;
 	int next_offset;
 };
@@ -55,7 +89,69 @@ struct pak_file {
 #define REWIND(f) rewind(f)
 #endif
 
-struct pak_file *pak_open(const char *name) {
+static int index_file(struct pak_file *p, int i) {
+	if(ht_get(p->index, p->dir[i].name))
+		return 1; /* Duplicate name; keep the first one */
+	return ht_put(p->index, p->dir[i].name, (void *)(intptr_t)(i + 1)) != NULL;
+}
+
+static int build_index(struct pak_file *p) {
+	int i, size = 512;
+	while(size < p->nf * 2)
+		size <<= 1;
+	p->index = ht_create(size);
+	if(!p->index)
+		return 0;
+	p->sorted = 1;
+	for(i = 0; i < p->nf; i++) {
+		p->dir[i].name[sizeof p->dir[i].name - 1] = '\0';
+		if(!index_file(p, i))
+			return 0;
+		if(i > 0 && strcmp(p->dir[i - 1].name, p->dir[i].name) > 0)
+			p->sorted = 0;
+	}
+	return 1;
+}
+
+/* Size of a directory entry on disk */
+static size_t dir_entry_size(struct pak_file *p) {
+	return p->compressed ? sizeof *p->dir : QUAKE_DIR_SIZE;
+}
+
+static int read_dir(struct pak_file *p) {
+	int i;
+	if(p->compressed) {
+		if(READFUN(p->dir, sizeof *p->dir, p->nf, p->f) != p->nf)
+			return 0;
+		for(i = 0; i < p->nf; i++) {
+			if(p->dir[i].method != PAK_STORE && p->dir[i].method != PAK_DEFLATE) {
+				if(pak_verbose) fprintf(stderr, "[pak_open] unknown compression method %d\n", p->dir[i].method);
+				return 0;
+			}
+		}
+	} else {
+		for(i = 0; i < p->nf; i++) {
+			if(READFUN(&p->dir[i], QUAKE_DIR_SIZE, 1, p->f) != 1)
+				return 0;
+			p->dir[i].size = p->dir[i].length;
+			p->dir[i].method = PAK_STORE;
+		}
+	}
+	return 1;
+}
+
+static int write_dir(struct pak_file *p) {
+	int i;
+	if(p->compressed)
+		return WRITFUN(p->dir, sizeof *p->dir, p->nf, p->f) == p->nf;
+	for(i = 0; i < p->nf; i++) {
+		if(WRITFUN(&p->dir[i], QUAKE_DIR_SIZE, 1, p->f) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+static struct pak_file *open_pak(const char *name, const char *mode) {
 	struct pak_file *p;
 	struct pak_hdr hdr;
 	int i;
@@ -66,8 +162,17 @@ struct pak_file *pak_open(const char *name) {
 	if(!p) return NULL;
 	
 	p->dirty = 0;
-
-	p->f = OPENFUN(name, "r+b");	
+	p->sort = 0;
+	p->method = PAK_STORE;
+	p->compressed = 0;
+	p->contents = NULL;
+	p->align = 1;
+	p->index = NULL;
+	p->map = NULL;
+	p->map_len = 0;
+	p->name = NULL;
+
+	p->f = OPENFUN(name, mode);	
 	if(!p->f) {
 		free(p);
 		return NULL;
@@ -80,16 +185,18 @@ struct pak_file *pak_open(const char *name) {
 		goto error;
 	}
 	
-	if(strncmp(hdr.magic, "PACK", 4)) {
+	if(!strncmp(hdr.magic, "PAKZ", 4)) {
+		p->compressed = 1;
+	} else if(strncmp(hdr.magic, "PACK", 4)) {
 		if(pak_verbose) fprintf(stderr, "[pak_open] bad magic\n");
 		goto error;
 	}
 	
 	if(pak_verbose > 1) printf("[pak_open] directory: offset: %d; length: %d;\n", hdr.offset, hdr.length);
 	
-	assert(sizeof *p->dir == 64);
+	assert(sizeof *p->dir == 72);
 	
-	p->nf = hdr.length / (sizeof *p->dir);
+	p->nf = hdr.length / dir_entry_size(p);
 	
 	if(pak_verbose > 1) printf("[pak_open] there are %d files in the archive\n", p->nf);
 	
@@ -99,12 +206,20 @@ struct pak_file *pak_open(const char *name) {
 	}
 	
 	p->dir = calloc(p->nf, sizeof *p->dir);
-	if(READFUN(p->dir, sizeof *p->dir, p->nf, p->f) != p->nf) {
+	if(!read_dir(p)) {
 		if(pak_verbose) perror("[pak_open] couldn't read directory");
 		free(p->dir);
 		goto error;
 	}
 	
+	if(!build_index(p)) {
+		if(pak_verbose) fprintf(stderr, "[pak_open] couldn't build directory index\n");
+		if(p->index)
+			ht_free(p->index, NULL);
+		free(p->dir);
+		goto error;
+	}
+	
 	/* Set p->next_offset.
 	If the directory is at the end of the file, we can just overwrite the directory 
 	when appending files and write the directory later.
@@ -123,6 +238,11 @@ struct pak_file *pak_open(const char *name) {
 		}
 	}		
 	
+	/* Kept so that pak_get_rwops() can open its own handles on the file */
+	p->name = malloc(strlen(name) + 1);
+	if(p->name)
+		strcpy(p->name, name);
+	
 	return p;
 		
 error:
@@ -131,12 +251,29 @@ error:
 	return NULL;
 }
 
+struct pak_file *pak_open(const char *name) {
+	return open_pak(name, "r+b");
+}
+
+struct pak_file *pak_open_mapped(const char *name) {
+	struct pak_file *p = open_pak(name, "rb");
+	if(!p) 
+		return NULL;
+	p->map = archio_map(name, &p->map_len);
+	if(!p->map) {
+		if(pak_verbose) fprintf(stderr, "[pak_open_mapped] unable to map %s: %s\n", name, strerror(errno));
+		pak_close(p);
+		return NULL;
+	}
+	return p;
+}
+
 static void write_header(struct pak_file *p, int dir_offset) {	
 	struct pak_hdr hdr;
 	
-	strncpy(hdr.magic, "PACK", 4);
+	strncpy(hdr.magic, p->compressed ? "PAKZ" : "PACK", 4);
 	hdr.offset = dir_offset;
-	hdr.length = p->nf * (sizeof *p->dir);
+	hdr.length = p->nf * dir_entry_size(p);
 	
 	assert(p->f);
 	REWIND(p->f);	
@@ -153,11 +290,33 @@ struct pak_file *pak_create(const char *name) {
 	p->nf = 0;	
 	p->dir = NULL;
 	p->dirty = 0;
+	p->sorted = 1;
+	p->sort = 0;
+	p->method = PAK_STORE;
+	p->compressed = 0;
+	p->contents = NULL;
+	p->align = 1;
+	p->map = NULL;
+	p->map_len = 0;
+	
+	p->name = malloc(strlen(name) + 1);
+	if(p->name)
+		strcpy(p->name, name);
+	
+	p->index = ht_create(0);
+	if(!p->index) {
+		free(p->name);
+		free(p);
+		return NULL;
+	}
 	
-	p->f = OPENFUN(name, "wb");
+	/* Opened for reading as well, to compare duplicates */
+	p->f = OPENFUN(name, "w+b");
 	if(!p->f) {
 		if(pak_verbose) 
 			fprintf(stderr, "[pak_create] unable to open %s: %s\n", name, strerror(errno));
+		ht_free(p->index, NULL);
+		free(p->name);
 		free(p);
 		return NULL;
 	}
@@ -170,15 +329,74 @@ struct pak_file *pak_create(const char *name) {
 	return p;
 }
 
-int pak_append_blob(struct pak_file *p, const char *filename, const char *blob, int len) {
+int pak_pack_blob(const char *blob, int len, int method, struct pak_blob *b) {
+	b->data = blob;
+	b->len = len;
+	b->size = len;
+	b->method = PAK_STORE;
+	b->hash = my_fnv1a(blob, len);
+	b->packed = NULL;
+	
+	if(method == PAK_DEFLATE && len > 0) {
+		uLongf plen = compressBound(len);
+		b->packed = malloc(plen);
+		if(!b->packed) {
+			if(pak_verbose) perror("[pak_pack_blob] Couldn't allocate memory for compression");
+			return 0;
+		}
+		/* Only keep it compressed if that actually saves space */
+		if(compress2((Bytef *)b->packed, &plen, (const Bytef *)blob, len, Z_BEST_COMPRESSION) == Z_OK && plen < len) {
+			b->data = b->packed;
+			b->len = plen;
+			b->method = PAK_DEFLATE;
+		} else {
+			free(b->packed);
+			b->packed = NULL;
+		}
+	}
+	return 1;
+}
+
+void pak_free_blob(struct pak_blob *b) {
+	free(b->packed);
+	b->packed = NULL;
+}
 
-	/*if(len <= 0) {
-		printf("[pak_append_blob] warning: length of %s is %d bytes\n", filename, len);
+/* Is the data stored for dir the same as b's? */
+static int same_data(struct pak_file *p, struct pak_dir *dir, const struct pak_blob *b) {
+	char *stored;
+	int same;
+	if(dir->length != b->len || dir->size != b->size || dir->method != b->method)
 		return 0;
-	}*/
+	stored = malloc(dir->length + 1);
+	if(!stored)
+		return 0;
+	same = SEEKOK(SEEKFUN(p->f, dir->offset, SEEK_SET)) 
+		&& READFUN(stored, 1, dir->length, p->f) == dir->length
+		&& !memcmp(stored, b->data, dir->length);
+	free(stored);
+	return same;
+}
+
+int pak_append_packed(struct pak_file *p, const char *filename, const struct pak_blob *b) {
+	static const char zeros[64];
+	char key[64];
+	int i, offset, pad;
+	struct pak_dir *dir;
 
 	if(pak_verbose > 1) 
-		printf("[pak_append_blob] Appending blob of %d bytes as %s\n", len, filename);
+		printf("[pak_append_packed] Appending blob of %d bytes as %s\n", b->size, filename);
+	
+	if(p->map) {
+		if(pak_verbose) fprintf(stderr, "[pak_append_packed] archive is opened read-only\n");
+		return 0;
+	}
+	
+	if(!p->contents) {
+		p->contents = ht_create(0);
+		if(!p->contents)
+			return 0;
+	}
 	
 	if(!p->dir) {
 		assert(p->nf == 0);
@@ -187,30 +405,78 @@ int pak_append_blob(struct pak_file *p, const char *filename, const char *blob,
 		p->dir = realloc(p->dir, (p->nf + 1) * sizeof *p->dir);
 	}
 	
-	if(!SEEKOK(SEEKFUN(p->f, p->next_offset, SEEK_SET))) {
-		if(pak_verbose) perror("[pak_append_blob] couldn't fseek next offset\n");
-		return 0;
+	snprintf(key, sizeof key, "%016llx:%d:%d", b->hash, b->size, b->method);
+	i = (int)(intptr_t)ht_get(p->contents, key);
+	if(i && same_data(p, &p->dir[i - 1], b)) {
+		/* Duplicate: Share the data that is already there */
+		if(pak_verbose > 1) 
+			printf("[pak_append_packed] %s is the same as %s\n", filename, p->dir[i - 1].name);
+		offset = p->dir[i - 1].offset;
+	} else {
+		offset = (p->next_offset + p->align - 1) / p->align * p->align;
+		
+		if(!SEEKOK(SEEKFUN(p->f, p->next_offset, SEEK_SET))) {
+			if(pak_verbose) perror("[pak_append_packed] couldn't fseek next offset\n");
+			return 0;
+		}
+		for(pad = offset - p->next_offset; pad > 0; pad -= sizeof zeros) {
+			int n = pad < sizeof zeros ? pad : sizeof zeros;
+			if(WRITFUN(zeros, 1, n, p->f) != n) {
+				if(pak_verbose) fprintf(stderr, "[pak_append_packed] unable to pad %s: %s\n", filename, strerror(errno));
+				return 0;
+			}
+		}
+		if(WRITFUN(b->data, 1, b->len, p->f) != b->len) {
+			if(pak_verbose) fprintf(stderr, "[pak_append_packed] unable to write %s: %s\n", filename, strerror(errno));
+			return 0;
+		}
+		if(pak_verbose > 2) 
+			printf("[pak_append_packed] Appended blob; Position is now %d\n", (int)TELLFUN(p->f));
+		p->next_offset = offset + b->len;
+		if(!i)
+			ht_put(p->contents, key, (void *)(intptr_t)(p->nf + 1));
 	}
 	
-	if(WRITFUN(blob, 1, len, p->f) != len) {
-		if(pak_verbose) fprintf(stderr, "[pak_append_blob] unable to write %s: %s\n", filename, strerror(errno));
+	/* Cleared so that the unused bytes of the name are written as zeros */
+	dir = &p->dir[p->nf];
+	memset(dir, 0, sizeof *dir);
+	dir->length = b->len;
+	dir->size = b->size;
+	dir->method = b->method;
+	dir->offset = offset;
+	snprintf(dir->name, 55, "%s", filename);
+	
+	if(p->nf > 0 && strcmp(p->dir[p->nf - 1].name, dir->name) > 0)
+		p->sorted = 0;
+	if(!index_file(p, p->nf)) {
+		if(pak_verbose) fprintf(stderr, "[pak_append_packed] unable to index %s\n", filename);
 		return 0;
 	}
-	
-	if(pak_verbose > 2) 
-		printf("[pak_append_blob] Appended blob; Position is now %d\n", (int)TELLFUN(p->f));		
-	
-	p->dir[p->nf].length = len;
-	p->dir[p->nf].offset = p->next_offset;
-	p->next_offset += len;	
-	snprintf(p->dir[p->nf].name, 55, "%s", filename);
 		
 	p->nf++;
 	p->dirty = 1;
+	if(b->method != PAK_STORE)
+		p->compressed = 1;
 	
 	return 1;
 }
 
+int pak_append_blob(struct pak_file *p, const char *filename, const char *blob, int len) {
+	struct pak_blob b;
+	int rv;
+	
+	if(pak_verbose > 1) 
+		printf("[pak_append_blob] Appending blob of %d bytes as %s\n", len, filename);
+	
+	if(!pak_pack_blob(blob, len, p->method, &b))
+		return 0;
+	if(pak_verbose > 1 && b.method != PAK_STORE) 
+		printf("[pak_append_blob] Compressed %s from %d to %d bytes\n", filename, len, b.len);
+	rv = pak_append_packed(p, filename, &b);
+	pak_free_blob(&b);
+	return rv;
+}
+
 int pak_append_file(struct pak_file *p, const char *filename) {		
 	int rv, len;
 	char *bytes;
@@ -266,6 +532,31 @@ int pak_append_file(struct pak_file *p, const char *filename) {
 	return rv;
 }
 
+static int compare_dir(const void *a, const void *b) {
+	const struct pak_dir *x = a, *y = b;
+	int c = strcmp(x->name, y->name);
+	if(c)
+		return c;
+	/* For duplicate names, keep the entry that was added first in front */
+	return x->offset - y->offset;
+}
+
+void pak_compress(struct pak_file * p, int method) {
+	p->method = method;
+}
+
+void pak_align(struct pak_file * p, int align) {
+	p->align = align > 1 ? align : 1;
+}
+
+void pak_sort(struct pak_file * p) {
+	if(p->map)
+		return;
+	p->sort = 1;
+	if(!p->sorted)
+		p->dirty = 1;
+}
+
 int pak_close(struct pak_file * p) {
 	int rv = 1;
 	if(pak_verbose > 1) printf("[pak_close] closing file\n");
@@ -274,6 +565,8 @@ int pak_close(struct pak_file * p) {
 		int offset;
 		if(pak_verbose > 1) 
 			printf("[pak_close] writing changes to file\n");
+		if(p->sort && !p->sorted)
+			qsort(p->dir, p->nf, sizeof *p->dir, compare_dir);
 		/* Seek the end of the file and write the directory */
 		if(!SEEKOK(SEEKFUN(p->f, 0, SEEK_END))) {
 			if(pak_verbose) 
@@ -281,7 +574,7 @@ int pak_close(struct pak_file * p) {
 			return 0;
 		}
 		offset = TELLFUN(p->f);
-		if(WRITFUN(p->dir, sizeof *p->dir, p->nf, p->f) != p->nf) {
+		if(!write_dir(p)) {
 			if(pak_verbose) 
 				perror("[pak_close] couldn't write directory");
 			rv = 0;
@@ -294,7 +587,12 @@ int pak_close(struct pak_file * p) {
 			printf("[pak_close] no changes need to be written\n");
 	}
 	
+	archio_unmap(p->map, p->map_len);
+	ht_free(p->index, NULL);
+	if(p->contents)
+		ht_free(p->contents, NULL);
 	free(p->dir);
+	free(p->name);
 	if(p->f) 
 		CLOSFUN(p->f);		
 	free(p);	
@@ -306,21 +604,141 @@ int pak_num_files(struct pak_file * p) {
 	return p->nf;
 }
 
+int pak_nth_info(struct pak_file * p, int n, struct pak_info *info) {
+	if(n < 0 || n >= p->nf)
+		return 0;
+	info->offset = p->dir[n].offset;
+	info->length = p->dir[n].length;
+	info->size = p->dir[n].size;
+	info->method = p->dir[n].method;
+	return 1;
+}
+
 const char *pak_nth_file(struct pak_file * p, int n) {
 	assert(n < p->nf);
 	return p->dir[n].name;
 }
 
-static struct pak_dir *get_file(struct pak_file * p, const char *filename) {
+int pak_next_file(struct pak_file * p, const char *prefix, int from) {
+	size_t len = strlen(prefix);
 	int i;
-	for(i = 0; i < p->nf; i++) {
-		if(!strcmp(p->dir[i].name, filename)) {
-			return &p->dir[i];
+	if(from < 0)
+		from = 0;
+	if(p->sorted) {
+		/* The names that start with prefix are all together, 
+		starting at the first name that is not less than prefix. */
+		int lo = from, hi = p->nf;
+		while(lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if(strcmp(p->dir[mid].name, prefix) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
+		if(lo < p->nf && !strncmp(p->dir[lo].name, prefix, len))
+			return lo;
+		return -1;
 	}
+	for(i = from; i < p->nf; i++) {
+		if(!strncmp(p->dir[i].name, prefix, len))
+			return i;
+	}
+	return -1;
+}
+
+static struct pak_dir *get_file(struct pak_file * p, const char *filename) {
+	int i = (int)(intptr_t)ht_get(p->index, filename);
+	if(i)
+		return &p->dir[i - 1];
 	return NULL;
 }
 
+/* Returns the file's bytes in the mapped archive, or NULL */
+static const char *get_view(struct pak_file * p, struct pak_dir *dir) {
+	if(!p->map || dir->offset < 0 || dir->length < 0 
+		|| (size_t)dir->offset > p->map_len || (size_t)dir->length > p->map_len - dir->offset)
+		return NULL;
+	return p->map + dir->offset;
+}
+
+const char *pak_get_view(struct pak_file * p, const char *filename, size_t *len) {
+	const char *view;
+	struct pak_dir *dir;
+	
+	if(!p->map)
+		return NULL;
+	
+	dir = get_file(p, filename);
+	if(!dir) {
+		if(pak_verbose) fprintf(stderr, "[pak_get_view] file not found: %s\n", filename);
+		return NULL;
+	}
+	if(dir->method != PAK_STORE) {
+		if(pak_verbose > 1) printf("[pak_get_view] %s is compressed\n", filename);
+		return NULL;
+	}
+	view = get_view(p, dir);
+	if(!view) {
+		if(pak_verbose) fprintf(stderr, "[pak_get_view] %s is outside the archive\n", filename);
+		return NULL;
+	}
+	if(len)
+		*len = dir->length;
+	return view;
+}
+
+int pak_is_view(struct pak_file * p, const void *ptr) {
+	const char *c = ptr;
+	return p->map && c >= p->map && c < p->map + p->map_len;
+}
+
+/* Reads the file described by dir into out, which must have room 
+	for dir->size bytes, decompressing it if necessary. */
+static int read_entry(struct pak_file * p, struct pak_dir *dir, char *out, const char *fun) {
+	const char *stored = get_view(p, dir);
+	char *tmp = NULL;
+	uLongf size;
+	int rv;
+	
+	if(dir->method == PAK_STORE && stored) {
+		memcpy(out, stored, dir->length);
+		return 1;
+	}
+	
+	if(!stored) {
+		if(!SEEKOK(SEEKFUN(p->f, dir->offset, SEEK_SET))) {
+			if(pak_verbose) fprintf(stderr, "[%s] couldn't locate %s\n", fun, dir->name);
+			return 0;
+		}
+		if(dir->method == PAK_STORE) {
+			if(READFUN(out, 1, dir->length, p->f) != dir->length) {
+				if(pak_verbose) fprintf(stderr, "[%s] couldn't read %s\n", fun, dir->name);
+				return 0;
+			}
+			return 1;
+		}
+		tmp = malloc(dir->length);
+		if(!tmp) {
+			if(pak_verbose) perror("[read_entry] couldn't allocate memory");
+			return 0;
+		}
+		if(READFUN(tmp, 1, dir->length, p->f) != dir->length) {
+			if(pak_verbose) fprintf(stderr, "[%s] couldn't read %s\n", fun, dir->name);
+			free(tmp);
+			return 0;
+		}
+		stored = tmp;
+	}
+	
+	size = dir->size;
+	rv = uncompress((Bytef *)out, &size, (const Bytef *)stored, dir->length) == Z_OK 
+		&& size == dir->size;
+	if(!rv && pak_verbose) 
+		fprintf(stderr, "[%s] couldn't decompress %s\n", fun, dir->name);
+	free(tmp);
+	return rv;
+}
+
 char *pak_get_blob(struct pak_file * p, const char *filename, size_t *len) {
 	char *blob;
 	struct pak_dir *dir;
@@ -333,25 +751,18 @@ char *pak_get_blob(struct pak_file * p, const char *filename, size_t *len) {
 		if(pak_verbose) fprintf(stderr, "[pak_get_blob] file not found: %s\n", filename);
 		return NULL;
 	}	
-	blob = malloc(dir->length);
+	blob = malloc(dir->size);
 	if(!blob) {
 		if(pak_verbose) perror("[pak_get_blob] Couldn't allocate memory for blob");
 		return NULL;
 	}
-	if(!SEEKOK(SEEKFUN(p->f, dir->offset, SEEK_SET))) {
-		if(pak_verbose) perror("[pak_get_blob] Couldn't locate file");
-		free(blob);
-		return NULL;
-	}
-	
-	if(READFUN(blob, 1, dir->length, p->f) != dir->length) {
-		if(pak_verbose) perror("[pak_get_blob] Couldn't read file");
+	if(!read_entry(p, dir, blob, "pak_get_blob")) {
 		free(blob);
 		return NULL;
 	}
 	
 	if(len) {
-		*len = dir->length;
+		*len = dir->size;
 	}
 	return blob;
 }
@@ -370,20 +781,13 @@ char *pak_get_text(struct pak_file * p, const char *filename) {
 		return NULL;
 	}	
 	
-	len = dir->length;
+	len = dir->size;
 	blob = malloc(len + 1);
 	if(!blob) {
 		if(pak_verbose) perror("[pak_get_text] couldn't allocate memory for text");
 		return NULL;
 	}
-	if(!SEEKOK(SEEKFUN(p->f, dir->offset, SEEK_SET))) {
-		if(pak_verbose) perror("[pak_get_text] couldn't fseek file.");
-		free(blob);
-		return NULL;
-	}
-	
-	if(READFUN(blob, 1, len, p->f) != dir->length) {
-		if(pak_verbose) perror("[pak_get_text] couldn't read file.");
+	if(!read_entry(p, dir, blob, "pak_get_text")) {
 		free(blob);
 		return NULL;
 	}
@@ -406,6 +810,11 @@ FILE *pak_get_file(struct pak_file * p, const char *filename) {
 		return NULL;
 	}	
 	
+	if(dir->method != PAK_STORE) {
+		if(pak_verbose) fprintf(stderr, "[pak_get_file] %s is compressed\n", filename);
+		return NULL;
+	}
+	
 	if(!SEEKOK(SEEKFUN(p->f, dir->offset, SEEK_SET))) {
 		if(pak_verbose) perror("[pak_get_file] couldn't fseek file.");
 		return NULL;
@@ -415,24 +824,52 @@ FILE *pak_get_file(struct pak_file * p, const char *filename) {
 #endif
 
 #ifdef USESDL
+/* Opens a stream over the bytes of the file as they are stored in the archive */
+static SDL_RWops *open_stored(struct pak_file * p, struct pak_dir *dir, const char *filename) {
+	const char *view;
+	SDL_RWops *rw;
+	
+	/* If the archive is mapped, read straight from the mapping */
+	view = get_view(p, dir);
+	if(view)
+		return SDL_RWFromConstMem(view, dir->length);
+	
+	if(!p->name)
+		return NULL;
+	
+	/* A stream of its own, so that any number of them can be read at
+		the same time, even from different threads, without disturbing
+		each other or p->f */
+	rw = archio_open_range(p->name, dir->offset, dir->length);
+	if(!rw && pak_verbose) 
+		fprintf(stderr, "[pak_get_rwops] unable to open %s in %s: %s\n", filename, p->name, SDL_GetError());
+	return rw;
+}
+
 SDL_RWops *pak_get_rwops(struct pak_file * p, const char *filename) {
 	struct pak_dir *dir;
+	SDL_RWops *rw, *zrw;
 
 	if(pak_verbose > 1) 
-		printf("[pak_get_file] retrieving file %s from archieve\n", filename);
+		printf("[pak_get_rwops] retrieving file %s from archieve\n", filename);
 	
 	dir = get_file(p, filename);
 		
 	if(!dir) {
-		if(pak_verbose) fprintf(stderr, "[pak_get_file] file not found: %s\n", filename);
+		if(pak_verbose) fprintf(stderr, "[pak_get_rwops] file not found: %s\n", filename);
 		return NULL;
 	}	
 	
-	if(!SEEKOK(SEEKFUN(p->f, dir->offset, SEEK_SET))) {
-		if(pak_verbose) perror("[pak_get_file] couldn't fseek file.");
-		return NULL;
+	rw = open_stored(p, dir, filename);
+	if(!rw || dir->method == PAK_STORE)
+		return rw;
+	
+	zrw = archio_open_inflate(rw, dir->size, ARCHIO_ZLIB);
+	if(!zrw) {
+		if(pak_verbose) fprintf(stderr, "[pak_get_rwops] unable to decompress %s\n", filename);
+		SDL_RWclose(rw);
 	}
-	return p->f;
+	return zrw;
 }
 #endif
 
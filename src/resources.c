@@ -1,69 +1,351 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <assert.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#ifdef __linux__
+#  include <unistd.h>
+#  include <fcntl.h>
+#  include <sys/inotify.h>
+#endif
+
 #include <SDL.h>
 #include <SDL_mixer.h>
 
 #include "pak.h"
+#include "zip.h"
 #include "bmp.h"
 #include "ini.h"
 #include "utils.h"
 #include "hash.h"
 #include "log.h"
+#include "tileset.h"
+#include "map.h"
+#include "resources.h"
+#include "imgcache.h"
+
+/* The sources of the game's files, in the order they were mounted.
+	Later mounts take precedence over earlier ones, so a patch only 
+	needs to contain the files that changed. If nothing is mounted, 
+	files are read from the working directory. */
+enum mount_type { MOUNT_PAK, MOUNT_ZIP, MOUNT_DIR };
+
+struct mount {
+	enum mount_type type;
+	char *name;
+	struct pak_file *pak;
+	struct zip_file *zip;
+};
 
-static struct pak_file *game_pak = NULL;
+#define MAX_MOUNTS 16
+static struct mount mounts[MAX_MOUNTS];
+static int num_mounts = 0;
 
-static const char *pak_file_name = "";
+/* Every file in every mount, mapped to the index (plus one) of 
+	the mount it is read from, so a lookup is a single hash no
+	matter how many archives are mounted */
+static Hash_Tbl *mount_index = NULL;
 
 /* The cache forms a stack, so that it can be pushed 
-	and popped as the game states are pushed and popped. */
+	and popped as the game states are pushed and popped. 
+	Now that re_push() and re_pop() are deprecated, only 
+	the top of the stack is ever used. */
 struct resource_cache {
 	
-	Hash_Tbl *bmp_cache;
-	Hash_Tbl *wav_cache;
-	Hash_Tbl *mus_cache;
+	/* Entries by name, one table for each enum re_kind */
+	Hash_Tbl *cache[RE_NUM_KINDS];
 	
-	/* I expect as development continues, other 
-	things will be cached as well */
+	/* Entries by the address of their resource, for re_retain()/re_release() */
+	Hash_Tbl *entries;
+	
+	/* Compiled sprites, keyed by the address of their bitmap */
+	Hash_Tbl *rle_cache;
+	
+	/* Unreferenced entries of each kind, most recently used first */
+	struct re_entry *lru_head[RE_NUM_KINDS], *lru_tail[RE_NUM_KINDS];
+	
+	struct re_stats stats[RE_NUM_KINDS];
 	
 	struct resource_cache *parent;
 } *re_cache = NULL;
 
+struct re_entry {
+	char *name;
+	enum re_kind kind;
+	void *res;
+	size_t size;
+	int refs;
+	
+	/* Clones and views can't be loaded again, so they 
+		are freed as soon as the last reference is released */
+	int transient;
+	
+	/* A view keeps a reference to the bitmap that owns its pixels */
+	struct bitmap *owner;
+	
+	struct re_entry *prev, *next;
+};
+
+static const char *kind_names[] = {"bitmaps", "sounds", "music"};
+
+static size_t budgets[RE_NUM_KINDS] = {
+	64 * 1024 * 1024, 
+	32 * 1024 * 1024, 
+	0
+};
+
+static void ptr_key(const void *p, char *key, size_t len) {
+	snprintf(key, len, "%p", p);
+}
+
+static void drop_rle(struct bitmap *b);
+
 static struct resource_cache *re_cache_create() {
+	int i;
 	struct resource_cache *rc = malloc(sizeof *rc);
-	rc->bmp_cache = ht_create(128);
-	rc->wav_cache = ht_create(128);
-	rc->mus_cache = ht_create(128);
+	for(i = 0; i < RE_NUM_KINDS; i++) {
+		rc->cache[i] = ht_create(128);
+		rc->lru_head[i] = NULL;
+		rc->lru_tail[i] = NULL;
+		memset(&rc->stats[i], 0, sizeof rc->stats[i]);
+	}
+	rc->entries = ht_create(256);
+	rc->rle_cache = ht_create(128);
 	rc->parent = NULL;
 	return rc;
 }
 
-static void bmp_cache_cleanup(const char *key, void *vb) {
-	struct bitmap *bmp = vb;
-	rlog("Freeing '%s'", key);
-	bm_free(bmp);
+static void free_resource(struct re_entry *e) {
+	rlog("Freeing '%s'", e->name);
+	switch(e->kind) {
+		case RE_BITMAP: bm_free(e->res); break;
+		case RE_SOUND: Mix_FreeChunk(e->res); break;
+		case RE_MUSIC: Mix_FreeMusic(e->res); break;
+		default: break;
+	}
 }
 
-static void wav_cache_cleanup(const char *key, void *vb) {
-	Mix_Chunk *sound = vb;
-	rlog("Freeing '%s'", key);
-	Mix_FreeChunk(sound);
+static void entry_cleanup(const char *key, void *ve) {
+	struct re_entry *e = ve;
+	free_resource(e);
+	free(e->name);
+	free(e);
 }
 
-static void mus_cache_cleanup(const char *key, void *vb) {
-	Mix_Music *music = vb;
-	rlog("Freeing '%s'", key);
-	Mix_FreeMusic(music);
+static void rle_cache_cleanup(const char *key, void *vr) {
+	bm_rle_free(vr);
 }
 
 static void re_cache_destroy(struct resource_cache *rc) {
-	ht_free(rc->bmp_cache, bmp_cache_cleanup);
-	ht_free(rc->wav_cache, wav_cache_cleanup);
-	ht_free(rc->mus_cache, mus_cache_cleanup);
+	int i;
+	/* Everything goes, so views don't need to release their owners.
+		Entries are freed through rc->entries, because entries that 
+		changed on disk are no longer in rc->cache; see invalidate() */
+	ht_free(rc->rle_cache, rle_cache_cleanup);
+	ht_free(rc->entries, entry_cleanup);
+	for(i = 0; i < RE_NUM_KINDS; i++)
+		ht_free(rc->cache[i], NULL);
 	free(rc);
 }
 
+static void lru_unlink(struct re_entry *e) {
+	if(e->prev) 
+		e->prev->next = e->next;
+	else
+		re_cache->lru_head[e->kind] = e->next;
+	if(e->next) 
+		e->next->prev = e->prev;
+	else
+		re_cache->lru_tail[e->kind] = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(struct re_entry *e) {
+	e->prev = NULL;
+	e->next = re_cache->lru_head[e->kind];
+	if(e->next)
+		e->next->prev = e;
+	else
+		re_cache->lru_tail[e->kind] = e;
+	re_cache->lru_head[e->kind] = e;
+}
+
+static void remove_entry(struct re_entry *e) {
+	char key[32];
+	struct re_stats *st = &re_cache->stats[e->kind];
+	
+	if(!e->refs)
+		lru_unlink(e);
+	if(ht_get(re_cache->cache[e->kind], e->name) == e)
+		ht_delete(re_cache->cache[e->kind], e->name);
+	ptr_key(e->res, key, sizeof key);
+	ht_delete(re_cache->entries, key);
+	st->count--;
+	st->bytes -= e->size;
+	
+	if(e->kind == RE_BITMAP)
+		drop_rle(e->res);
+	free_resource(e);
+	if(e->owner)
+		re_release(e->owner);
+	free(e->name);
+	free(e);
+}
+
+/* Mix_FreeChunk() and Mix_FreeMusic() stop the sound, 
+	so sounds that are still playing are not evicted */
+static int is_playing(struct re_entry *e) {
+	int i, n;
+	if(e->kind == RE_MUSIC)
+		return Mix_PlayingMusic();
+	if(e->kind == RE_SOUND) {
+		n = Mix_AllocateChannels(-1);
+		for(i = 0; i < n; i++) {
+			if(Mix_Playing(i) && Mix_GetChunk(i) == e->res)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Evicts the least recently used unreferenced resources 
+	until the kind is within its budget */
+static void trim(enum re_kind kind, struct re_entry *keep) {
+	struct re_stats *st = &re_cache->stats[kind];
+	struct re_entry *e = re_cache->lru_tail[kind], *prev;
+	
+	while(budgets[kind] && st->bytes > budgets[kind] && e) {
+		prev = e->prev;
+		if(e != keep && !is_playing(e)) {
+			rlog("Evicting '%s' from the cache", e->name);
+			st->evictions++;
+			remove_entry(e);
+		}
+		e = prev;
+	}
+}
+
+static size_t bmp_size(struct bitmap *b) {
+	if(b->parent)
+		return sizeof *b;
+	return sizeof *b + (size_t)b->stride * b->h;
+}
+
+static size_t wav_size(Mix_Chunk *c) {
+	return sizeof *c + c->alen;
+}
+
+/* Adds a resource to the cache, with refs references held by the caller */
+static struct re_entry *add_entry(enum re_kind kind, const char *name, void *res, size_t size, int refs) {
+	char key[32];
+	struct re_stats *st = &re_cache->stats[kind];
+	struct re_entry *e = malloc(sizeof *e);
+	if(!e || !(e->name = my_strdup(name))) {
+		rerror("Out of memory caching '%s'", name);
+		free(e);
+		return NULL;
+	}
+	e->kind = kind;
+	e->res = res;
+	e->size = size;
+	e->refs = refs;
+	e->transient = 0;
+	e->owner = NULL;
+	e->prev = e->next = NULL;
+	
+	ht_put(re_cache->cache[kind], name, e);
+	ptr_key(res, key, sizeof key);
+	ht_put(re_cache->entries, key, e);
+	st->count++;
+	st->bytes += size;
+	
+	if(!refs)
+		lru_push(e);
+	trim(kind, e);
+	return e;
+}
+
+/* Finds a cached resource by name and marks it as recently used */
+static struct re_entry *lookup(enum re_kind kind, const char *name) {
+	struct re_entry *e = ht_get(re_cache->cache[kind], name);
+	if(e) {
+		re_cache->stats[kind].hits++;
+		if(!e->refs) {
+			lru_unlink(e);
+			lru_push(e);
+		}
+	} else
+		re_cache->stats[kind].misses++;
+	return e;
+}
+
+static struct re_entry *entry_of(const void *res) {
+	char key[32];
+	ptr_key(res, key, sizeof key);
+	return ht_get(re_cache->entries, key);
+}
+
+void re_retain(const void *res) {
+	struct re_entry *e = entry_of(res);
+	if(!e) {
+		rerror("Retaining a resource that isn't in the cache");
+		return;
+	}
+	if(!e->refs++)
+		lru_unlink(e);
+}
+
+void re_release(const void *res) {
+	struct re_entry *e;
+	if(!re_cache || !res)
+		return;
+	e = entry_of(res);
+	if(!e || e->refs <= 0) {
+		rerror("Releasing a resource that isn't referenced");
+		return;
+	}
+	if(--e->refs)
+		return;
+	if(e->transient) {
+		remove_entry(e);
+	} else {
+		lru_push(e);
+		trim(e->kind, NULL);
+	}
+}
+
+void re_set_budget(enum re_kind kind, size_t bytes) {
+	budgets[kind] = bytes;
+	if(re_cache)
+		trim(kind, NULL);
+}
+
+void re_get_stats(enum re_kind kind, struct re_stats *stats) {
+	struct re_entry *e;
+	*stats = re_cache->stats[kind];
+	stats->budget = budgets[kind];
+	stats->unused = 0;
+	for(e = re_cache->lru_head[kind]; e; e = e->next)
+		stats->unused++;
+}
+
+void re_log_stats() {
+	int i;
+	struct re_stats st;
+	for(i = 0; i < RE_NUM_KINDS; i++) {
+		re_get_stats(i, &st);
+		rlog("Cache %s: %d (%d unused), %lu KB of %lu KB; %lu hits, %lu misses, %lu evictions", 
+			kind_names[i], st.count, st.unused, (unsigned long)(st.bytes >> 10), (unsigned long)(st.budget >> 10),
+			st.hits, st.misses, st.evictions);
+	}
+}
+
 void re_initialize() {
 	rlog("Initializing resources.");	
 	re_cache = re_cache_create();
@@ -71,6 +353,10 @@ void re_initialize() {
 
 void re_clean_up() {
 	rlog("Cleaning up resources");
+	re_preload_deinit();
+	re_unwatch();
+	if(re_cache)
+		re_log_stats();
 	while(re_cache) {
 		struct resource_cache *t = re_cache;
 		re_cache = re_cache->parent;
@@ -100,23 +386,190 @@ void re_pop() {
 }
 #endif
 
-int rs_read_pak(const char *filename) {
-	game_pak = pak_open(filename);
-	if(game_pak) {
-		pak_file_name = filename;
-		return 1;
-	} else {
+static void index_file(int m, const char *filename) {
+	ht_delete(mount_index, filename);
+	ht_put(mount_index, filename, (void *)(intptr_t)(m + 1));
+}
+
+/* Adds all the files under path to the index, named relative to the mount */
+static void index_dir(int m, const char *path, const char *prefix) {
+	struct dirent *dp;
+	DIR *dir = opendir(path);
+	if(!dir) {
+		rerror("Unable to read directory %s: %s", path, strerror(errno));
+		return;
+	}
+	while((dp = readdir(dir)) != NULL) {
+		char full[512], name[512];
+		struct stat st;
+		if(dp->d_name[0] == '.')
+			continue;
+		snprintf(full, sizeof full, "%s/%s", path, dp->d_name);
+		snprintf(name, sizeof name, "%s%s", prefix, dp->d_name);
+		if(stat(full, &st))
+			continue;
+		if(S_ISDIR(st.st_mode)) {
+			strncat(name, "/", sizeof name - strlen(name) - 1);
+			index_dir(m, full, name);
+		} else {
+			index_file(m, name);
+		}
+	}
+	closedir(dir);
+}
+
+/* ZIP archives are recognised by the signature of their first local header */
+static int is_zip(const char *filename) {
+	char magic[4];
+	int rv = 0;
+	FILE *f = fopen(filename, "rb");
+	if(f) {
+		rv = fread(magic, 1, 4, f) == 4 && !memcmp(magic, "PK\3\4", 4);
+		fclose(f);
+	}
+	return rv;
+}
+
+int rs_mount(const char *filename) {
+	struct mount *m;
+	struct stat st;
+	int i, n;
+	
+	if(num_mounts == MAX_MOUNTS) {
+		rerror("Unable to mount %s: Too many mounts", filename);
 		return 0;
 	}
+	if(stat(filename, &st)) {
+		rerror("Unable to mount %s: %s", filename, strerror(errno));
+		return 0;
+	}
+	if(!mount_index) {
+		mount_index = ht_create(0);
+		if(!mount_index)
+			return 0;
+	}
+	
+	m = &mounts[num_mounts];
+	memset(m, 0, sizeof *m);
+	if(S_ISDIR(st.st_mode)) {
+		m->type = MOUNT_DIR;
+	} else if(is_zip(filename)) {
+		m->type = MOUNT_ZIP;
+		m->zip = zip_open(filename);
+		if(!m->zip) {
+			rerror("Unable to open ZIP archive %s", filename);
+			return 0;
+		}
+	} else {
+		m->type = MOUNT_PAK;
+		/* The game only reads from its PAKs, so map them and 
+			load resources straight out of the mapping */
+		m->pak = pak_open_mapped(filename);
+		if(!m->pak) {
+			rlog("Unable to map %s; reading it instead", filename);
+			m->pak = pak_open(filename);
+		}
+		if(!m->pak) {
+			rerror("Unable to open PAK file %s", filename);
+			return 0;
+		}
+	}
+	m->name = my_strdup(filename);
+	
+	switch(m->type) {
+		case MOUNT_PAK:
+			n = pak_num_files(m->pak);
+			for(i = 0; i < n; i++)
+				index_file(num_mounts, pak_nth_file(m->pak, i));
+			break;
+		case MOUNT_ZIP:
+			n = zip_num_files(m->zip);
+			for(i = 0; i < n; i++)
+				index_file(num_mounts, zip_nth_file(m->zip, i));
+			break;
+		case MOUNT_DIR:
+			index_dir(num_mounts, filename, "");
+			break;
+	}
+	num_mounts++;
+	rlog("Mounted %s", filename);
+	return 1;
+}
+
+static struct mount *find_mount(const char *filename) {
+	int i;
+	if(!mount_index)
+		return NULL;
+	i = (int)(intptr_t)ht_get(mount_index, filename);
+	return i ? &mounts[i - 1] : NULL;
+}
+
+/* For error messages */
+static const char *mount_name(const char *filename) {
+	struct mount *m = find_mount(filename);
+	return m ? m->name : "any of the mounted archives";
+}
+
+static const char *dir_path(struct mount *m, const char *filename, char *path, size_t size) {
+	snprintf(path, size, "%s/%s", m->name, filename);
+	return path;
+}
+
+/* Access to the mounted file, wherever it is; see rs_mount() */
+static char *mount_text(const char *filename) {
+	char path[512];
+	struct mount *m = find_mount(filename);
+	if(!m)
+		return NULL;
+	switch(m->type) {
+		case MOUNT_PAK: return pak_get_text(m->pak, filename);
+		case MOUNT_ZIP: return zip_get_text(m->zip, filename);
+		default: return my_readfile(dir_path(m, filename, path, sizeof path));
+	}
+}
+
+static const char *mount_view(const char *filename, size_t *len) {
+	struct mount *m = find_mount(filename);
+	if(!m)
+		return NULL;
+	switch(m->type) {
+		case MOUNT_PAK: return pak_get_view(m->pak, filename, len);
+		case MOUNT_ZIP: return zip_get_view(m->zip, filename, len);
+		default: return NULL;
+	}
+}
+
+static char *mount_blob(const char *filename, size_t *len) {
+	char path[512];
+	struct mount *m = find_mount(filename);
+	if(!m)
+		return NULL;
+	switch(m->type) {
+		case MOUNT_PAK: return pak_get_blob(m->pak, filename, len);
+		case MOUNT_ZIP: return zip_get_blob(m->zip, filename, len);
+		default: return my_readblob(dir_path(m, filename, path, sizeof path), len);
+	}
+}
+
+static SDL_RWops *mount_rwops(const char *filename) {
+	char path[512];
+	struct mount *m = find_mount(filename);
+	if(!m)
+		return NULL;
+	switch(m->type) {
+		case MOUNT_PAK: return pak_get_rwops(m->pak, filename);
+		case MOUNT_ZIP: return zip_get_rwops(m->zip, filename);
+		default: return SDL_RWFromFile(dir_path(m, filename, path, sizeof path), "rb");
+	}
 }
 
 struct ini_file *re_get_ini(const char *filename) {
 	int err, line;
 	struct ini_file *ini;
-	if(game_pak) {
-		char *text = pak_get_text(game_pak, filename);
+	if(num_mounts) {
+		char *text = mount_text(filename);
 		if(!text) {
-			rerror("Unable to find %s in %s", filename, pak_file_name);
+			rerror("Unable to find %s in %s", filename, mount_name(filename));
 			return NULL;
 		}
 		ini = ini_parse(text, &err, &line);
@@ -134,56 +587,72 @@ struct ini_file *re_get_ini(const char *filename) {
 }
 
 static SDL_RWops *re_get_RWops(const char *filename) {
-    if(game_pak) {
-		return pak_get_rwops(game_pak, filename);
+    if(num_mounts) {
+		return mount_rwops(filename);
 	} 
 	return SDL_RWFromFile(filename, "rb");
 }
 
+/* Loads a bitmap, through the image cache. 
+ * It only uses its own RWops, so that the preloader threads can call it too. */
+static struct bitmap *load_bmp(const char *filename) {
+	struct bitmap *bmp;
+	const char *data = NULL;
+	char *buffer = NULL, key[256];
+	size_t len = 0;
+	
+	if(num_mounts)
+		data = mount_view(filename, &len);
+	if(!data) {
+		SDL_RWops *rw = re_get_RWops(filename);
+		Sint64 size;
+		if(!rw) {
+			if(num_mounts)
+				rerror("Unable to locate %s in %s", filename, mount_name(filename));
+			else
+				rerror("Unable to open %s", filename);
+			return NULL;
+		}
+		size = SDL_RWsize(rw);
+		buffer = size > 0 ? malloc(size) : NULL;
+		if(buffer && SDL_RWread(rw, buffer, 1, size) == (size_t)size) {
+			data = buffer;
+			len = size;
+		}
+		SDL_RWclose(rw);
+		if(!data) {
+			rerror("Unable to read bitmap '%s'", filename);
+			free(buffer);
+			return NULL;
+		}
+	}
+	
+	snprintf(key, sizeof key, "%s:%s", num_mounts ? mount_name(filename) : "", filename);
+	bmp = ic_decode(key, data, len);
+	if(!bmp) {
+		if(num_mounts)
+			rerror("Unable to load bitmap '%s' from %s", filename, mount_name(filename));
+		else
+			rerror("Unable to load bitmap '%s'", filename);
+	}
+	free(buffer);
+	return bmp;
+}
+
 /* There is also a re_get_bmp(const char *filename)
  * defined in rengine/editor/resources.c which doesn't
  * use the resource cache.
  */
 struct bitmap *re_get_bmp(const char *filename) {
 	struct bitmap *bmp;
-	
-	/* Search through the current resource cache and
-		all its parents for the desired node. */
-	struct resource_cache *rc = re_cache;	
-	while(rc) {
-		bmp = ht_get(rc->bmp_cache, filename);
-		if(bmp) {
-			return bmp;
-		}
-		rc = rc->parent;
-	}
+	struct re_entry *e = lookup(RE_BITMAP, filename);
+	if(e)
+		return e->res;
 	
 	/* Not cached. Load it. */
-	if(game_pak) {
-		SDL_RWops *rw = re_get_RWops(filename);
-		if(!rw) {
-			rerror("Unable to locate %s in %s", filename, pak_file_name);
-			return NULL;
-		}
-        bmp = bm_load_rw(rw);
-        if(!bmp) {
-            rerror("Unable to load bitmap '%s' from %s", filename, pak_file_name);
-        }		
-    } else {
-        SDL_RWops *rw = SDL_RWFromFile(filename, "rb");
-		if(!rw) {
-			rerror("Unable to open %s", filename);
-			return NULL;
-		}        
-        bmp = bm_load_rw(rw);
-        if(!bmp) {
-            rerror("Unable to load bitmap '%s'", filename);
-        }
-        SDL_RWclose(rw);
-    }
+	bmp = load_bmp(filename);
     if(bmp) {	
-        /* Insert it to the cache on the top of the stack. */
-        ht_put(re_cache->bmp_cache, filename, bmp);
+        add_entry(RE_BITMAP, filename, bmp, bmp_size(bmp), 0);
         rlog("Cached bitmap '%s'", filename);
 	}
     
@@ -191,30 +660,106 @@ struct bitmap *re_get_bmp(const char *filename) {
 }
 
 struct bitmap *re_clone_bmp(struct bitmap *b, const char *newname) {
-	struct resource_cache *rc = re_cache;	
-	struct bitmap *clone = ht_get(rc->bmp_cache, newname);
-	if(clone) {
+	struct re_entry *e;
+	struct bitmap *clone = NULL;
+	if(ht_get(re_cache->cache[RE_BITMAP], newname)) {
 		rerror("Attempt to clone bitmap with an existing name %s", newname);
 		return NULL;
 	}
 	clone = bm_copy(b);
-	ht_put(re_cache->bmp_cache, newname, clone);
+	e = add_entry(RE_BITMAP, newname, clone, bmp_size(clone), 1);
+	if(!e) {
+		bm_free(clone);
+		return NULL;
+	}
+	e->transient = 1;
 	rlog("Cached cloned bitmap as '%s'", newname);
 	return clone;
 }
 
-Mix_Chunk *re_get_wav(const char *filename) {
-	Mix_Chunk *chunk = NULL;
+/* Compiled sprites are created the first time they're asked for
+ * and recreated if the bitmap's mask colour changes. */
+struct bm_rle *re_get_rle(struct bitmap *b) {
+	char key[32];
+	struct bm_rle *rle;
 	
-	struct resource_cache *rc = re_cache;	
-	while(rc) {
-		chunk = ht_get(rc->wav_cache, filename);
-		if(chunk) {
-			return chunk;
-		}
-		rc = rc->parent;
+	ptr_key(b, key, sizeof key);
+	rle = ht_get(re_cache->rle_cache, key);
+	if(rle) {
+		if(rle->color == (b->color & 0xFFFFFF))
+			return rle;
+		bm_rle_free(ht_delete(re_cache->rle_cache, key));
 	}
 	
+	rle = bm_rle_create(b);
+	if(!rle) {
+		rerror("Unable to create compiled sprite");
+		return NULL;
+	}
+	ht_put(re_cache->rle_cache, key, rle);
+	return rle;
+}
+
+static struct bitmap *root_bmp(struct bitmap *b) {
+	while(b->parent)
+		b = b->parent;
+	return b;
+}
+
+static void drop_rle(struct bitmap *b) {
+	char key[32];
+	ptr_key(b, key, sizeof key);
+	bm_rle_free(ht_delete(re_cache->rle_cache, key));
+}
+
+static int drop_related_rle(const char *key, void *ve, void *data) {
+	struct re_entry *e = ve;
+	if(root_bmp(e->res) == data)
+		drop_rle(e->res);
+	return 1;
+}
+
+/* Views share their pixels with their parent, so the compiled 
+ * sprites of all of them go stale together. */
+void re_dirty_bmp(struct bitmap *b) {
+	struct bitmap *root = root_bmp(b);
+	drop_rle(root);
+	ht_foreach(re_cache->cache[RE_BITMAP], drop_related_rle, root);
+	bm_touch(root);
+}
+
+struct bitmap *re_view_bmp(struct bitmap *b, int x, int y, int w, int h, const char *newname) {
+	struct re_entry *e;
+	struct bitmap *view;
+	if(ht_get(re_cache->cache[RE_BITMAP], newname)) {
+		rerror("Attempt to create view with an existing name %s", newname);
+		return NULL;
+	}
+	view = bm_view(b, x, y, w, h);
+	if(!view) {
+		rerror("Unable to create a %dx%d view at %d,%d", w, h, x, y);
+		return NULL;
+	}
+	e = add_entry(RE_BITMAP, newname, view, bmp_size(view), 1);
+	if(!e) {
+		bm_free(view);
+		return NULL;
+	}
+	/* The view doesn't own its pixels, so the bitmap
+	that does has to stay in the cache while it exists */
+	e->transient = 1;
+	e->owner = b;
+	re_retain(b);
+	rlog("Cached bitmap view as '%s'", newname);
+	return view;
+}
+
+Mix_Chunk *re_get_wav(const char *filename) {
+	Mix_Chunk *chunk = NULL;
+	struct re_entry *e = lookup(RE_SOUND, filename);
+	if(e)
+		return e->res;
+	
 	SDL_RWops * ops = re_get_RWops(filename);
 	if(!ops) {
 		return NULL;
@@ -224,7 +769,7 @@ Mix_Chunk *re_get_wav(const char *filename) {
 		return NULL;
 	}
 	
-	ht_put(re_cache->wav_cache, filename, chunk);
+	add_entry(RE_SOUND, filename, chunk, wav_size(chunk), 0);
 	rlog("Cached WAV '%s'", filename);
 	
 	return chunk;
@@ -232,26 +777,23 @@ Mix_Chunk *re_get_wav(const char *filename) {
 
 Mix_Music *re_get_mus(const char *filename) {	
 	Mix_Music *music = NULL;
-	
-	struct resource_cache *rc = re_cache;	
-	while(rc) {
-		music = ht_get(rc->mus_cache, filename);
-		if(music) {
-			return music;
-		}
-		rc = rc->parent;
-	}
+	Sint64 size;
+	struct re_entry *e = lookup(RE_MUSIC, filename);
+	if(e)
+		return e->res;
 	
 	SDL_RWops * ops = re_get_RWops(filename);
 	if(!ops) {
 		return NULL;
 	}	
+	/* The music is decoded as it plays, so count the size of the file */
+	size = SDL_RWsize(ops);
 	music = Mix_LoadMUS_RW(ops, 1);
 	if(!music) {
 		return NULL;
 	}
 	
-	ht_put(re_cache->mus_cache, filename, music);
+	add_entry(RE_MUSIC, filename, music, size > 0 ? size : 0, 0);
 	rlog("Cached Music '%s'", filename);
 	
 	return music;
@@ -259,10 +801,10 @@ Mix_Music *re_get_mus(const char *filename) {
 
 char *re_get_script(const char *filename) {
 	char *txt;
-	if(game_pak) {		
-		txt = pak_get_text(game_pak, filename);
+	if(num_mounts) {		
+		txt = mount_text(filename);
 		if(!txt) {
-			rerror("Unable to load script '%s' from %s", filename, pak_file_name);
+			rerror("Unable to load script '%s' from %s", filename, mount_name(filename));
 		}
 	} else {
 		txt = my_readfile(filename);
@@ -275,3 +817,609 @@ char *re_get_script(const char *filename) {
 	return txt;
 }
 
+
+/* Like re_get_script(), but for binary data: len is set to the size of the data.
+	If the archive is memory mapped, the data is not copied. */
+const char *re_get_data(const char *filename, size_t *len) {
+	const char *blob;
+	if(num_mounts) {
+		blob = mount_view(filename, len);
+		if(!blob)
+			blob = mount_blob(filename, len);
+		if(!blob) {
+			rerror("Unable to load '%s' from %s", filename, mount_name(filename));
+		}
+	} else {
+		blob = my_readblob(filename, len);
+		if(!blob) {
+			rerror("Couldn't load '%s'", filename);
+			return 0;
+		}
+	}
+	return blob;
+}
+
+void re_free_data(const char *data) {
+	int i;
+	for(i = 0; i < num_mounts; i++) {
+		if(mounts[i].pak && pak_is_view(mounts[i].pak, data))
+			return;
+		if(mounts[i].zip && zip_is_view(mounts[i].zip, data))
+			return;
+	}
+	free((char *)data);
+}
+
+/* Preloading *******************************************************
+
+Worker threads load bitmaps and sounds in the background while the 
+game runs. The cache isn't thread safe, so re_preload_update() moves 
+the results into it on the main thread. Music is only opened by 
+Mix_LoadMUS_RW() and decoded as it plays, so it is loaded there too.
+*/
+
+enum preload_type { PRE_BMP, PRE_WAV, PRE_MUS };
+enum preload_state { PRE_TODO, PRE_BUSY, PRE_DONE };
+
+struct preload_job {
+	char *filename;
+	enum preload_type type;
+	enum preload_state state;
+	void *result;
+	struct preload_job *next;
+};
+
+static struct preload_job *pre_jobs = NULL, **pre_tail = &pre_jobs;
+
+/* Jobs not yet finished by a worker */
+static int pre_pending = 0;
+
+/* Jobs queued and jobs applied since the queue was last empty */
+static int pre_total = 0, pre_applied = 0;
+
+static SDL_mutex *pre_lock = NULL;
+static SDL_cond *pre_work = NULL, *pre_idle = NULL;
+static SDL_Thread **pre_threads = NULL;
+static int pre_nthreads = 0, pre_quit = 0;
+
+static int is_cached(enum preload_type type, const char *filename) {
+	enum re_kind kind = type == PRE_BMP ? RE_BITMAP : type == PRE_WAV ? RE_SOUND : RE_MUSIC;
+	return ht_get(re_cache->cache[kind], filename) != NULL;
+}
+
+/* Does the actual loading. This runs on the worker threads,
+	so it must not touch the cache. */
+static void run_job(struct preload_job *job) {
+	SDL_RWops *rw;
+	if(job->type == PRE_MUS)
+		return;
+	if(job->type == PRE_BMP) {
+		job->result = load_bmp(job->filename);
+		return;
+	}
+	rw = re_get_RWops(job->filename);
+	if(!rw)
+		return;
+	switch(job->type) {
+		case PRE_WAV: {
+			job->result = Mix_LoadWAV_RW(rw, 1);
+		} break;
+		default: 
+			SDL_RWclose(rw);
+			break;
+	}
+}
+
+/* Moves the result of a job into the cache. Main thread only. */
+static void apply_job(struct preload_job *job) {
+	switch(job->type) {
+		case PRE_BMP: {
+			if(!job->result) {
+				rerror("Unable to preload bitmap '%s'", job->filename);
+			} else if(is_cached(PRE_BMP, job->filename)) {
+				bm_free(job->result); /* It was loaded in the meantime */
+			} else {
+				add_entry(RE_BITMAP, job->filename, job->result, bmp_size(job->result), 0);
+				rlog("Preloaded bitmap '%s'", job->filename);
+			}
+		} break;
+		case PRE_WAV: {
+			if(!job->result) {
+				rerror("Unable to preload WAV '%s'", job->filename);
+			} else if(is_cached(PRE_WAV, job->filename)) {
+				Mix_FreeChunk(job->result);
+			} else {
+				add_entry(RE_SOUND, job->filename, job->result, wav_size(job->result), 0);
+				rlog("Preloaded WAV '%s'", job->filename);
+			}
+		} break;
+		case PRE_MUS: {
+			re_get_mus(job->filename);
+		} break;
+	}
+}
+
+static void discard_job(struct preload_job *job) {
+	if(job->result) {
+		if(job->type == PRE_BMP)
+			bm_free(job->result);
+		else if(job->type == PRE_WAV)
+			Mix_FreeChunk(job->result);
+	}
+	free(job->filename);
+	free(job);
+}
+
+static int preload_worker(void *unused) {
+	struct preload_job *job;
+	SDL_LockMutex(pre_lock);
+	for(;;) {
+		for(job = pre_jobs; job && job->state != PRE_TODO; job = job->next);
+		if(pre_quit)
+			break;
+		if(!job) {
+			SDL_CondWait(pre_work, pre_lock);
+			continue;
+		}
+		job->state = PRE_BUSY;
+		SDL_UnlockMutex(pre_lock);
+		
+		run_job(job);
+		
+		SDL_LockMutex(pre_lock);
+		job->state = PRE_DONE;
+		if(--pre_pending == 0)
+			SDL_CondBroadcast(pre_idle);
+	}
+	SDL_UnlockMutex(pre_lock);
+	return 0;
+}
+
+/* Queues a job, unless the same file is already queued. Main thread only. */
+static void queue_job(const char *filename, enum preload_type type) {
+	struct preload_job *job;
+	
+	if(!pre_nthreads) {
+		/* No workers, so just load it now */
+		struct preload_job tmp;
+		tmp.filename = (char *)filename;
+		tmp.type = type;
+		tmp.result = NULL;
+		run_job(&tmp);
+		apply_job(&tmp);
+		return;
+	}
+	
+	SDL_LockMutex(pre_lock);
+	for(job = pre_jobs; job; job = job->next) {
+		if(job->type == type && !strcmp(job->filename, filename)) {
+			SDL_UnlockMutex(pre_lock);
+			return;
+		}
+	}
+	job = malloc(sizeof *job);
+	if(job)
+		job->filename = my_strdup(filename);
+	if(!job || !job->filename) {
+		rerror("Out of memory preloading '%s'", filename);
+		free(job);
+		SDL_UnlockMutex(pre_lock);
+		return;
+	}
+	job->type = type;
+	job->state = PRE_TODO;
+	job->result = NULL;
+	job->next = NULL;
+	*pre_tail = job;
+	pre_tail = &job->next;
+	pre_pending++;
+	pre_total++;
+	SDL_CondSignal(pre_work);
+	SDL_UnlockMutex(pre_lock);
+}
+
+int re_preload_init(int nthreads) {
+	int i;
+	if(nthreads <= 0)
+		return 1;
+	pre_lock = SDL_CreateMutex();
+	pre_work = SDL_CreateCond();
+	pre_idle = SDL_CreateCond();
+	pre_threads = calloc(nthreads, sizeof *pre_threads);
+	if(!pre_lock || !pre_work || !pre_idle || !pre_threads) {
+		rerror("Unable to create preloader: %s", SDL_GetError());
+		return 0;
+	}
+	pre_quit = 0;
+	for(i = 0; i < nthreads; i++) {
+		pre_threads[i] = SDL_CreateThread(preload_worker, "preload", NULL);
+		if(!pre_threads[i]) {
+			rerror("Unable to create preloader thread: %s", SDL_GetError());
+			break;
+		}
+	}
+	pre_nthreads = i;
+	rlog("Started %d preloader threads", pre_nthreads);
+	return pre_nthreads > 0;
+}
+
+void re_preload_deinit() {
+	int i;
+	struct preload_job *job;
+	if(!pre_lock)
+		return;
+	
+	SDL_LockMutex(pre_lock);
+	pre_quit = 1;
+	SDL_CondBroadcast(pre_work);
+	SDL_UnlockMutex(pre_lock);
+	for(i = 0; i < pre_nthreads; i++)
+		SDL_WaitThread(pre_threads[i], NULL);
+	
+	while(pre_jobs) {
+		job = pre_jobs;
+		pre_jobs = job->next;
+		discard_job(job);
+	}
+	pre_tail = &pre_jobs;
+	pre_pending = pre_total = pre_applied = 0;
+	
+	free(pre_threads);
+	pre_threads = NULL;
+	pre_nthreads = 0;
+	SDL_DestroyCond(pre_work);
+	SDL_DestroyCond(pre_idle);
+	SDL_DestroyMutex(pre_lock);
+	pre_lock = NULL;
+}
+
+int re_preload(const char *filename) {
+	const char *ext = strrchr(filename, '.');
+	enum preload_type type;
+	
+	if(!ext) {
+		rerror("Don't know how to preload '%s'", filename);
+		return 0;
+	}
+	if(!my_stricmp(ext, ".map") || !my_stricmp(ext, ".rmap"))
+		return re_preload_map(filename);
+	if(!my_stricmp(ext, ".wav"))
+		type = PRE_WAV;
+	else if(!my_stricmp(ext, ".ogg") || !my_stricmp(ext, ".mp3") || !my_stricmp(ext, ".mod") 
+		|| !my_stricmp(ext, ".xm") || !my_stricmp(ext, ".s3m") || !my_stricmp(ext, ".it")
+		|| !my_stricmp(ext, ".mid") || !my_stricmp(ext, ".flac"))
+		type = PRE_MUS;
+	else
+		type = PRE_BMP;
+	
+	if(is_cached(type, filename))
+		return 1;
+	queue_job(filename, type);
+	return 1;
+}
+
+static void preload_tileset(const char *name, void *unused) {
+	re_preload(name);
+}
+
+/* The map itself isn't cached, so it is read here rather than by a worker,
+	and only the tilesets that aren't in the cache yet get queued. */
+int re_preload_map(const char *filename) {
+	size_t len;
+	int n;
+	const char *data = re_get_data(filename, &len);
+	if(!data)
+		return 0;
+	n = map_tilesets(data, len, preload_tileset, NULL);
+	re_free_data(data);
+	if(n < 0) {
+		rerror("Unable to read tilesets of map '%s'", filename);
+		return 0;
+	}
+	return 1;
+}
+
+void re_preload_update() {
+	struct preload_job *job, **prev, *done = NULL, **done_tail = &done;
+	int n = 0;
+	
+	if(!pre_lock)
+		return;
+	
+	SDL_LockMutex(pre_lock);
+	prev = &pre_jobs;
+	while((job = *prev)) {
+		if(job->state == PRE_DONE) {
+			*prev = job->next;
+			job->next = NULL;
+			*done_tail = job;
+			done_tail = &job->next;
+		} else
+			prev = &job->next;
+	}
+	pre_tail = prev;
+	SDL_UnlockMutex(pre_lock);
+	
+	while(done) {
+		job = done;
+		done = job->next;
+		apply_job(job);
+		job->result = NULL;
+		discard_job(job);
+		n++;
+	}
+	
+	SDL_LockMutex(pre_lock);
+	pre_applied += n;
+	if(!pre_jobs) 
+		pre_total = pre_applied = 0;
+	SDL_UnlockMutex(pre_lock);
+}
+
+void re_preload_wait() {
+	if(!pre_lock)
+		return;
+	SDL_LockMutex(pre_lock);
+	while(pre_pending > 0)
+		SDL_CondWait(pre_idle, pre_lock);
+	SDL_UnlockMutex(pre_lock);
+	re_preload_update();
+}
+
+double re_preload_progress() {
+	double p = 1.0;
+	if(!pre_lock)
+		return p;
+	SDL_LockMutex(pre_lock);
+	if(pre_total > 0)
+		p = (double)pre_applied / pre_total;
+	SDL_UnlockMutex(pre_lock);
+	return p;
+}
+
+/* Hot reloading ****************************************************
+
+In directory mode, files that change while the game runs are picked up 
+through inotify. Bitmaps are reloaded in place, so that everything that 
+points to them (Lua's BmpObjs, tilesets) sees the new pixels. Sounds 
+can't be replaced while they may be playing, so they are just dropped
+from the cache and loaded again the next time they are asked for.
+*/
+
+#ifdef __linux__
+static int watch_fd = -1;
+
+/* Watch descriptors (as strings) to the path of their directory 
+	relative to the root of the watch, with a trailing slash */
+static Hash_Tbl *watch_dirs = NULL;
+static char *watch_root = NULL;
+
+static void watch_dir(const char *rel) {
+	char path[512], key[16];
+	struct dirent *dp;
+	DIR *dir;
+	int wd;
+	
+	snprintf(path, sizeof path, "%s/%s", watch_root, rel);
+	wd = inotify_add_watch(watch_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if(wd < 0) {
+		rerror("Unable to watch %s: %s", path, strerror(errno));
+		return;
+	}
+	snprintf(key, sizeof key, "%d", wd);
+	if(!ht_get(watch_dirs, key))
+		ht_put(watch_dirs, key, my_strdup(rel));
+	
+	dir = opendir(path);
+	if(!dir)
+		return;
+	while((dp = readdir(dir)) != NULL) {
+		char sub[512];
+		struct stat st;
+		if(dp->d_name[0] == '.')
+			continue;
+		snprintf(sub, sizeof sub, "%s%s/", rel, dp->d_name);
+		snprintf(path, sizeof path, "%s/%s", watch_root, sub);
+		if(!stat(path, &st) && S_ISDIR(st.st_mode))
+			watch_dir(sub);
+	}
+	closedir(dir);
+}
+#endif
+
+int re_watch(const char *dir) {
+#ifdef __linux__
+	if(watch_fd >= 0)
+		return 1;
+	watch_fd = inotify_init();
+	if(watch_fd < 0) {
+		rerror("Unable to watch %s for changes: %s", dir, strerror(errno));
+		return 0;
+	}
+	fcntl(watch_fd, F_SETFL, fcntl(watch_fd, F_GETFL) | O_NONBLOCK);
+	watch_dirs = ht_create(0);
+	watch_root = my_strdup(dir);
+	watch_dir("");
+	rlog("Watching %s for changes", dir);
+	return 1;
+#else
+	rlog("Hot reloading is not supported on this platform");
+	return 0;
+#endif
+}
+
+#ifdef __linux__
+static void free_dir(const char *key, void *rel) {
+	free(rel);
+}
+#endif
+
+void re_unwatch() {
+#ifdef __linux__
+	if(watch_fd < 0)
+		return;
+	close(watch_fd);
+	watch_fd = -1;
+	ht_free(watch_dirs, free_dir);
+	watch_dirs = NULL;
+	free(watch_root);
+	watch_root = NULL;
+#endif
+}
+
+/* The entry no longer represents the file: Whoever holds a reference 
+	keeps the old resource, which is freed when they release it */
+static void invalidate(struct re_entry *e) {
+	rlog("'%s' changed; dropping it from the cache", e->name);
+	if(!e->refs) {
+		remove_entry(e);
+		return;
+	}
+	ht_delete(re_cache->cache[e->kind], e->name);
+	e->transient = 1;
+}
+
+struct view_search {
+	struct bitmap *owner;
+	int found;
+};
+
+static int find_view(const char *key, void *ve, void *data) {
+	struct view_search *vs = data;
+	struct re_entry *e = ve;
+	if(e->owner == vs->owner)
+		vs->found = 1;
+	return !vs->found;
+}
+
+/* Views point into their owner's pixels, so it can't be reloaded in place */
+static int has_views(struct bitmap *b) {
+	struct view_search vs;
+	vs.owner = b;
+	vs.found = 0;
+	ht_foreach(re_cache->entries, find_view, &vs);
+	return vs.found;
+}
+
+/* Returns 1 if whoever uses the bitmap sees the change without 
+	having to get it from the cache again */
+static int reload_bmp(struct re_entry *e) {
+	struct bitmap *old = e->res, *fresh, tmp;
+	struct re_stats *st = &re_cache->stats[RE_BITMAP];
+	
+	if(has_views(old)) {
+		invalidate(e);
+		return 0;
+	}
+	fresh = load_bmp(e->name);
+	if(!fresh) 
+		return 1; /* Probably half written; keep the old one */
+	
+	/* Swap the pixels, so that the old ones are freed with fresh */
+	tmp = *old;
+	old->w = fresh->w;
+	old->h = fresh->h;
+	old->stride = fresh->stride;
+	old->data = fresh->data;
+	fresh->w = tmp.w;
+	fresh->h = tmp.h;
+	fresh->stride = tmp.stride;
+	fresh->data = tmp.data;
+	bm_free(fresh);
+	bm_unclip(old);
+	drop_rle(old);
+	/* So that maps render their chunks again */
+	bm_touch(old);
+	
+	st->bytes -= e->size;
+	e->size = bmp_size(old);
+	st->bytes += e->size;
+	rlog("Reloaded '%s'", e->name);
+	return 1;
+}
+
+/* Returns 1 if the file was a bitmap that was reloaded in place */
+static int reload_file(const char *filename) {
+	struct re_entry *e;
+	int i, in_place = 0;
+	e = ht_get(re_cache->cache[RE_BITMAP], filename);
+	if(e && !e->transient)
+		in_place = reload_bmp(e);
+	for(i = RE_SOUND; i < RE_NUM_KINDS; i++) {
+		e = ht_get(re_cache->cache[i], filename);
+		if(e && !e->transient)
+			invalidate(e);
+	}
+	return in_place;
+}
+
+#ifdef __linux__
+struct watch_callback {
+	void (*changed)(const char *filename);
+};
+
+static int notify_changed(const char *filename, void *unused, void *data) {
+	struct watch_callback *cb = data;
+	/* Bitmaps reloaded in place need nothing more */
+	if(!reload_file(filename) && cb->changed)
+		cb->changed(filename);
+	return 1;
+}
+#endif
+
+int re_watch_update(void (*changed)(const char *filename)) {
+#ifdef __linux__
+	/* Aligned for the struct inotify_events in it */
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct watch_callback cb;
+	Hash_Tbl *files;
+	ssize_t len;
+	int n = 0;
+	
+	if(watch_fd < 0)
+		return 0;
+	
+	/* An editor may write a file several times when it saves it, 
+		so every file is only reloaded once */
+	files = ht_create(0);
+	while((len = read(watch_fd, u.buf, sizeof u.buf)) > 0) {
+		char *p = u.buf;
+		while(p < u.buf + len) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			char key[16], name[512];
+			const char *rel;
+			p += sizeof *ev + ev->len;
+			
+			snprintf(key, sizeof key, "%d", ev->wd);
+			rel = ht_get(watch_dirs, key);
+			if(!rel || !ev->len || ev->name[0] == '.')
+				continue;
+			snprintf(name, sizeof name, "%s%s", rel, ev->name);
+			if(ev->mask & IN_ISDIR) {
+				if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					strncat(name, "/", sizeof name - strlen(name) - 1);
+					watch_dir(name);
+				}
+			} else if(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+				if(!ht_get(files, name)) {
+					ht_put(files, name, files);
+					n++;
+				}
+			}
+		}
+	}
+	
+	if(n > 0) {
+		rlog("%d file(s) changed", n);
+		cb.changed = changed;
+		ht_foreach(files, notify_changed, &cb);
+	}
+	ht_free(files, NULL);
+	return n;
+#else
+	return 0;
+#endif
+}
@@ -15,6 +15,8 @@
 #include "utils.h"
 #include "game.h"
 #include "resources.h"
+#include "tileset.h"
+#include "map.h"
 #include "log.h"
 
 /* Globals *******************************************/
@@ -413,6 +415,82 @@ void states_initialize() {
 	}
 }
 
+int preload_state(const char *name) {
+	const char *list, *value;
+	char *buf, *file, *saveptr;
+	
+	if(!game_ini || !name || !ini_has_section(game_ini, name))
+		return 0;
+	
+	/* The resources listed explicitly */
+	list = ini_get(game_ini, name, "preload", NULL);
+	if(list) {
+		buf = my_strdup(list);
+		if(!buf)
+			return 0;
+		for(file = my_strtok_r(buf, ", \t", &saveptr); file; file = my_strtok_r(NULL, ", \t", &saveptr))
+			re_preload(file);
+		free(buf);
+	}
+	
+	/* Resources implied by the state's own settings */
+	value = ini_get(game_ini, name, "image", NULL);
+	if(value)
+		re_preload(value);
+	value = ini_get(game_ini, name, "map", NULL);
+	if(value)
+		re_preload_map(value);
+	
+	return 1;
+}
+
+struct tileset_search {
+	const char *filename;
+	int found;
+};
+
+static void find_tileset(const char *name, void *udata) {
+	struct tileset_search *ts = udata;
+	if(!strcmp(name, ts->filename))
+		ts->found = 1;
+}
+
+/* Tilesets are normally reloaded in place, but not if they have
+	views, in which case the map has to be loaded again to see them */
+static int map_uses_file(const char *map_file, const char *filename) {
+	struct tileset_search ts;
+	const char *data;
+	size_t len;
+	
+	data = re_get_data(map_file, &len);
+	if(!data)
+		return 0;
+	ts.filename = filename;
+	ts.found = 0;
+	map_tilesets(data, len, find_tileset, &ts);
+	re_free_data(data);
+	return ts.found;
+}
+
+int state_uses_file(const char *filename) {
+	struct game_state *s = current_state();
+	const char *value, *ext;
+	
+	if(!s || !s->name || !game_ini)
+		return 0;
+	
+	value = ini_get(game_ini, s->name, "script", NULL);
+	if(value && !strcmp(value, filename))
+		return 1;
+	value = ini_get(game_ini, s->name, "map", NULL);
+	if(value && (!strcmp(value, filename) || map_uses_file(value, filename)))
+		return 1;
+	
+	/* There's no telling which scripts the state's script imported */
+	ext = strrchr(filename, '.');
+	return ext && !my_stricmp(ext, ".lua") && ini_get(game_ini, s->name, "script", NULL);
+}
+
 int change_state(struct game_state *next) {
     
     if(next)
@@ -440,6 +518,12 @@ int change_state(struct game_state *next) {
         const char *show_cursor_local;
         int show;
 
+		/* Whatever was preloaded for this state should be ready before it starts, 
+			unless the state can cope with it arriving later */
+		preload_state(next->name);
+		if(atoi(ini_get(game_ini, next->name, "preload-wait", "1")))
+			re_preload_wait();
+
 		game_states[state_top]->styles = ht_create(0);
 
         show_cursor_local = ini_get(game_ini, next->name, "show-cursor", NULL);
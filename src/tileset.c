@@ -94,8 +94,19 @@ static struct bitmap *get_bitmap(const char *filename) {
 	}	
 	return bmp;
 #else
-    /* Just get the bitmap from the resources */
-    return re_get_bmp(filename);
+    /* Just get the bitmap from the resources, and keep it there */
+    struct bitmap *bmp = re_get_bmp(filename);
+	if(bmp)
+		re_retain(bmp);
+	return bmp;
+#endif
+}
+
+static void put_bitmap(struct bitmap *bmp) {
+#ifdef EDITOR
+	bm_free(bmp);
+#else
+	re_release(bmp);
 #endif
 }
 
@@ -105,7 +116,7 @@ static struct tileset *ts_make(const char *filename) {
 		struct tileset *t = malloc(sizeof *t);
 		if(!t) { 
 			rerror("malloc failed while creating tileset for %s", filename);
-			bm_free(bm);
+			put_bitmap(bm);
 			return NULL;
 		}
 		
@@ -131,11 +142,7 @@ static struct tileset *ts_make(const char *filename) {
 static void ts_free(struct tileset *t) {
 	if(!t) return;
 	free(t->name);
-#ifdef EDITOR
-	/* In the game engine itself, the bitmap is freed
-	through the resource cache */
-	bm_free(t->bm);
-#endif
+	put_bitmap(t->bm);
 	free(t);
 }
 
@@ -63,31 +63,56 @@ char *my_strtok_r(char *str, const char *delim, char **saveptr) {
 	return str;
 }
 
-/* Reads an entire file into a dynamically allocated memory buffer.
- * The returned buffer needs to be free()d afterwards
+/* Like my_readfile(), but also returns the length of the file in len.
+ * The buffer is still NUL terminated, so it can be used for text files.
  */
-char *my_readfile(const char *fname) {
+char *my_readblob(const char *fname, size_t *len) {
 	FILE *f;
-	long len,r;
+	long flen,r;
 	char *str;
 	
 	if(!(f = fopen(fname, "rb")))	
 		return NULL;
 	
 	fseek(f, 0, SEEK_END);
-	len = ftell(f);
+	flen = ftell(f);
 	rewind(f);
 	
-	if(!(str = malloc(len+2)))
+	if(!(str = malloc(flen+2))) {
+		fclose(f);
 		return NULL;	
-	r = fread(str, 1, len, f);
+	}
+	r = fread(str, 1, flen, f);
 	
-	if(r != len) {
+	if(r != flen) {
 		free(str);
+		fclose(f);
 		return NULL;
 	}
 	
 	fclose(f);	
-	str[len] = '\0';
+	str[flen] = '\0';
+	if(len)
+		*len = flen;
 	return str;
 }
+
+/* Reads an entire file into a dynamically allocated memory buffer.
+ * The returned buffer needs to be free()d afterwards
+ */
+char *my_readfile(const char *fname) {
+	return my_readblob(fname, NULL);
+}
+
+/* 64-bit FNV-1a; See http://www.isthe.com/chongo/tech/comp/fnv/
+ */
+unsigned long long my_fnv1a(const void *data, size_t len) {
+	const unsigned char *p = data;
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for(i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
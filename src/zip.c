@@ -0,0 +1,485 @@
+/*
+ZIP archives:
+Only the central directory at the end of the archive is read when it is
+opened. The local header in front of each file's data has a variable size,
+so it is only read when the file itself is.
+Nothing in a zip_file changes after zip_open(), and reads from an archive
+that isn't mapped open their own handle on it, so any number of threads
+may read from the same archive.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef USESDL
+#  include <SDL2/SDL.h>
+#endif
+
+#include <zlib.h>
+
+#include "zip.h"
+#include "archio.h"
+#include "hash.h"
+
+int zip_verbose = 0;
+
+#define ZIP_STORE   0
+#define ZIP_DEFLATE 8
+
+#define LOCAL_SIG   0x04034b50
+#define CENTRAL_SIG 0x02014b50
+#define END_SIG     0x06054b50
+
+#define LOCAL_SIZE   30
+#define CENTRAL_SIZE 46
+#define END_SIZE     22
+
+/* The end of central directory record is followed by a comment of up to 64K */
+#define MAX_END_SEARCH (END_SIZE + 0xFFFF)
+
+struct zip_entry {
+	const char *name;
+	unsigned long header;  /* Offset of the local header */
+	unsigned long length;  /* Number of bytes stored */
+	unsigned long size;    /* Size of the file when uncompressed */
+	int method;            /* ZIP_STORE or ZIP_DEFLATE */
+};
+
+struct zip_file {
+	char *name;
+	int nf;
+	struct zip_entry *dir;
+	char *names;    /* All the file names, one after the other */
+
+	/* Maps file names to their index in dir (plus one) */
+	Hash_Tbl *index;
+
+	/* The whole archive, if it could be mapped */
+	const char *map;
+	size_t map_len;
+
+	size_t file_len;
+};
+
+static unsigned get16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Reads len bytes at offset in the archive into buf.
+	f is an open handle on the archive if it isn't mapped. */
+static int read_at(struct zip_file *z, FILE *f, unsigned long offset, void *buf, size_t len) {
+	if(z->map) {
+		if(offset > z->map_len || len > z->map_len - offset)
+			return 0;
+		memcpy(buf, z->map + offset, len);
+		return 1;
+	}
+	return f && !fseek(f, offset, SEEK_SET) && fread(buf, 1, len, f) == len;
+}
+
+/* Finds the end of central directory record and reads it into end */
+static int read_end(struct zip_file *z, FILE *f, unsigned char *end) {
+	size_t n = z->file_len < MAX_END_SEARCH ? z->file_len : MAX_END_SEARCH, i;
+	unsigned char *tail;
+	int found = 0;
+
+	if(n < END_SIZE)
+		return 0;
+	tail = malloc(n);
+	if(!tail)
+		return 0;
+	if(read_at(z, f, z->file_len - n, tail, n)) {
+		for(i = n - END_SIZE + 1; i-- > 0;) {
+			if(get32(tail + i) == END_SIG) {
+				memcpy(end, tail + i, END_SIZE);
+				found = 1;
+				break;
+			}
+		}
+	}
+	free(tail);
+	return found;
+}
+
+static int read_dir(struct zip_file *z, FILE *f) {
+	unsigned char end[END_SIZE], *cd, *p;
+	unsigned long cd_size, cd_offset;
+	unsigned n, i;
+	size_t names_len = 0;
+	char *name;
+	unsigned size = 512;
+
+	if(!read_end(z, f, end)) {
+		if(zip_verbose) fprintf(stderr, "[zip_open] %s is not a ZIP archive\n", z->name);
+		return 0;
+	}
+	n = get16(end + 10);
+	cd_size = get32(end + 12);
+	cd_offset = get32(end + 16);
+	if(n == 0xFFFF || cd_offset == 0xFFFFFFFF) {
+		if(zip_verbose) fprintf(stderr, "[zip_open] ZIP64 archives are not supported\n");
+		return 0;
+	}
+
+	while(size < n * 2)
+		size <<= 1;
+	z->index = ht_create(size);
+	cd = malloc(cd_size + 1);
+	z->dir = malloc((n ? n : 1) * sizeof *z->dir);
+	if(!z->index || !cd || !z->dir || !read_at(z, f, cd_offset, cd, cd_size)) {
+		if(zip_verbose) fprintf(stderr, "[zip_open] couldn't read the central directory of %s\n", z->name);
+		free(cd);
+		return 0;
+	}
+
+	/* First pass: check the entries and add up the lengths of their names */
+	for(i = 0, p = cd; i < n; i++) {
+		if(p + CENTRAL_SIZE > cd + cd_size || get32(p) != CENTRAL_SIG) {
+			if(zip_verbose) fprintf(stderr, "[zip_open] bad central directory in %s\n", z->name);
+			free(cd);
+			return 0;
+		}
+		names_len += get16(p + 28) + 1;
+		p += CENTRAL_SIZE + get16(p + 28) + get16(p + 30) + get16(p + 32);
+	}
+	if(p > cd + cd_size) {
+		if(zip_verbose) fprintf(stderr, "[zip_open] bad central directory in %s\n", z->name);
+		free(cd);
+		return 0;
+	}
+
+	z->names = malloc(names_len + 1);
+	if(!z->names) {
+		free(cd);
+		return 0;
+	}
+
+	name = z->names;
+	for(i = 0, p = cd; i < n; p += CENTRAL_SIZE + get16(p + 28) + get16(p + 30) + get16(p + 32), i++) {
+		struct zip_entry *e = &z->dir[z->nf];
+		unsigned name_len = get16(p + 28), flags = get16(p + 8);
+
+		memcpy(name, p + CENTRAL_SIZE, name_len);
+		name[name_len] = '\0';
+
+		if(!name_len || name[name_len - 1] == '/')
+			continue; /* A directory */
+
+		e->name = name;
+		e->method = get16(p + 10);
+		e->length = get32(p + 20);
+		e->size = get32(p + 24);
+		e->header = get32(p + 42);
+
+		if(flags & 1) {
+			if(zip_verbose) fprintf(stderr, "[zip_open] %s is encrypted; skipping it\n", name);
+			continue;
+		}
+		if(e->method != ZIP_STORE && e->method != ZIP_DEFLATE) {
+			if(zip_verbose) fprintf(stderr, "[zip_open] %s uses unsupported compression method %d; skipping it\n", name, e->method);
+			continue;
+		}
+		if(e->length == 0xFFFFFFFF || e->size == 0xFFFFFFFF || e->header == 0xFFFFFFFF) {
+			if(zip_verbose) fprintf(stderr, "[zip_open] %s needs ZIP64; skipping it\n", name);
+			continue;
+		}
+		if(e->method == ZIP_STORE && e->length != e->size) {
+			if(zip_verbose) fprintf(stderr, "[zip_open] %s has a bad size; skipping it\n", name);
+			continue;
+		}
+
+		if(!ht_get(z->index, name)) { /* Duplicate name; keep the first one */
+			if(!ht_put(z->index, name, (void *)(intptr_t)(z->nf + 1))) {
+				free(cd);
+				return 0;
+			}
+		}
+		z->nf++;
+		name += name_len + 1;
+	}
+	free(cd);
+
+	if(zip_verbose > 1) printf("[zip_open] %d files in %s\n", z->nf, z->name);
+	return 1;
+}
+
+struct zip_file *zip_open(const char *name) {
+	struct zip_file *z;
+	FILE *f = NULL;
+
+	if(zip_verbose > 1) printf("[zip_open] opening file %s\n", name);
+
+	z = calloc(1, sizeof *z);
+	if(!z)
+		return NULL;
+	z->name = malloc(strlen(name) + 1);
+	if(!z->name) {
+		free(z);
+		return NULL;
+	}
+	strcpy(z->name, name);
+
+	z->map = archio_map(name, &z->map_len);
+	if(z->map) {
+		z->file_len = z->map_len;
+	} else {
+		if(zip_verbose > 1) printf("[zip_open] unable to map %s; reading it instead\n", name);
+		f = fopen(name, "rb");
+		if(!f || fseek(f, 0, SEEK_END) || ftell(f) < 0) {
+			if(zip_verbose) fprintf(stderr, "[zip_open] couldn't open %s: %s\n", name, strerror(errno));
+			if(f) fclose(f);
+			zip_close(z);
+			return NULL;
+		}
+		z->file_len = ftell(f);
+	}
+
+	if(!read_dir(z, f)) {
+		if(f) fclose(f);
+		zip_close(z);
+		return NULL;
+	}
+	if(f)
+		fclose(f);
+	return z;
+}
+
+void zip_close(struct zip_file *z) {
+	if(!z)
+		return;
+	archio_unmap(z->map, z->map_len);
+	if(z->index)
+		ht_free(z->index, NULL);
+	free(z->dir);
+	free(z->names);
+	free(z->name);
+	free(z);
+}
+
+int zip_num_files(struct zip_file *z) {
+	return z->nf;
+}
+
+const char *zip_nth_file(struct zip_file *z, int n) {
+	if(n < 0 || n >= z->nf)
+		return NULL;
+	return z->dir[n].name;
+}
+
+static struct zip_entry *get_file(struct zip_file *z, const char *filename) {
+	int i = (int)(intptr_t)ht_get(z->index, filename);
+	if(i)
+		return &z->dir[i - 1];
+	return NULL;
+}
+
+/* Returns the offset of the file's data, which follows its local header */
+static long data_offset(struct zip_file *z, FILE *f, struct zip_entry *e) {
+	unsigned char hdr[LOCAL_SIZE];
+	unsigned long offset;
+	if(!read_at(z, f, e->header, hdr, LOCAL_SIZE) || get32(hdr) != LOCAL_SIG) {
+		if(zip_verbose) fprintf(stderr, "[zip] bad local header for %s\n", e->name);
+		return -1;
+	}
+	offset = e->header + LOCAL_SIZE + get16(hdr + 26) + get16(hdr + 28);
+	if(offset > z->file_len || e->length > z->file_len - offset) {
+		if(zip_verbose) fprintf(stderr, "[zip] %s is outside the archive\n", e->name);
+		return -1;
+	}
+	return (long)offset;
+}
+
+/* Reads the file into out, which must have room for e->size bytes */
+static int read_entry(struct zip_file *z, struct zip_entry *e, char *out, const char *fun) {
+	FILE *f = NULL;
+	const char *stored;
+	char *tmp = NULL;
+	z_stream s;
+	long offset;
+	int rv = 0;
+
+	if(!z->map) {
+		f = fopen(z->name, "rb");
+		if(!f) {
+			if(zip_verbose) fprintf(stderr, "[%s] couldn't open %s: %s\n", fun, z->name, strerror(errno));
+			return 0;
+		}
+	}
+
+	offset = data_offset(z, f, e);
+	if(offset < 0)
+		goto done;
+
+	if(e->method == ZIP_STORE) {
+		rv = read_at(z, f, offset, out, e->length);
+		if(!rv && zip_verbose) fprintf(stderr, "[%s] couldn't read %s\n", fun, e->name);
+		goto done;
+	}
+
+	if(z->map) {
+		stored = z->map + offset;
+	} else {
+		tmp = malloc(e->length ? e->length : 1);
+		if(!tmp || !read_at(z, f, offset, tmp, e->length)) {
+			if(zip_verbose) fprintf(stderr, "[%s] couldn't read %s\n", fun, e->name);
+			goto done;
+		}
+		stored = tmp;
+	}
+
+	/* ZIP files hold raw deflate data, without zlib's header */
+	memset(&s, 0, sizeof s);
+	if(inflateInit2(&s, -MAX_WBITS) != Z_OK)
+		goto done;
+	s.next_in = (Bytef *)stored;
+	s.avail_in = e->length;
+	s.next_out = (Bytef *)out;
+	s.avail_out = e->size;
+	rv = inflate(&s, Z_FINISH) == Z_STREAM_END && s.total_out == e->size;
+	inflateEnd(&s);
+	if(!rv && zip_verbose)
+		fprintf(stderr, "[%s] couldn't decompress %s\n", fun, e->name);
+
+done:
+	free(tmp);
+	if(f)
+		fclose(f);
+	return rv;
+}
+
+char *zip_get_blob(struct zip_file *z, const char *filename, size_t *len) {
+	struct zip_entry *e;
+	char *blob;
+
+	if(zip_verbose > 1) printf("[zip_get_blob] retrieving file %s\n", filename);
+
+	e = get_file(z, filename);
+	if(!e) {
+		if(zip_verbose) fprintf(stderr, "[zip_get_blob] file not found: %s\n", filename);
+		return NULL;
+	}
+	blob = malloc(e->size ? e->size : 1);
+	if(!blob) {
+		if(zip_verbose) perror("[zip_get_blob] couldn't allocate memory for blob");
+		return NULL;
+	}
+	if(!read_entry(z, e, blob, "zip_get_blob")) {
+		free(blob);
+		return NULL;
+	}
+	if(len)
+		*len = e->size;
+	return blob;
+}
+
+char *zip_get_text(struct zip_file *z, const char *filename) {
+	struct zip_entry *e;
+	char *text;
+
+	if(zip_verbose > 1) printf("[zip_get_text] retrieving file %s\n", filename);
+
+	e = get_file(z, filename);
+	if(!e) {
+		if(zip_verbose) fprintf(stderr, "[zip_get_text] file not found: %s\n", filename);
+		return NULL;
+	}
+	text = malloc(e->size + 1);
+	if(!text) {
+		if(zip_verbose) perror("[zip_get_text] couldn't allocate memory for text");
+		return NULL;
+	}
+	if(!read_entry(z, e, text, "zip_get_text")) {
+		free(text);
+		return NULL;
+	}
+	text[e->size] = '\0';
+	return text;
+}
+
+const char *zip_get_view(struct zip_file *z, const char *filename, size_t *len) {
+	struct zip_entry *e;
+	long offset;
+
+	if(!z->map)
+		return NULL;
+
+	e = get_file(z, filename);
+	if(!e) {
+		if(zip_verbose) fprintf(stderr, "[zip_get_view] file not found: %s\n", filename);
+		return NULL;
+	}
+	if(e->method != ZIP_STORE) {
+		if(zip_verbose > 1) printf("[zip_get_view] %s is compressed\n", filename);
+		return NULL;
+	}
+	offset = data_offset(z, NULL, e);
+	if(offset < 0)
+		return NULL;
+	if(len)
+		*len = e->size;
+	return z->map + offset;
+}
+
+int zip_is_view(struct zip_file *z, const void *ptr) {
+	const char *c = ptr;
+	return z->map && c >= z->map && c < z->map + z->map_len;
+}
+
+#ifdef USESDL
+/* Opens a stream over the bytes of the file as they are stored in the archive */
+static SDL_RWops *open_stored(struct zip_file *z, struct zip_entry *e) {
+	SDL_RWops *rw;
+	FILE *f;
+	long offset;
+
+	if(z->map) {
+		offset = data_offset(z, NULL, e);
+		if(offset < 0)
+			return NULL;
+		return SDL_RWFromConstMem(z->map + offset, e->length);
+	}
+
+	f = fopen(z->name, "rb");
+	if(!f)
+		return NULL;
+	offset = data_offset(z, f, e);
+	fclose(f);
+	if(offset < 0)
+		return NULL;
+
+	rw = archio_open_range(z->name, offset, e->length);
+	if(!rw && zip_verbose)
+		fprintf(stderr, "[zip_get_rwops] unable to open %s in %s: %s\n", e->name, z->name, SDL_GetError());
+	return rw;
+}
+
+SDL_RWops *zip_get_rwops(struct zip_file *z, const char *filename) {
+	struct zip_entry *e;
+	SDL_RWops *rw, *zrw;
+
+	if(zip_verbose > 1) printf("[zip_get_rwops] retrieving file %s\n", filename);
+
+	e = get_file(z, filename);
+	if(!e) {
+		if(zip_verbose) fprintf(stderr, "[zip_get_rwops] file not found: %s\n", filename);
+		return NULL;
+	}
+
+	rw = open_stored(z, e);
+	if(!rw || e->method == ZIP_STORE)
+		return rw;
+
+	zrw = archio_open_inflate(rw, e->size, ARCHIO_RAW);
+	if(!zrw) {
+		if(zip_verbose) fprintf(stderr, "[zip_get_rwops] unable to decompress %s\n", filename);
+		SDL_RWclose(rw);
+	}
+	return zrw;
+}
+#endif
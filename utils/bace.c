@@ -10,6 +10,14 @@ files into my executable.
 #include <string.h>
 #include <unistd.h> 
 
+#ifdef WIN32
+#  include <lua.h>
+#  include <lauxlib.h>
+#else
+#  include <lua5.2/lua.h>
+#  include <lua5.2/lauxlib.h>
+#endif
+
 #define BUFFER_SIZE	1024
 
 int verbose = 0;
@@ -19,18 +27,54 @@ void usage(const char *name) {
 	fprintf(stderr, "where options:\n");
 	fprintf(stderr, " -o file     : Set the output file (default: stdout)\n");
 	fprintf(stderr, " -n name     : Name of the created variable.\n");
+	fprintf(stderr, " -l          : Compile the infile as a Lua script, and output the bytecode.\n");
 	fprintf(stderr, " -z          : Append a '\\0' to to the end of the generated array.\n");
 	fprintf(stderr, " -v          : Verbose mode. Each -v increase verbosity.\n");
 }
 
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	return fwrite(p, 1, sz, ud) != sz;
+}
+
+/* Compiles a Lua script into a temporary file, that is then encoded
+	instead of the script, so that it doesn't need to be parsed at runtime */
+FILE *compile_lua(const char *filename) {
+	FILE *out;
+	lua_State *L = luaL_newstate();
+	if(!L) {
+		fprintf(stderr, "error: unable to create Lua state\n");
+		return NULL;
+	}
+	if(luaL_loadfile(L, filename)) {
+		fprintf(stderr, "error: %s\n", lua_tostring(L, -1));
+		lua_close(L);
+		return NULL;
+	}
+	out = tmpfile();
+#if LUA_VERSION_NUM >= 503
+	if(!out || lua_dump(L, dump_writer, out, 0)) {
+#else
+	if(!out || lua_dump(L, dump_writer, out)) {
+#endif
+		fprintf(stderr, "error: unable to compile %s\n", filename);
+		if(out) 
+			fclose(out);
+		lua_close(L);
+		return NULL;
+	}
+	lua_close(L);
+	rewind(out);
+	return out;
+}
+
 int main(int argc, char *argv[]) {
 	FILE *infile = NULL;
 	size_t len = 0, sublen, i;
 	FILE *outfile = stdout;
 	char *infile_name = NULL, *var_name = NULL, *c;
 	char buffer[BUFFER_SIZE];
-	int opt, append_z = 0;
-	while((opt = getopt(argc, argv, "o:n:zv?")) != -1) {
+	int opt, append_z = 0, compile = 0;
+	while((opt = getopt(argc, argv, "o:n:lzv?")) != -1) {
 		switch(opt) {	
 			case 'o': {
 				outfile = fopen(optarg, "w");
@@ -42,6 +86,9 @@ int main(int argc, char *argv[]) {
 			case 'n': {
 				var_name = strdup(optarg);
 			} break;
+			case 'l' : {
+				compile = 1;
+			} break;
 			case 'z' : {
 				append_z = 1;
 			} break;
@@ -62,7 +109,10 @@ int main(int argc, char *argv[]) {
 	}
 	
 	infile_name = argv[optind];
-	infile = fopen(infile_name, "rb");
+	if(compile)
+		infile = compile_lua(infile_name);
+	else
+		infile = fopen(infile_name, "rb");
 	if(!infile) {
 		fprintf(stderr, "error: unable to open %s for input\n", infile_name);
 		return 1;
@@ -0,0 +1,163 @@
+/*
+Lubench measures the overhead of the ways a Lua binding can find the
+State Data it works on, so that the cost per call of the bindings in
+src/lua/ can be compared:
+
+ - global:   lua_getglobal() on a variable, as get_state_data() used to.
+ - registry: lua_rawgetp() on the registry, as get_state_data() does now.
+ - upvalue:  The State Data is an upvalue of the function, like STATE_DATA().
+
+Every binding does the same trivial work as G.pixel(x,y), so the
+difference between the times is the cost of finding the State Data.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef WIN32
+#  include <lua.h>
+#  include <lauxlib.h>
+#  include <lualib.h>
+#else
+#  include <lua5.2/lua.h>
+#  include <lua5.2/lauxlib.h>
+#  include <lua5.2/lualib.h>
+#endif
+
+#define STATE_DATA_VAR	"___state_data"
+
+struct bench_data {
+	int x, y;
+	unsigned int count;
+};
+
+static const char registry_key = 0;
+
+static void work(struct bench_data *sd, lua_State *L) {
+	sd->x = luaL_checknumber(L, 1);
+	sd->y = luaL_checknumber(L, 2);
+	sd->count++;
+}
+
+static int b_global(lua_State *L) {
+	struct bench_data *sd;
+	lua_getglobal(L, STATE_DATA_VAR);
+	if(!lua_islightuserdata(L, -1))
+		luaL_error(L, "Variable %s got tampered with.", STATE_DATA_VAR);
+	sd = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	work(sd, L);
+	return 0;
+}
+
+static int b_registry(lua_State *L) {
+	struct bench_data *sd;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &registry_key);
+	sd = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	work(sd, L);
+	return 0;
+}
+
+static int b_upvalue(lua_State *L) {
+	work(lua_touserdata(L, lua_upvalueindex(1)), L);
+	return 0;
+}
+
+static int b_none(lua_State *L) {
+	static struct bench_data sd;
+	work(&sd, L);
+	return 0;
+}
+
+static const char *bench_script =
+	"local f, n = ...\n"
+	"for i = 1, n do f(i, n) end\n";
+
+static double run(lua_State *L, const char *name, int n) {
+	clock_t start;
+	double ns;
+
+	if(luaL_loadstring(L, bench_script)) {
+		fprintf(stderr, "error: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	lua_getglobal(L, name);
+	lua_pushinteger(L, n);
+	start = clock();
+	if(lua_pcall(L, 2, 0, 0)) {
+		fprintf(stderr, "error: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / n;
+	return ns;
+}
+
+void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "where options:\n");
+	fprintf(stderr, " -n num      : Number of calls to time (default: 10000000).\n");
+	fprintf(stderr, " -g num      : Number of global variables to add, since scripts\n");
+	fprintf(stderr, "               usually have many (default: 100).\n");
+}
+
+int main(int argc, char *argv[]) {
+	static const char *names[] = {"none", "global", "registry", "upvalue"};
+	struct bench_data sd = {0, 0, 0};
+	int opt, n = 10000000, globals = 100, i;
+	double base;
+	lua_State *L;
+
+	while((opt = getopt(argc, argv, "n:g:?")) != -1) {
+		switch(opt) {
+			case 'n': n = atoi(optarg); break;
+			case 'g': globals = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(n <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	L = luaL_newstate();
+	if(!L) {
+		fprintf(stderr, "error: unable to create Lua state\n");
+		return 1;
+	}
+	luaL_openlibs(L);
+
+	for(i = 0; i < globals; i++) {
+		char name[32];
+		snprintf(name, sizeof name, "global_%d", i);
+		lua_pushinteger(L, i);
+		lua_setglobal(L, name);
+	}
+
+	lua_pushlightuserdata(L, &sd);
+	lua_setglobal(L, STATE_DATA_VAR);
+	lua_pushlightuserdata(L, &sd);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &registry_key);
+
+	lua_pushcfunction(L, b_none);
+	lua_setglobal(L, "none");
+	lua_pushcfunction(L, b_global);
+	lua_setglobal(L, "global");
+	lua_pushcfunction(L, b_registry);
+	lua_setglobal(L, "registry");
+	lua_pushlightuserdata(L, &sd);
+	lua_pushcclosure(L, b_upvalue, 1);
+	lua_setglobal(L, "upvalue");
+
+	printf("%d calls, %d globals\n", n, globals);
+	base = run(L, names[0], n);
+	printf("%-10s %6.1f ns/call\n", names[0], base);
+	for(i = 1; i < 4; i++) {
+		double ns = run(L, names[i], n);
+		printf("%-10s %6.1f ns/call (%+.1f ns to find the State Data)\n", names[i], ns, ns - base);
+	}
+
+	lua_close(L);
+	return 0;
+}
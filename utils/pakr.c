@@ -15,9 +15,21 @@ NOTE: On Windows, I use MinGW which provides
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+
+#ifdef WIN32
+#  include <lua.h>
+#  include <lauxlib.h>
+#else
+#  include <lua5.2/lua.h>
+#  include <lua5.2/lauxlib.h>
+#endif
 
 #include "pak.h"
 #include "utils.h"
+#include "hash.h"
+#include "tileset.h"
+#include "map.h"
 
 #ifdef WIN32
 #   define MKDIR(x,y) mkdir(x)
@@ -26,6 +38,13 @@ NOTE: On Windows, I use MinGW which provides
 #endif
 
 int inc_hidden = 0; /* Include hidden files in PAK. Default no */
+int conv_maps = 0; /* Convert maps to the binary format. Default no */
+int compile_lua = 0; /* Compile Lua scripts to bytecode. Default no */
+int sort_dir = 0; /* Sort the PAK's directory. Default no */
+int compress = 0; /* Compress files that benefit from it. Default no */
+int nthreads = 0; /* Threads to read and compress files with. Default: one per CPU */
+int align = 1; /* Alignment of the files in the PAK. Default none */
+const char *report = NULL; /* File to write the manifest report to */
 
 void usage(const char *name) {
 	fprintf(stderr, "Usage: %s [options] pakfile [files...]\n", name);
@@ -38,13 +57,306 @@ void usage(const char *name) {
 	fprintf(stderr, " -t          : Dumps the contents of a text file.\n");
 	fprintf(stderr, " -o file     : Set the output file for -d and -t.\n");
 	fprintf(stderr, " -h          : Include hidden files when using the -c option.\n");
+	fprintf(stderr, " -s          : Sort the pakfile's directory by name when using -c or -a.\n");
+	fprintf(stderr, " -m          : Convert JSON map files (*.map) to the binary\n");
+	fprintf(stderr, "               map format as they are added with -c or -a.\n");
+	fprintf(stderr, " -l          : Compile Lua scripts (*.lua) to bytecode as they are\n");
+	fprintf(stderr, "               added with -c or -a. The engine must use the same\n");
+	fprintf(stderr, "               version of Lua (" LUA_VERSION_MAJOR "." LUA_VERSION_MINOR ") on the same kind of CPU.\n");
+	fprintf(stderr, " -z          : Compress files added with -c or -a, except for\n");
+	fprintf(stderr, "               formats that are already compressed (PNG, JPG, OGG...)\n");
+	fprintf(stderr, " -j n        : Read and compress files on n threads (default: one per CPU).\n");
+	fprintf(stderr, " -A n        : Align files added with -c or -a to multiples of n bytes.\n");
+	fprintf(stderr, " -r file     : Write a report of the files added with -c or -a, their\n");
+	fprintf(stderr, "               sizes and the space saved to file (- for stdout).\n");
 	fprintf(stderr, " -v          : Verbose mode. Each -v increase verbosity.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "If no options are specified, the file is just listed.\n");
+	fprintf(stderr, "If files are also given, only names starting with them are listed.\n");
 	fprintf(stderr, "If the -o option is not used, files are written to stdout.\n");
+	fprintf(stderr, "Files with the same contents are only stored once.\n");
+}
+
+/* Converts a JSON map file to the binary map format.
+The name of the file is kept, since the engine recognises both formats. */
+char *convert_map(const char *filename, size_t *len) {
+	char *text, *blob = NULL;
+	FILE *tmp;
+	
+	text = my_readfile(filename);
+	if(!text) {
+		fprintf(stderr, "error: Unable to read %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	
+	tmp = tmpfile();
+	if(!tmp) {
+		fprintf(stderr, "error: Unable to create temporary file: %s\n", strerror(errno));
+		free(text);
+		return NULL;
+	}
+	
+	if(map_convert(text, tmp)) {
+		*len = ftell(tmp);
+		rewind(tmp);
+		blob = malloc(*len);
+		if(blob && fread(blob, 1, *len, tmp) != *len) {
+			free(blob);
+			blob = NULL;
+		}
+	} else {
+		fprintf(stderr, "error: Unable to convert map %s\n", filename);
+	}
+	
+	fclose(tmp);
+	free(text);
+	return blob;
+}
+
+struct dump_buffer {
+	char *data;
+	size_t len, size;
+};
+
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	struct dump_buffer *b = ud;
+	if(b->len + sz > b->size) {
+		char *data;
+		size_t size = b->size ? b->size * 2 : 4096;
+		while(size < b->len + sz)
+			size *= 2;
+		data = realloc(b->data, size);
+		if(!data)
+			return 1;
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, p, sz);
+	b->len += sz;
+	return 0;
+}
+
+/* Compiles a Lua script to bytecode, so that the engine doesn't have to
+parse it. The name of the file is kept, since the engine accepts both. */
+char *compile_script(const char *filename, size_t *len) {
+	struct dump_buffer b = {NULL, 0, 0};
+	lua_State *L;
+	char *text;
+	size_t text_len;
+	
+	text = my_readblob(filename, &text_len);
+	if(!text) {
+		fprintf(stderr, "error: Unable to read %s: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	
+	/* Each script gets its own interpreter, since they are compiled on several threads */
+	L = luaL_newstate();
+	if(!L) {
+		fprintf(stderr, "error: Unable to create Lua state\n");
+		free(text);
+		return NULL;
+	}
+	/* The chunk name is the one the engine would give it */
+	if(luaL_loadbuffer(L, text, text_len, filename)) {
+		fprintf(stderr, "error: %s\n", lua_tostring(L, -1));
+	} else {
+#if LUA_VERSION_NUM >= 503
+		if(lua_dump(L, dump_writer, &b, 0)) {
+#else
+		if(lua_dump(L, dump_writer, &b)) {
+#endif
+			fprintf(stderr, "error: Unable to compile %s\n", filename);
+			free(b.data);
+			b.data = NULL;
+		}
+	}
+	lua_close(L);
+	free(text);
+	*len = b.len;
+	return b.data;
+}
+
+/* Formats that are compressed already, and would not get any smaller */
+static const char *stored_exts[] = {
+	".png", ".jpg", ".jpeg", ".gif", ".ogg", ".mp3", ".zip", ".gz", NULL
+};
+
+static int compress_method(const char *filename) {
+	const char *ext = strrchr(filename, '.');
+	int i;
+	if(!compress)
+		return PAK_STORE;
+	if(ext) {
+		for(i = 0; stored_exts[i]; i++)
+			if(!my_stricmp(ext, stored_exts[i]))
+				return PAK_STORE;
+	}
+	return PAK_DEFLATE;
+}
+
+/* Files are read, converted and compressed on a pool of threads, 
+but always appended in the order they're listed, so the PAK comes out 
+the same regardless of the number of threads. */
+struct job {
+	char *filename;
+	char *blob;
+	size_t len;
+	struct pak_blob packed;
+	int done, ok;
+};
+
+static struct job *jobs = NULL;
+static int njobs = 0, next_job = 0, appended = 0;
+
+/* Workers may only run this far ahead of the appending, 
+so that only so many files are in memory at once */
+static int window = 1;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+void add_job(const char *filename) {
+	jobs = realloc(jobs, (njobs + 1) * sizeof *jobs);
+	if(!jobs) {
+		fprintf(stderr, "error: Out of memory\n");
+		exit(1);
+	}
+	jobs[njobs].filename = strdup(filename);
+	jobs[njobs].blob = NULL;
+	jobs[njobs].done = 0;
+	jobs[njobs].ok = 0;
+	njobs++;
+}
+
+static int compare_jobs(const void *a, const void *b) {
+	const struct job *x = a, *y = b;
+	return strcmp(x->filename, y->filename);
+}
+
+/* Reads the file and packs it, without touching the PAK */
+static int prepare_job(struct job *j) {
+	const char *ext = strrchr(j->filename, '.');
+	if(conv_maps && ext && !strcmp(ext, ".map"))
+		j->blob = convert_map(j->filename, &j->len);
+	else if(compile_lua && ext && !strcmp(ext, ".lua"))
+		j->blob = compile_script(j->filename, &j->len);
+	else {
+		j->blob = my_readblob(j->filename, &j->len);
+		if(!j->blob)
+			fprintf(stderr, "error: Unable to read %s: %s\n", j->filename, strerror(errno));
+	}
+	if(!j->blob)
+		return 0;
+	return pak_pack_blob(j->blob, j->len, compress_method(j->filename), &j->packed);
+}
+
+static void *worker(void *unused) {
+	struct job *j;
+	pthread_mutex_lock(&job_lock);
+	for(;;) {
+		while(next_job < njobs && next_job >= appended + window)
+			pthread_cond_wait(&job_cond, &job_lock);
+		if(next_job >= njobs)
+			break;
+		j = &jobs[next_job++];
+		pthread_mutex_unlock(&job_lock);
+		
+		j->ok = prepare_job(j);
+		
+		pthread_mutex_lock(&job_lock);
+		j->done = 1;
+		pthread_cond_broadcast(&job_cond);
+	}
+	pthread_mutex_unlock(&job_lock);
+	return NULL;
+}
+
+static void free_job(struct job *j) {
+	if(j->ok)
+		pak_free_blob(&j->packed);
+	free(j->blob);
+	j->blob = NULL;
+	free(j->filename);
+}
+
+static int cpu_count() {
+#ifdef WIN32
+	const char *n = getenv("NUMBER_OF_PROCESSORS");
+	return n ? atoi(n) : 1;
+#else
+	return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 }
 
-void pak_dir(DIR *dir, const char *base, struct pak_file *pak) {		
+/* Appends all the jobs to the PAK. Returns 0 if any of them failed. */
+int run_jobs(struct pak_file *pak) {
+	pthread_t *threads = NULL;
+	int i, n = 0, rv = 1, total = njobs;
+	
+	if(nthreads <= 0)
+		nthreads = cpu_count();
+	if(nthreads > njobs)
+		nthreads = njobs;
+	window = 4 * nthreads;
+	next_job = 0;
+	appended = 0;
+	
+	if(nthreads > 1) {
+		threads = calloc(nthreads, sizeof *threads);
+		for(n = 0; threads && n < nthreads; n++) {
+			if(pthread_create(&threads[n], NULL, worker, NULL)) {
+				fprintf(stderr, "error: Unable to create thread: %s\n", strerror(errno));
+				break;
+			}
+		}
+	}
+	
+	for(i = 0; i < njobs; i++) {
+		struct job *j = &jobs[i];
+		if(n > 0) {
+			pthread_mutex_lock(&job_lock);
+			while(!j->done)
+				pthread_cond_wait(&job_cond, &job_lock);
+			pthread_mutex_unlock(&job_lock);
+		} else {
+			next_job = i + 1;
+			j->ok = prepare_job(j);
+		}
+		
+		printf(" - %s\n", j->filename);
+		if(!j->ok || !pak_append_packed(pak, j->filename, &j->packed)) {
+			fprintf(stderr, "error: Unable to write %s to PAK file\n", j->filename);
+			rv = 0;
+		}
+		free_job(j);
+		
+		pthread_mutex_lock(&job_lock);
+		appended = i + 1;
+		if(!rv) {
+			/* Stop the workers from starting on anything else */
+			njobs = next_job;
+		}
+		pthread_cond_broadcast(&job_cond);
+		pthread_mutex_unlock(&job_lock);
+		if(!rv)
+			break;
+	}
+	
+	while(n > 0)
+		pthread_join(threads[--n], NULL);
+	free(threads);
+	
+	/* Clean up after an error */
+	for(i++; i < total; i++)
+		free_job(&jobs[i]);
+	free(jobs);
+	jobs = NULL;
+	njobs = 0;
+	return rv;
+}
+
+void pak_dir(DIR *dir, const char *base) {
 	struct dirent *dp = NULL;
 	while((dp = readdir(dir)) != NULL) {
 		struct stat statbuf;
@@ -69,18 +381,94 @@ void pak_dir(DIR *dir, const char *base, struct pak_file *pak) {
 			DIR *newdir;
 			newdir = opendir(path);
 			if(newdir) {
-				pak_dir(newdir, path, pak);
+				pak_dir(newdir, path);
+				closedir(newdir);
 			} else {
 				fprintf(stderr, "error: Unable to read directory %s: %s\n", path, strerror(errno));
 			}
-		} else {					
-			printf(" - %s\n", path);
-			if(!pak_append_file(pak, path)) {
-				fprintf(stderr, "error: Unable to write %s to PAK file\n", path);
-				break;
-			}
+		} else {
+			add_job(path);
+		}
+	}
+}
+
+static int compare_offsets(const void *a, const void *b) {
+	const struct pak_info *x = a, *y = b;
+	return x->offset - y->offset;
+}
+
+/* Lists the files added from index first onwards, and sums up
+how much space compression and deduplication saved */
+void write_report(struct pak_file *pak, int first, FILE *f) {
+	Hash_Tbl *seen = ht_create(0);
+	struct pak_info info, *unique;
+	int i, nunique = 0, end;
+	long total = 0, stored = 0, dups = 0, packed = 0, padding = 0;
+	char key[32];
+	
+	unique = calloc(pak_num_files(pak), sizeof *unique);
+	if(!seen || !unique) {
+		fprintf(stderr, "error: Out of memory\n");
+		return;
+	}
+	
+	fprintf(f, "%-40s %10s %10s %-7s %10s\n", "File", "Size", "Stored", "Method", "Offset");
+	for(i = first; i < pak_num_files(pak); i++) {
+		const char *name = pak_nth_file(pak, i), *dup;
+		pak_nth_info(pak, i, &info);
+		total += info.size;
+		
+		snprintf(key, sizeof key, "%d", info.offset);
+		dup = info.length ? ht_get(seen, key) : NULL;
+		if(dup) {
+			dups += info.length;
+			fprintf(f, "%-40s %10d %10s %-7s %10d (same as %s)\n", name, info.size, "-", "-", info.offset, dup);
+			continue;
 		}
+		ht_put(seen, key, (char *)name);
+		unique[nunique++] = info;
+		stored += info.length;
+		packed += info.size - info.length;
+		fprintf(f, "%-40s %10d %10d %-7s %10d\n", name, info.size, info.length, 
+			info.method == PAK_DEFLATE ? "deflate" : "store", info.offset);
+	}
+	
+	/* Padding is whatever lies between the files */
+	qsort(unique, nunique, sizeof *unique, compare_offsets);
+	for(i = 1; i < nunique; i++) {
+		end = unique[i - 1].offset + unique[i - 1].length;
+		if(unique[i].offset > end)
+			padding += unique[i].offset - end;
+	}
+	
+	fprintf(f, "\n%d files (%d unique), %ld bytes\n", pak_num_files(pak) - first, nunique, total);
+	fprintf(f, "Stored:               %10ld bytes\n", stored);
+	fprintf(f, "Saved by compression: %10ld bytes\n", packed);
+	fprintf(f, "Saved by duplicates:  %10ld bytes\n", dups);
+	fprintf(f, "Alignment padding:    %10ld bytes\n", padding);
+	
+	free(unique);
+	ht_free(seen, NULL);
+}
+
+/* Adds the queued files to the PAK and writes the report */
+int add_files(struct pak_file *p) {
+	int first = pak_num_files(p), rv;
+	FILE *f;
+	
+	pak_align(p, align);
+	rv = run_jobs(p);
+	
+	if(report) {
+		f = strcmp(report, "-") ? fopen(report, "w") : stdout;
+		if(f) {
+			write_report(p, first, f);
+			if(f != stdout)
+				fclose(f);
+		} else
+			fprintf(stderr, "error: Unable to write report to %s: %s\n", report, strerror(errno));
 	}
+	return rv;
 }
 
 int mkdir_tree(const char *path) {
@@ -124,7 +512,7 @@ int main(int argc, char *argv[]) {
 		LIST
 	} mode = LIST;
 	
-	while((opt = getopt(argc, argv, "c:ax:dto:v?")) != -1) {
+	while((opt = getopt(argc, argv, "c:ax:dto:hmlszj:A:r:v?")) != -1) {
 		switch(opt) {
 			case 'c' : {
 				mode = CREATE;
@@ -153,6 +541,31 @@ int main(int argc, char *argv[]) {
 			case 'h': {
 				inc_hidden = 1;
 			} break;
+			case 'm': {
+				conv_maps = 1;
+			} break;
+			case 'l': {
+				compile_lua = 1;
+			} break;
+			case 's': {
+				sort_dir = 1;
+			} break;
+			case 'z': {
+				compress = 1;
+			} break;
+			case 'j': {
+				nthreads = atoi(optarg);
+			} break;
+			case 'A': {
+				align = atoi(optarg);
+				if(align <= 0) {
+					fprintf(stderr, "error: invalid alignment %s\n", optarg);
+					return 1;
+				}
+			} break;
+			case 'r': {
+				report = optarg;
+			} break;
 			case 'v' : {
 				pak_verbose++;
 			} break;
@@ -184,10 +597,16 @@ int main(int argc, char *argv[]) {
 			
 			if(!chdir(dir_name)) {
 				dir = opendir(".");
-				pak_dir(dir, NULL, p);
+				pak_dir(dir, NULL);
+				closedir(dir);
+				/* readdir() order depends on the file system */
+				qsort(jobs, njobs, sizeof *jobs, compare_jobs);
+				add_files(p);
 			} else {				
 				fprintf(stderr, "error: Unable to read directory %s: %s\n", dir_name, strerror(errno));
 			}			
+			if(sort_dir)
+				pak_sort(p);
 			pak_close(p);			
 		} break;
 		case APPEND : {
@@ -205,14 +624,11 @@ int main(int argc, char *argv[]) {
 			} else
 				printf("Appending to %s:\n", pakfile);
 			
-			while(optind < argc) {
-				const char *filename = argv[optind++];
-				printf(" - %s\n", filename);
-				if(!pak_append_file(p, filename)) {
-					fprintf(stderr, "error: unable to append %s to PAK file\n", filename);
-					break;
-				}
-			}			
+			while(optind < argc)
+				add_job(argv[optind++]);
+			add_files(p);
+			if(sort_dir)
+				pak_sort(p);
 			pak_close(p);
 			
 		} break;
@@ -302,9 +718,17 @@ int main(int argc, char *argv[]) {
 				fprintf(stderr, "error: unable to read %s\n", pakfile);
 				return 1;
 			}
-			for(i = 0; i < pak_num_files(p); i++) {
-				printf("%3d: %s\n", i, pak_nth_file(p, i));
-			}		
+			if(optind < argc) {
+				while(optind < argc) {
+					const char *prefix = argv[optind++];
+					for(i = pak_next_file(p, prefix, 0); i >= 0; i = pak_next_file(p, prefix, i + 1))
+						printf("%3d: %s\n", i, pak_nth_file(p, i));
+				}
+			} else {
+				for(i = 0; i < pak_num_files(p); i++) {
+					printf("%3d: %s\n", i, pak_nth_file(p, i));
+				}		
+			}
 			pak_close(p);		
 		} break;
 	}